@@ -0,0 +1,169 @@
+//------------------------------------------------------------------------
+// Program:   accept-bench
+//
+// Purpose:   measure how many new connections per second a server can
+//            accept and answer. Every thread opens a fresh connection,
+//            sends one request, reads the reply until the server closes
+//            the socket and starts over.
+//
+// Syntax:    accept-bench host port threads seconds [path]
+//
+//               host    - name of a computer on which server is executing
+//               port    - protocol port number server is using
+//               threads - number of concurrent client threads
+//               seconds - how long to run
+//               path    - document to request, / by default
+//
+//------------------------------------------------------------------------
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdlib.h>
+
+struct sockaddr_in socketAddress;
+char request[1024];
+int requestLength;
+double stopTime;
+
+struct BenchThread {
+  pthread_t thread;
+  long connections;
+  long errors;
+  double latency; // sum of all connection latencies, in seconds
+};
+
+  double
+now()
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+  void
+printUsage()
+{
+  printf( "Usage: accept-bench <host> <port> <threads> <seconds> [path]\n");
+  printf( "\n");
+  printf( "Examples:\n");
+  printf( "\n");
+  printf( "          accept-bench localhost 14566 8 10\n");
+  printf( "          accept-bench localhost 14566 8 10 /simple.html\n");
+  printf( "\n");
+}
+
+// One request on a brand new connection. Returns 0 on success.
+  int
+oneConnection()
+{
+  int sock = socket( PF_INET, SOCK_STREAM, 0 );
+  if ( sock < 0 ) {
+    return -1;
+  }
+
+  if ( connect( sock, (struct sockaddr *)&socketAddress,
+	sizeof(socketAddress) ) < 0 ||
+       write( sock, request, requestLength ) != requestLength ) {
+    close( sock );
+    return -1;
+  }
+
+  char buf[4096];
+  int total = 0;
+  int n;
+  while ( ( n = read( sock, buf, sizeof(buf) ) ) > 0 ) {
+    total += n;
+  }
+
+  close( sock );
+  return ( n < 0 || total == 0 ) ? -1 : 0;
+}
+
+  void *
+benchThread( void * arg )
+{
+  BenchThread * t = (BenchThread *)arg;
+
+  double start;
+  while ( ( start = now() ) < stopTime ) {
+    if ( oneConnection() == 0 ) {
+      t->connections++;
+      t->latency += now() - start;
+    } else {
+      t->errors++;
+    }
+  }
+  return NULL;
+}
+
+  int
+main(int argc, char **argv)
+{
+  if ( argc < 5 ) {
+    printUsage();
+    exit(1);
+  }
+
+  char * host = argv[1];
+  int port = atoi(argv[2]);
+  int threads = atoi(argv[3]);
+  int seconds = atoi(argv[4]);
+  const char * path = argc > 5 ? argv[5] : "/";
+
+  if ( port <= 0 || threads <= 0 || seconds <= 0 ) {
+    printUsage();
+    exit(1);
+  }
+
+  memset( (char *)&socketAddress, 0, sizeof(socketAddress) );
+  socketAddress.sin_family = AF_INET;
+  socketAddress.sin_port = htons( (u_short)port );
+
+  struct hostent * ptrh = gethostbyname( host );
+  if ( ptrh == NULL ) {
+    fprintf( stderr, "invalid host: %s\n", host );
+    exit(1);
+  }
+  memcpy( &socketAddress.sin_addr, ptrh->h_addr, ptrh->h_length );
+
+  requestLength = snprintf( request, sizeof(request),
+      "GET %s HTTP/1.0\r\nHost: %s\r\n\r\n", path, host );
+
+  BenchThread * pool = (BenchThread *)calloc( threads, sizeof(BenchThread) );
+  double start = now();
+  stopTime = start + seconds;
+
+  for ( int i = 0; i < threads; i++ ) {
+    if ( pthread_create( &pool[i].thread, NULL, benchThread, &pool[i] ) != 0 ) {
+      perror( "pthread_create" );
+      exit(1);
+    }
+  }
+
+  long connections = 0;
+  long errors = 0;
+  double latency = 0;
+  for ( int i = 0; i < threads; i++ ) {
+    pthread_join( pool[i].thread, NULL );
+    connections += pool[i].connections;
+    errors += pool[i].errors;
+    latency += pool[i].latency;
+  }
+  double elapsed = now() - start;
+
+  printf( "%ld connections, %ld errors in %.2f s\n", connections, errors, elapsed );
+  printf( "%.0f connections/s, mean latency %.3f ms\n",
+      connections / elapsed,
+      connections ? latency / connections * 1000 : 0.0 );
+
+  free( pool );
+  exit(0);
+}
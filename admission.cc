@@ -0,0 +1,168 @@
+//------------------------------------------------------------------------
+// Admission control: which accepted connections get served.
+//
+// Two things turn a connection away with a 503 before any work is spent
+// on it. One is a limit on the connections being served at once, which
+// keeps -t and -f from starting a thread or process for everybody in a
+// spike. The other sheds by queueing delay, after CoDel: a connection's
+// time in the queues is how long ago the kernel got its last segment,
+// usually the handshake's ACK or the request itself. A short burst is
+// fine, but once the delay has stayed above target for a whole interval
+// there is a standing queue, and every connection that waited longer
+// than target is rejected until one comes through in time again. That
+// drains the queue at the cost of a write per connection, and nobody
+// waits much more than an interval plus the time to be served.
+//
+// admissionEnter() is called where a connection leaves its last queue:
+// right after accept(), or for -p when a pool thread takes it, so the
+// pool's queue counts too. connectionClose() calls admissionLeave().
+//------------------------------------------------------------------------
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "admission.h"
+#include "linger.h"
+#include "log.h"
+#include "metrics.h"
+
+AdmissionConfig admissionConfig = { -1, 5, 100 };
+
+static const char rejection[] =
+  "HTTP/1.1 503 Service Unavailable\r\nServer: CS 252 lab5\r\nRetry-After: 1\r\n"
+  "Content-Length: 0\r\nConnection: close\r\n\r\n";
+
+static int inFlight;
+static long long overLimit;  // rejected by the limit, or for want of a thread or process
+static long long overTarget; // shed for their queueing delay
+
+// The CoDel state, changed under the mutex. firstAbove is read without
+// it so that while delays are short nobody takes the lock.
+static pthread_mutex_t admissionMutex = PTHREAD_MUTEX_INITIALIZER;
+static long long firstAbove; // when the delay will have been above target for an interval, 0 if it isn't
+static int shedding;
+static long long shedUntil;  // when shedding last stopped
+
+static long long nowMs() {
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+// Fill in the default limit: a quarter of the open file limit, as a
+// connection may hold a socket, a file and a script's two pipes. This
+// goes for -t and -f as well, past it accept() would start failing.
+void admissionInit() {
+  if ( admissionConfig.maxConnections >= 0 ) {
+    return;
+  }
+  struct rlimit limit;
+  if ( getrlimit( RLIMIT_NOFILE, &limit ) != 0 ||
+       limit.rlim_cur == RLIM_INFINITY ) {
+    admissionConfig.maxConnections = 1024;
+  } else {
+    admissionConfig.maxConnections = limit.rlim_cur / 4 > 0 ? limit.rlim_cur / 4 : 1;
+  }
+}
+
+// Milliseconds since the kernel got the last segment of a connection
+// nothing has been read from yet, -1 if it can't tell
+static long long queued( int socket ) {
+  struct tcp_info info;
+  socklen_t length = sizeof(info);
+  if ( getsockopt( socket, IPPROTO_TCP, TCP_INFO, &info, &length ) != 0 ) {
+    return -1;
+  }
+  return info.tcpi_last_ack_recv;
+}
+
+// Whether a connection that waited delay milliseconds is to be shed
+static int overdue( long long delay ) {
+  if ( delay < admissionConfig.target &&
+       __atomic_load_n( &firstAbove, __ATOMIC_RELAXED ) == 0 ) {
+    return 0;
+  }
+
+  pthread_mutex_lock( &admissionMutex );
+  long long now = nowMs();
+  if ( delay < admissionConfig.target ) {
+    // the queue has drained
+    __atomic_store_n( &firstAbove, 0, __ATOMIC_RELAXED );
+    if ( shedding ) {
+      shedding = 0;
+      shedUntil = now;
+      LOG( LOG_DEBUG, "queueing delay back under %d ms", admissionConfig.target );
+    }
+  } else if ( firstAbove == 0 ) {
+    __atomic_store_n( &firstAbove, now + admissionConfig.interval, __ATOMIC_RELAXED );
+  } else if ( !shedding && now >= firstAbove ) {
+    // under steady overload this starts and stops every interval or
+    // so, only a new bout of it is worth a warning
+    shedding = 1;
+    if ( shedUntil == 0 || now - shedUntil > 10000 ) {
+      LOG( LOG_WARN, "queueing delay above %d ms for %d ms, shedding connections",
+	  admissionConfig.target, admissionConfig.interval );
+    }
+  }
+  int shed = shedding;
+  pthread_mutex_unlock( &admissionMutex );
+  return shed;
+}
+
+// Send the 503 and close. The socket may be blocking, but a new
+// connection's send buffer always has room for it. What the client
+// sent is read first, as closing with unread data would reset the
+// connection and might take the response with it.
+static void reject( int socket, long long * counter ) {
+  ssize_t n = send( socket, rejection, sizeof(rejection) - 1, MSG_DONTWAIT | MSG_NOSIGNAL );
+  metricsResponse( 503, n > 0 ? n : 0 );
+  __atomic_fetch_add( counter, 1, __ATOMIC_RELAXED );
+  lingerClose( socket );
+}
+
+// Decide on a connection that is about to be served. Returns 1 if it
+// may be, and counts it until admissionLeave(). Otherwise it has been
+// sent a 503 and closed, and 0 is returned.
+int admissionEnter( int socket ) {
+  if ( admissionConfig.interval > 0 ) {
+    long long delay = queued( socket );
+    if ( delay >= 0 && overdue( delay ) ) {
+      LOG( LOG_DEBUG, "shedding a connection that waited %lld ms", delay );
+      reject( socket, &overTarget );
+      return 0;
+    }
+  }
+
+  int n = __atomic_add_fetch( &inFlight, 1, __ATOMIC_RELAXED );
+  if ( admissionConfig.maxConnections > 0 && n > admissionConfig.maxConnections ) {
+    __atomic_sub_fetch( &inFlight, 1, __ATOMIC_RELAXED );
+    LOG( LOG_DEBUG, "%d connections already, rejecting", admissionConfig.maxConnections );
+    reject( socket, &overLimit );
+    return 0;
+  }
+  return 1;
+}
+
+void admissionLeave() {
+  __atomic_sub_fetch( &inFlight, 1, __ATOMIC_RELAXED );
+}
+
+// Turn away a connection that was let in but has no thread or process
+// to serve it. The caller has already called admissionLeave().
+void admissionReject( int socket ) {
+  reject( socket, &overLimit );
+}
+
+// Whether connections are being shed, and how many were turned away
+// for either reason
+void admissionCounts( int * shed, long long * limited, long long * late ) {
+  *shed = __atomic_load_n( &shedding, __ATOMIC_RELAXED );
+  *limited = __atomic_load_n( &overLimit, __ATOMIC_RELAXED );
+  *late = __atomic_load_n( &overTarget, __ATOMIC_RELAXED );
+}
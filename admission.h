@@ -0,0 +1,19 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+// Tunables of the admission control, see admissionInit()
+struct AdmissionConfig {
+  int maxConnections; // served at once, 0 for no limit, -1 for the mode's default
+  int target;         // milliseconds of queueing that are fine
+  int interval;       // milliseconds queueing may stay above target, 0 never sheds
+};
+
+extern AdmissionConfig admissionConfig;
+
+void admissionInit();
+int admissionEnter( int socket );
+void admissionLeave();
+void admissionReject( int socket );
+void admissionCounts( int * shed, long long * limited, long long * late );
+
+#endif
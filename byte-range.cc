@@ -0,0 +1,120 @@
+//------------------------------------------------------------------------
+// Range request header parsing.
+//
+// "Range: bytes=0-499, 1000-, -200" becomes a list of byte ranges of the
+// file, clipped to its size, sorted and with overlapping or adjacent
+// ranges merged, so a client can't make the server send the same bytes
+// over and over.
+//------------------------------------------------------------------------
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "byte-range.h"
+
+static int compareRanges( const void * a, const void * b ) {
+  off_t first = ((const ByteRange *)a)->first;
+  off_t second = ((const ByteRange *)b)->first;
+  return first < second ? -1 : first > second;
+}
+
+// Digits from *p up to end, -1 if there are none
+static off_t number( const char ** p, const char * end ) {
+  off_t value = -1;
+  while ( *p < end && **p >= '0' && **p <= '9' ) {
+    off_t digit = **p - '0';
+    if ( value > ( ( (off_t)1 << 62 ) - digit ) / 10 ) {
+      return -1;
+    }
+    value = ( value < 0 ? 0 : value * 10 ) + digit;
+    (*p)++;
+  }
+  return value;
+}
+
+// Parse the value of a Range header for a file of size bytes. Returns
+// how many ranges were stored, 0 if none of them can be satisfied (416)
+// and -1 if the header is to be ignored and the whole file sent.
+int parseRanges( const StringView * header, off_t size, ByteRange * ranges ) {
+  const char * p = header->data;
+  const char * end = header->data + header->length;
+  int count = 0;
+  int specs = 0;
+
+  if ( end - p < 6 || strncasecmp( p, "bytes=", 6 ) ) {
+    return -1;
+  }
+  p += 6;
+
+  while ( p < end ) {
+    while ( p < end && ( *p == ' ' || *p == '\t' ) ) {
+      p++;
+    }
+    if ( p < end && *p == ',' ) {
+      p++;
+      continue;
+    }
+
+    off_t first = number( &p, end );
+    if ( p == end || *p != '-' ) {
+      return -1;
+    }
+    p++;
+    off_t last = number( &p, end );
+
+    while ( p < end && ( *p == ' ' || *p == '\t' ) ) {
+      p++;
+    }
+    if ( p < end && *p != ',' ) {
+      return -1;
+    }
+    specs++;
+
+    if ( first < 0 ) {
+      // -N, the last N bytes
+      if ( last < 0 ) {
+	return -1;
+      }
+      if ( last == 0 || size == 0 ) {
+	continue;
+      }
+      first = last < size ? size - last : 0;
+      last = size - 1;
+    } else {
+      if ( last >= 0 && last < first ) {
+	return -1;
+      }
+      if ( first >= size ) {
+	continue;
+      }
+      if ( last < 0 || last >= size ) {
+	last = size - 1;
+      }
+    }
+
+    if ( count == MAX_RANGES ) {
+      return -1;
+    }
+    ranges[count].first = first;
+    ranges[count].last = last;
+    count++;
+  }
+
+  if ( specs == 0 ) {
+    return -1;
+  }
+
+  qsort( ranges, count, sizeof(ByteRange), compareRanges );
+  int merged = 0;
+  for ( int i = 0; i < count; i++ ) {
+    if ( merged > 0 && ranges[i].first <= ranges[merged - 1].last + 1 ) {
+      if ( ranges[i].last > ranges[merged - 1].last ) {
+	ranges[merged - 1].last = ranges[i].last;
+      }
+    } else {
+      ranges[merged++] = ranges[i];
+    }
+  }
+  return merged;
+}
@@ -0,0 +1,19 @@
+#ifndef BYTE_RANGE_H
+#define BYTE_RANGE_H
+
+#include <sys/types.h>
+
+#include "http-parser.h"
+
+// more ranges than this in one request and the whole file is sent
+#define MAX_RANGES 16
+
+// bytes first to last of a file, both included
+struct ByteRange {
+  off_t first;
+  off_t last;
+};
+
+int parseRanges( const StringView * header, off_t size, ByteRange * ranges );
+
+#endif
@@ -0,0 +1,218 @@
+//------------------------------------------------------------------------
+// CGI/1.1 environment (RFC 3875).
+//
+// Everything a script is told about its request goes into its
+// environment: the request line, the script's name and the path after
+// it, the addresses of both ends, and every request header as HTTP_*.
+// It is built into a CgiEnv by the thread serving the request and
+// handed to execve(), so the server's own environment is only ever
+// read. Threads serving scripts side by side don't race on environ, and
+// the forked child doesn't call setenv(), which may malloc() in a copy
+// of a threaded process whose heap lock another thread held.
+//------------------------------------------------------------------------
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+
+#include "cgi-env.h"
+#include "log.h"
+
+// Headers that are never passed on. The body's are CONTENT_TYPE and
+// CONTENT_LENGTH already, credentials stay with the server, and Proxy
+// would become HTTP_PROXY, which HTTP libraries take for their proxy.
+static const char * hidden[] = {
+  "Content-Type", "Content-Length", "Authorization", "Proxy-Authorization", "Proxy",
+  NULL
+};
+
+// Append NAME=value, value being length bytes. Returns -1 if it doesn't
+// fit.
+static int append( CgiEnv * e, const char * name, const char * value, int length ) {
+  int nameLength = strlen( name );
+  if ( e->count == CGI_ENV_MAX || e->length + nameLength + length + 2 > CGI_ENV_SIZE ) {
+    LOG( LOG_DEBUG, "no room for %s in the CGI environment", name );
+    return -1;
+  }
+
+  char * p = e->data + e->length;
+  memcpy( p, name, nameLength );
+  p[nameLength] = '=';
+  memcpy( p + nameLength + 1, value, length );
+  p[nameLength + 1 + length] = '\0';
+  e->length += nameLength + length + 2;
+  e->count++;
+  return 0;
+}
+
+// Start an environment with what every script gets
+void cgiEnvInit( CgiEnv * e ) {
+  e->length = 0;
+  e->count = 0;
+
+  const char * path = getenv( "PATH" );
+  cgiEnvAdd( e, "PATH", path != NULL ? path : "/usr/local/bin:/usr/bin:/bin" );
+  cgiEnvAdd( e, "GATEWAY_INTERFACE", "CGI/1.1" );
+  cgiEnvAdd( e, "SERVER_SOFTWARE", "CS 252 lab5" );
+}
+
+int cgiEnvAdd( CgiEnv * e, const char * name, const char * value ) {
+  return append( e, name, value, strlen( value ) );
+}
+
+// A view of length -1, such as a missing query, is added empty
+int cgiEnvAddView( CgiEnv * e, const char * name, const StringView * value ) {
+  return append( e, name, value->data, value->length > 0 ? value->length : 0 );
+}
+
+static int formatAddress( const struct sockaddr_storage * address, char * host, int hostSize,
+    char * port, int portSize ) {
+  const void * ip;
+  int number;
+  if ( address->ss_family == AF_INET6 ) {
+    ip = &((const struct sockaddr_in6 *)address)->sin6_addr;
+    number = ntohs( ((const struct sockaddr_in6 *)address)->sin6_port );
+  } else if ( address->ss_family == AF_INET ) {
+    ip = &((const struct sockaddr_in *)address)->sin_addr;
+    number = ntohs( ((const struct sockaddr_in *)address)->sin_port );
+  } else {
+    return 0;
+  }
+  snprintf( port, portSize, "%d", number );
+  return inet_ntop( address->ss_family, ip, host, hostSize ) != NULL;
+}
+
+// REMOTE_ADDR and REMOTE_PORT of the client, SERVER_ADDR and SERVER_PORT
+// it connected to, and SERVER_NAME from the Host header, or the address
+// if there is none
+void cgiEnvSocket( CgiEnv * e, int socket, const HttpRequest * r ) {
+  struct sockaddr_storage address;
+  socklen_t length;
+  char host[INET6_ADDRSTRLEN];
+  char port[8];
+
+  length = sizeof(address);
+  if ( getpeername( socket, (struct sockaddr *)&address, &length ) == 0 &&
+       formatAddress( &address, host, sizeof(host), port, sizeof(port) ) ) {
+    cgiEnvAdd( e, "REMOTE_ADDR", host );
+    cgiEnvAdd( e, "REMOTE_PORT", port );
+  }
+
+  length = sizeof(address);
+  int local = getsockname( socket, (struct sockaddr *)&address, &length ) == 0 &&
+    formatAddress( &address, host, sizeof(host), port, sizeof(port) );
+  if ( local ) {
+    cgiEnvAdd( e, "SERVER_ADDR", host );
+    cgiEnvAdd( e, "SERVER_PORT", port );
+  }
+
+  const StringView * hostHeader = httpFindHeader( r, "Host" );
+  if ( hostHeader != NULL && hostHeader->length > 0 ) {
+    // without the port, which may follow an [IPv6 address]
+    StringView name = *hostHeader;
+    const char * bracket = (const char *)memchr( name.data, ']', name.length );
+    const char * colon = (const char *)memchr( bracket != NULL ? bracket : name.data, ':',
+	name.data + name.length - ( bracket != NULL ? bracket : name.data ) );
+    if ( colon != NULL ) {
+      name.length = colon - name.data;
+    }
+    cgiEnvAddView( e, "SERVER_NAME", &name );
+  } else if ( local ) {
+    cgiEnvAdd( e, "SERVER_NAME", host );
+  }
+}
+
+// Whether header i goes into the environment: it isn't hidden, isn't a
+// repeat of an earlier one, and its name has nothing but letters, digits
+// and dashes, so two headers can't end up as the same variable
+static int passedOn( const HttpRequest * r, int i ) {
+  const StringView * name = &r->headers[i].name;
+  for ( int j = 0; hidden[j] != NULL; j++ ) {
+    if ( viewCaseEquals( name, hidden[j] ) ) {
+      return 0;
+    }
+  }
+  for ( int j = 0; j < name->length; j++ ) {
+    char ch = name->data[j];
+    if ( !( ( ch >= 'a' && ch <= 'z' ) || ( ch >= 'A' && ch <= 'Z' ) ||
+	    ( ch >= '0' && ch <= '9' ) || ch == '-' ) ) {
+      return 0;
+    }
+  }
+  for ( int j = 0; j < i; j++ ) {
+    const StringView * other = &r->headers[j].name;
+    if ( other->length == name->length &&
+	 !strncasecmp( other->data, name->data, name->length ) ) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Every request header as HTTP_NAME, the name upper-cased with dashes
+// turned into underscores. The values of a repeated header are joined
+// with ", ".
+void cgiEnvHeaders( CgiEnv * e, const HttpRequest * r ) {
+  for ( int i = 0; i < r->headerCount; i++ ) {
+    if ( !passedOn( r, i ) ) {
+      continue;
+    }
+    const StringView * name = &r->headers[i].name;
+
+    int length = 5 + name->length + 1 + 1;
+    for ( int j = i; j < r->headerCount; j++ ) {
+      const StringView * other = &r->headers[j].name;
+      if ( other->length == name->length &&
+	   !strncasecmp( other->data, name->data, name->length ) ) {
+	length += ( j > i ? 2 : 0 ) + r->headers[j].value.length;
+      }
+    }
+    if ( e->count == CGI_ENV_MAX || e->length + length > CGI_ENV_SIZE ) {
+      LOG( LOG_DEBUG, "no room for header %.*s in the CGI environment",
+	  name->length, name->data );
+      continue;
+    }
+
+    char * p = e->data + e->length;
+    memcpy( p, "HTTP_", 5 );
+    p += 5;
+    for ( int j = 0; j < name->length; j++ ) {
+      char ch = name->data[j];
+      *p++ = ch == '-' ? '_' : ( ch >= 'a' && ch <= 'z' ) ? ch - 'a' + 'A' : ch;
+    }
+    *p++ = '=';
+    for ( int j = i; j < r->headerCount; j++ ) {
+      const StringView * other = &r->headers[j].name;
+      if ( other->length == name->length &&
+	   !strncasecmp( other->data, name->data, name->length ) ) {
+	if ( j > i ) {
+	  memcpy( p, ", ", 2 );
+	  p += 2;
+	}
+	memcpy( p, r->headers[j].value.data, r->headers[j].value.length );
+	p += r->headers[j].value.length;
+      }
+    }
+    *p = '\0';
+    e->length += length;
+    e->count++;
+  }
+}
+
+// Point vector at the NAME=value strings of an environment block of
+// length bytes, followed by a NULL, as execve() wants it. Only touches
+// the stack, so it is safe in a child forked from a threaded process.
+int cgiEnvVector( const char * data, int length, char ** vector, int size ) {
+  int count = 0;
+  const char * p = data;
+  while ( p < data + length && count < size - 1 ) {
+    vector[count++] = (char *)p;
+    p += strlen( p ) + 1;
+  }
+  vector[count] = NULL;
+  return count;
+}
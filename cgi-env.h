@@ -0,0 +1,26 @@
+#ifndef CGI_ENV_H
+#define CGI_ENV_H
+
+#include "http-parser.h"
+
+#define CGI_ENV_SIZE ( 16 * 1024 )
+#define CGI_ENV_MAX ( MAX_HEADERS + 32 )
+
+// The CGI/1.1 environment of one script, built by the server thread for
+// the request at hand. The NAME=value strings follow each other in one
+// block, which goes to a worker as it is and becomes execve()'s envp
+// without a single malloc() in the forked child.
+struct CgiEnv {
+  char data[CGI_ENV_SIZE];
+  int length;
+  int count;
+};
+
+void cgiEnvInit( CgiEnv * e );
+int cgiEnvAdd( CgiEnv * e, const char * name, const char * value );
+int cgiEnvAddView( CgiEnv * e, const char * name, const StringView * value );
+void cgiEnvSocket( CgiEnv * e, int socket, const HttpRequest * r );
+void cgiEnvHeaders( CgiEnv * e, const HttpRequest * r );
+int cgiEnvVector( const char * data, int length, char ** vector, int size );
+
+#endif
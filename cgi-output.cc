@@ -0,0 +1,390 @@
+//------------------------------------------------------------------------
+// CGI script output.
+//
+// A script writes a CGI header (Content-type, maybe Status or Location)
+// and then the document to a pipe. The header is turned into an HTTP
+// response header, and the document passed on as it comes: in chunks if
+// the connection is to stay open, as is if the script sent its own
+// Content-Length, and otherwise ended by closing the connection. A
+// script whose name starts with nph- writes the whole response itself
+// and gets nothing added.
+//
+// All of it goes through one buffer that is read into from the pipe,
+// framed in place and sent before the next read, so a script writing
+// faster than the client reads is held back by its full pipe.
+//
+// A text document goes out gzipped to a client that takes it, unless
+// the script encoded it or gave its length itself. It is read into a
+// buffer of its own and compressed into the one that is sent, with a
+// flush after every read so the client still gets what the script has
+// written so far.
+//------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <zlib.h>
+
+#include "cgi-output.h"
+#include "content-encoding.h"
+
+#define OUTPUT_BUFFER ( 16 * 1024 )
+#define CHUNK_HEAD 10   // "%08x\r\n", the size padded so data can be read in after it
+#define CHUNK_TAIL 2    // "\r\n"
+#define HEADER_EXTRA 256
+#define CHUNK_END 5     // "0\r\n\r\n"
+#define FLUSH_MARK 6    // what a sync flush may add to the compressed data
+
+enum {
+  OUTPUT_HEADER,  // reading the script's header
+  OUTPUT_BODY,    // passing on the document
+  OUTPUT_END      // the script is done, what is buffered is all that is left
+};
+
+// Set up for the output of a script. keepAlive is whether the connection
+// may stay open, chunked whether the client takes chunked responses,
+// gzip whether it takes gzip, and nph whether the script writes its own
+// response header. Returns -1 if there is no memory for it.
+int cgiOutputStart( CgiOutput * o, int keepAlive, int chunked, int gzip, int nph ) {
+  o->zip = NULL;
+  o->raw = NULL;
+  o->buffer = (char *)malloc( OUTPUT_BUFFER );
+  if ( o->buffer == NULL ) {
+    return -1;
+  }
+  o->size = OUTPUT_BUFFER;
+  o->start = 0;
+  o->end = 0;
+  o->state = nph ? OUTPUT_BODY : OUTPUT_HEADER;
+  o->chunked = chunked && keepAlive && !nph;
+  o->keepAlive = keepAlive && !nph;
+  o->status = nph ? 200 : 0;
+  o->bodiless = 0;
+  o->gzip = gzip && !nph;
+  o->rawSize = 0;
+  o->sent = 0;
+  return 0;
+}
+
+// Length of the header the script wrote up to and including the empty
+// line, -1 if it isn't all there yet
+static int headerEnd( const char * p, int length ) {
+  for ( int i = 0; i < length; i++ ) {
+    if ( p[i] != '\n' ) {
+      continue;
+    }
+    int j = i + 1;
+    if ( j < length && p[j] == '\r' ) {
+      j++;
+    }
+    if ( j < length && p[j] == '\n' ) {
+      return j + 1;
+    }
+  }
+  return -1;
+}
+
+static int fieldIs( const char * line, int length, const char * name ) {
+  int n = strlen( name );
+  return length > n && line[n] == ':' && !strncasecmp( line, name, n );
+}
+
+// Get ready to compress the document. Returns -1 if it can't be, and
+// the document goes out as it is.
+static int startZip( CgiOutput * o ) {
+  o->zip = (z_stream *)calloc( 1, sizeof(z_stream) );
+  o->raw = (char *)malloc( OUTPUT_BUFFER );
+  // 16 more window bits ask for a gzip header instead of a zlib one
+  if ( o->zip == NULL || o->raw == NULL ||
+       deflateInit2( o->zip, encodingConfig.level, Z_DEFLATED, 15 + 16, 8,
+	 Z_DEFAULT_STRATEGY ) != Z_OK ) {
+    free( o->zip );
+    free( o->raw );
+    o->zip = NULL;
+    o->raw = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+// Compress n bytes of the document, the last ones if finish, into space
+// bytes at out. Every call flushes, so the client gets what the script
+// has written so far. Returns the compressed length, -1 if it doesn't
+// fit.
+static int gzipSome( CgiOutput * o, const char * in, int n, int finish,
+    char * out, int space ) {
+  z_stream * z = o->zip;
+  z->next_in = (Bytef *)in;
+  z->avail_in = n;
+  z->next_out = (Bytef *)out;
+  z->avail_out = space;
+  int result = deflate( z, finish ? Z_FINISH : Z_SYNC_FLUSH );
+  if ( result != ( finish ? Z_STREAM_END : Z_OK ) || z->avail_in != 0 ||
+       z->avail_out == 0 ) {
+    return -1;
+  }
+  return space - z->avail_out;
+}
+
+// Frame the n bytes of the document at p + CHUNK_HEAD as a chunk, or
+// leave the n bytes at p alone if the response isn't chunked. Returns
+// the length of what is there now.
+static int frame( CgiOutput * o, char * p, int n ) {
+  if ( !o->chunked ) {
+    return n;
+  }
+  if ( n == 0 ) {
+    // a chunk of 0 would end the response
+    return 0;
+  }
+  char head[CHUNK_HEAD + 1];
+  snprintf( head, sizeof(head), "%08x\r\n", n );
+  memcpy( p, head, CHUNK_HEAD );
+  memcpy( p + CHUNK_HEAD + n, "\r\n", CHUNK_TAIL );
+  return CHUNK_HEAD + n + CHUNK_TAIL;
+}
+
+// Replace the script's header of headerLength bytes with the response
+// header, followed by whatever of the document came with it. Returns -1
+// if the header is malformed.
+static int startBody( CgiOutput * o, int headerLength ) {
+  const char * status = NULL;
+  int statusLength = 0;
+  int hasLength = 0;
+  int hasLocation = 0;
+  int hasEncoding = 0;
+  char type[128] = "";
+  const char * end = o->buffer + headerLength;
+
+  for ( const char * line = o->buffer; line < end; ) {
+    const char * newline = (const char *)memchr( line, '\n', end - line );
+    int length = newline - line;
+    if ( length > 0 && line[length - 1] == '\r' ) {
+      length--;
+    }
+    if ( fieldIs( line, length, "Status" ) ) {
+      status = line + 7;
+      statusLength = length - 7;
+      while ( statusLength > 0 && ( *status == ' ' || *status == '\t' ) ) {
+	status++;
+	statusLength--;
+      }
+    } else if ( fieldIs( line, length, "Location" ) ) {
+      hasLocation = 1;
+    } else if ( fieldIs( line, length, "Content-Length" ) ) {
+      hasLength = 1;
+    } else if ( fieldIs( line, length, "Content-Encoding" ) ) {
+      hasEncoding = 1;
+    } else if ( fieldIs( line, length, "Content-Type" ) ) {
+      const char * value = line + 13;
+      while ( value < line + length && ( *value == ' ' || *value == '\t' ) ) {
+	value++;
+      }
+      snprintf( type, sizeof(type), "%.*s", (int)( line + length - value ), value );
+    }
+    line = newline + 1;
+  }
+
+  if ( status != NULL ) {
+    if ( statusLength < 3 || status[0] < '1' || status[0] > '5' ||
+	 status[1] < '0' || status[1] > '9' || status[2] < '0' || status[2] > '9' ) {
+      return -1;
+    }
+    o->status = ( status[0] - '0' ) * 100 + ( status[1] - '0' ) * 10 + status[2] - '0';
+  } else if ( hasLocation ) {
+    status = "302 Found";
+    statusLength = strlen( status );
+    o->status = 302;
+  } else {
+    status = "200 Document follows";
+    statusLength = strlen( status );
+    o->status = 200;
+  }
+
+  // a document of known length doesn't need chunks to keep the
+  // connection, one of unknown length needs them. 204 and 304 have none,
+  // whatever the script writes after the header is dropped.
+  o->bodiless = o->status == 204 || o->status == 304;
+  if ( o->bodiless ) {
+    o->chunked = 0;
+  } else if ( hasLength ) {
+    o->chunked = 0;
+  } else if ( !o->chunked ) {
+    o->keepAlive = 0;
+  }
+
+  // text the script didn't encode or give a length for, and not just a
+  // part of it, is compressed if the client takes gzip
+  int compress = !o->bodiless && !hasLength && !hasEncoding && o->status != 206 &&
+    encodingConfig.level > 0 && compressible( type );
+  if ( compress && o->gzip ) {
+    startZip( o );
+  }
+
+  // every line may gain a CR
+  int leftover = o->bodiless ? 0 : o->end - headerLength;
+  int leftoverOut = o->zip != NULL ? (int)deflateBound( o->zip, leftover ) + FLUSH_MARK
+    : leftover;
+  int size = 2 * headerLength + HEADER_EXTRA + CHUNK_HEAD + leftoverOut + CHUNK_TAIL;
+  if ( size < OUTPUT_BUFFER ) {
+    size = OUTPUT_BUFFER;
+  }
+  char * out = (char *)malloc( size );
+  if ( out == NULL ) {
+    return -1;
+  }
+
+  int length = snprintf( out, size, "HTTP/1.1 %.*s\r\nServer: CS 252 lab5\r\n",
+      statusLength, status );
+  for ( const char * line = o->buffer; line < end; ) {
+    const char * newline = (const char *)memchr( line, '\n', end - line );
+    int n = newline - line;
+    if ( n > 0 && line[n - 1] == '\r' ) {
+      n--;
+    }
+    // framing is up to the server
+    if ( n > 0 && !fieldIs( line, n, "Status" ) && !fieldIs( line, n, "Connection" ) &&
+	 !fieldIs( line, n, "Transfer-Encoding" ) && !fieldIs( line, n, "Keep-Alive" ) ) {
+      memcpy( out + length, line, n );
+      memcpy( out + length + n, "\r\n", 2 );
+      length += n + 2;
+    }
+    line = newline + 1;
+  }
+  length += snprintf( out + length, size - length, "%s%s%s%s",
+      compress ? "Vary: Accept-Encoding\r\n" : "",
+      o->zip != NULL ? "Content-Encoding: gzip\r\n" : "",
+      o->chunked ? "Transfer-Encoding: chunked\r\n" : "",
+      o->keepAlive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n" );
+
+  if ( leftover > 0 && o->zip != NULL ) {
+    int head = o->chunked ? CHUNK_HEAD : 0;
+    int n = gzipSome( o, end, leftover, 0, out + length + head,
+	size - length - head - CHUNK_TAIL );
+    if ( n < 0 ) {
+      free( out );
+      return -1;
+    }
+    length += frame( o, out + length, n );
+  } else if ( leftover > 0 && o->chunked ) {
+    length += snprintf( out + length, size - length, "%x\r\n", leftover );
+    memcpy( out + length, end, leftover );
+    memcpy( out + length + leftover, "\r\n", 2 );
+    length += leftover + 2;
+  } else if ( leftover > 0 ) {
+    memcpy( out + length, end, leftover );
+    length += leftover;
+  }
+
+  free( o->buffer );
+  o->buffer = out;
+  o->size = size;
+  o->start = 0;
+  o->end = length;
+  o->state = OUTPUT_BODY;
+
+  // read no more than surely fits compressed, with room for the end
+  if ( o->zip != NULL ) {
+    int space = size - CHUNK_HEAD - CHUNK_TAIL - CHUNK_END - FLUSH_MARK;
+    o->rawSize = OUTPUT_BUFFER;
+    while ( (int)deflateBound( o->zip, o->rawSize ) > space ) {
+      o->rawSize -= 64;
+    }
+  }
+  return 0;
+}
+
+// Where the next read from the script goes, and how much fits. NULL if
+// what was read before has to be sent first, or the script is done.
+char * cgiOutputSpace( CgiOutput * o, int * space ) {
+  if ( o->state == OUTPUT_HEADER ) {
+    *space = o->size - o->end;
+    return o->buffer + o->end;
+  }
+  if ( o->state == OUTPUT_END || o->start < o->end ) {
+    return NULL;
+  }
+
+  o->start = 0;
+  o->end = 0;
+  if ( o->zip != NULL ) {
+    *space = o->rawSize;
+    return o->raw;
+  }
+  if ( o->chunked ) {
+    *space = o->size - CHUNK_HEAD - CHUNK_TAIL;
+    return o->buffer + CHUNK_HEAD;
+  }
+  *space = o->size;
+  return o->buffer;
+}
+
+// n bytes were read into the space, 0 means the script's output ended.
+// Returns -1 if the script didn't write a whole header that makes sense.
+int cgiOutputReceived( CgiOutput * o, int n ) {
+  if ( o->state == OUTPUT_HEADER ) {
+    if ( n <= 0 ) {
+      return -1;
+    }
+    o->end += n;
+    int length = headerEnd( o->buffer, o->end );
+    if ( length < 0 ) {
+      return o->end < o->size ? 0 : -1;
+    }
+    return startBody( o, length );
+  }
+
+  int ended = n <= 0;
+  if ( o->zip != NULL ) {
+    int head = o->chunked ? CHUNK_HEAD : 0;
+    n = gzipSome( o, o->raw, ended ? 0 : n, ended, o->buffer + head,
+	o->size - head - CHUNK_TAIL - CHUNK_END );
+    if ( n < 0 ) {
+      return -1;
+    }
+  } else if ( ended ) {
+    n = 0;
+  }
+
+  o->end = o->bodiless ? 0 : frame( o, o->buffer, n );
+  if ( ended ) {
+    o->state = OUTPUT_END;
+    if ( o->chunked ) {
+      memcpy( o->buffer + o->end, "0\r\n\r\n", CHUNK_END );
+      o->end += CHUNK_END;
+    }
+  }
+  return 0;
+}
+
+// Bytes ready to go to the client
+int cgiOutputPending( CgiOutput * o, char ** data ) {
+  if ( o->state == OUTPUT_HEADER ) {
+    return 0;
+  }
+  *data = o->buffer + o->start;
+  return o->end - o->start;
+}
+
+void cgiOutputSent( CgiOutput * o, int n ) {
+  o->start += n;
+  o->sent += n;
+}
+
+// Whether the whole response has been sent
+int cgiOutputDone( CgiOutput * o ) {
+  return o->state == OUTPUT_END && o->start == o->end;
+}
+
+void cgiOutputFree( CgiOutput * o ) {
+  if ( o->zip != NULL ) {
+    deflateEnd( o->zip );
+    free( o->zip );
+    o->zip = NULL;
+  }
+  free( o->raw );
+  o->raw = NULL;
+  free( o->buffer );
+  o->buffer = NULL;
+}
@@ -0,0 +1,34 @@
+#ifndef CGI_OUTPUT_H
+#define CGI_OUTPUT_H
+
+struct z_stream_s;
+
+// A CGI script's output on its way to the client. The header the script
+// writes becomes an HTTP response header, the document after it goes out
+// as it arrives.
+struct CgiOutput {
+  char * buffer;     // NULL when no script is running
+  int size;
+  int start;         // bytes from start to end are ready to send
+  int end;
+  int state;         // reading the script's header, its document, or done
+  int chunked;       // the document goes out in chunks
+  int keepAlive;     // the connection stays open after the response
+  int status;        // of the response, 0 until the header has been read
+  int bodiless;      // a 204 or 304, nothing is sent after the header
+  int gzip;          // the client takes gzip
+  z_stream_s * zip;  // compressing the document, NULL if it isn't
+  char * raw;        // the document as read, before it is compressed
+  int rawSize;
+  long long sent;    // bytes sent to the client, for the access log
+};
+
+int cgiOutputStart( CgiOutput * o, int keepAlive, int chunked, int gzip, int nph );
+char * cgiOutputSpace( CgiOutput * o, int * space );
+int cgiOutputReceived( CgiOutput * o, int n );
+int cgiOutputPending( CgiOutput * o, char ** data );
+void cgiOutputSent( CgiOutput * o, int n );
+int cgiOutputDone( CgiOutput * o );
+void cgiOutputFree( CgiOutput * o );
+
+#endif
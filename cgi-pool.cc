@@ -0,0 +1,799 @@
+//------------------------------------------------------------------------
+// CGI worker pool.
+//
+// Forking the server for every /cgi-bin/ request copies the page tables
+// of a large multi-threaded process and, in the blocking modes, leaves a
+// server thread sitting in waitpid() until the script is done. Instead
+// the server starts a few small worker processes (this same binary run
+// with --cgi-worker) and hands each script request to one of them as a
+// frame on a Unix SEQPACKET socket, with the write end of a pipe attached
+// as SCM_RIGHTS. The worker starts the script with the pipe as its
+// stdout, the server reads the other end (see cgi-output.cc), and the
+// worker reports back with a CGI_DONE frame once the script exits. A
+// request with a body also carries the read end of a second pipe, which
+// becomes the script's stdin while the server streams the body into the
+// other end. The server thread is free again as soon as the frame is
+// sent, and a worker runs any number of scripts at once.
+//
+// Workers and scripts are started with posix_spawn(), see cgiSpawn(),
+// which doesn't copy the page tables either, so even with no workers a
+// script costs the same to start however large the server has grown.
+//
+// A script still running after cgiConfig.timeout seconds is killed, with
+// everything it started, by whoever started it: the worker, or when there
+// are no workers the reaper thread cgiWatch() hands the script to. That
+// thread waits for the scripts' pidfds, so no server thread ever blocks
+// in waitpid().
+//
+// A worker is replaced after maxRequests scripts: the server stops
+// sending it work and shuts its end down, the worker finishes the
+// scripts still running and exits. A worker that dies for any other
+// reason is replaced the same way. cgiMain() watches all the control
+// sockets, accounts for finished scripts and respawns workers.
+//
+// maxPerScript limits how many copies of one script run at the same
+// time, so a slow script can't take every worker's children with it.
+//------------------------------------------------------------------------
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cgi-env.h"
+#include "cgi-pool.h"
+#include "log.h"
+#include "myhttpd.h"
+
+CgiConfig cgiConfig = { 2, 1000, 0, 16 * 1024 * 1024, 30, 0 };
+
+// frames on the control socket
+enum {
+  CGI_RUN,  // server -> worker, the script's stdout is attached
+  CGI_DONE  // worker -> server, the script exited
+};
+
+struct CgiFrame {
+  int type;
+  int id;          // matches a CGI_DONE to its CGI_RUN
+  int status;      // exit status of the script, CGI_DONE only
+  int queryLength; // -1 if the request had no query string
+  int envLength;
+  // script, NUL, query, NUL, then the environment block
+  char data[PATH_MAX + MAX_MESSAGE + 2 + CGI_ENV_SIZE];
+};
+
+#define FRAME_HEADER offsetof( CgiFrame, data )
+
+// scripts of one name currently running
+struct ScriptCount {
+  char * path;
+  int running;
+  ScriptCount * next;
+};
+
+struct CgiJob {
+  int id;
+  ScriptCount * script;
+  CgiJob * next;
+};
+
+struct CgiWorker {
+  pid_t pid;
+  int fd;         // control socket, -1 while the slot is empty
+  int launched;   // scripts handed to this worker
+  int retiring;   // no new work, exits once its scripts are done
+  int running;
+  CgiJob * jobs;
+};
+
+static CgiWorker * workers;
+static ScriptCount * scripts;
+static int nextId;
+static int nextWorker;
+
+static pthread_mutex_t cgiMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// The rest of cgiSpawn() in a child fork()ed from the caller. Never
+// returns. Only async-signal-safe calls, the server is threaded.
+static void execScript( int output, int input, char ** argv, char ** envp ) {
+  // the body, if any, arrives on stdin
+  if ( input != -1 ) {
+    dup2( input, STDIN_FILENO );
+    close( input );
+  }
+
+  // signals blocked for the server's own threads don't apply here
+  sigset_t signals;
+  sigemptyset( &signals );
+  sigprocmask( SIG_SETMASK, &signals, NULL );
+  signal( SIGPIPE, SIG_DFL );
+
+  // its own process group, so a timeout kills whatever it started too
+  setpgid( 0, 0 );
+
+  // redirect output to the pipe, errors still go to the server's log
+  dup2(output, STDOUT_FILENO);
+  close(output);
+
+  execve(argv[0], argv, envp);
+  _exit(127);
+}
+
+// Start a script with its output going to the pipe output, and its
+// stdin reading request->input if there is a body. Returns its pid, -1
+// if it couldn't be started.
+//
+// posix_spawn() runs the child in the caller's memory until the exec, as
+// vfork() does, instead of copying the page tables the way fork() does,
+// so a script costs the same to start however large the server grows.
+// --cgi-fork goes the old way, for comparison.
+pid_t cgiSpawn( int output, const CgiRequest * request ) {
+  const char * script = request->script;
+  char * argv[3];
+  argv[0] = (char *)script;
+  argv[1] = (char *)request->query; // the query string is also its argument
+  argv[2] = NULL;
+
+  // finger takes no arguments
+  const char * name = strrchr( script, '/' );
+  if ( name != NULL && !strcmp( name, "/finger" ) ) {
+    argv[1] = NULL;
+  }
+
+  // the environment the server built, not the server's own
+  char * envp[CGI_ENV_MAX + 1];
+  cgiEnvVector( request->env, request->envLength, envp, CGI_ENV_MAX + 1 );
+
+  LOG( LOG_DEBUG, "executing: %s args: %s", argv[0], argv[1] );
+
+  pid_t pid;
+  if ( cgiConfig.fork ) {
+    pid = fork();
+    if ( pid == 0 ) {
+      execScript( output, request->input, argv, envp );
+    }
+    return pid;
+  }
+
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init( &actions );
+  if ( request->input != -1 ) {
+    posix_spawn_file_actions_adddup2( &actions, request->input, STDIN_FILENO );
+  }
+  posix_spawn_file_actions_adddup2( &actions, output, STDOUT_FILENO );
+  // nothing else of the server's, such as other clients' sockets
+  posix_spawn_file_actions_addclosefrom_np( &actions, STDERR_FILENO + 1 );
+
+  // its own process group, so a timeout kills whatever it started too,
+  // and signals the server blocks or ignores back to normal
+  posix_spawnattr_t attr;
+  sigset_t signals;
+  posix_spawnattr_init( &attr );
+  posix_spawnattr_setflags( &attr,
+      POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF );
+  posix_spawnattr_setpgroup( &attr, 0 );
+  sigemptyset( &signals );
+  posix_spawnattr_setsigmask( &attr, &signals );
+  sigaddset( &signals, SIGPIPE );
+  posix_spawnattr_setsigdefault( &attr, &signals );
+
+  int error = posix_spawn( &pid, script, &actions, &attr, argv, envp );
+  posix_spawnattr_destroy( &attr );
+  posix_spawn_file_actions_destroy( &actions );
+  if ( error != 0 ) {
+    LOG( LOG_WARN, "cannot start %s: %s", script, strerror(error) );
+    return -1;
+  }
+  return pid;
+}
+
+//------------------------------------------------------------------------
+// worker side
+//------------------------------------------------------------------------
+
+struct Running {
+  pid_t pid;
+  int id;
+  time_t deadline; // when it gets killed, 0 never
+  Running * next;
+};
+
+static void sendDone( int fd, int id, int status ) {
+  CgiFrame frame;
+  frame.type = CGI_DONE;
+  frame.id = id;
+  frame.status = status;
+  frame.queryLength = -1;
+  frame.envLength = 0;
+  send( fd, &frame, FRAME_HEADER, MSG_NOSIGNAL );
+}
+
+// Receive one frame and the descriptors attached to it, the script's
+// stdout and possibly its stdin. Returns the frame size, 0 once
+// the server closed its end, -1 on error.
+static ssize_t receiveFrame( int fd, CgiFrame * frame, int attached[2] ) {
+  char control[CMSG_SPACE( 2 * sizeof(int) )];
+  struct iovec iov = { frame, sizeof(*frame) };
+  struct msghdr msg;
+  memset( &msg, 0, sizeof(msg) );
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  ssize_t n = recvmsg( fd, &msg, MSG_CMSG_CLOEXEC );
+  attached[0] = attached[1] = -1;
+  struct cmsghdr * cmsg = n > 0 ? CMSG_FIRSTHDR( &msg ) : NULL;
+  if ( cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET &&
+       cmsg->cmsg_type == SCM_RIGHTS ) {
+    int count = ( cmsg->cmsg_len - CMSG_LEN( 0 ) ) / sizeof(int);
+    memcpy( attached, CMSG_DATA( cmsg ), ( count < 2 ? count : 2 ) * sizeof(int) );
+  }
+  return n;
+}
+
+// Fork the script a CGI_RUN frame asks for
+static Running * launch( CgiFrame * frame, int output, int input, Running * running ) {
+  CgiRequest request;
+  request.script = frame->data;
+  const char * next = request.script + strlen( request.script ) + 1;
+  request.query = NULL;
+  if ( frame->queryLength >= 0 ) {
+    request.query = next;
+    next += frame->queryLength + 1;
+  }
+  request.env = next;
+  request.envLength = frame->envLength;
+  request.input = input;
+
+  // a script that can't be started gets the client a 502, as its
+  // output ends without a header
+  pid_t pid = cgiSpawn( output, &request );
+  close( output );
+  if ( input != -1 ) {
+    close( input );
+  }
+
+  if ( pid < 0 ) {
+    return running;
+  }
+
+  Running * r = (Running *)malloc( sizeof(Running) );
+  if ( r == NULL ) {
+    return running;
+  }
+  r->pid = pid;
+  r->id = frame->id;
+  r->deadline = cgiConfig.timeout > 0 ? time( NULL ) + cgiConfig.timeout : 0;
+  r->next = running;
+  return r;
+}
+
+// Body of a --cgi-worker process: launch scripts as frames come in,
+// kill them when they time out and report them as they exit. Exits once
+// the server closed the control socket and every script has finished.
+void cgiWorkerMain( int fd ) {
+  // only the control socket is ours, anything else was inherited
+  // from whatever the server had open when it forked
+  close_range( fd + 1, ~0U, 0 );
+  fcntl( fd, F_SETFD, FD_CLOEXEC );
+
+  // the server may ignore SIGCHLD and block other signals, the
+  // mask and ignored signals survive exec
+  signal( SIGCHLD, SIG_DFL );
+  sigset_t signals;
+  sigemptyset( &signals );
+  sigaddset( &signals, SIGCHLD );
+  sigprocmask( SIG_SETMASK, &signals, NULL );
+  int sfd = signalfd( -1, &signals, SFD_NONBLOCK | SFD_CLOEXEC );
+  if ( sfd < 0 ) {
+    perror( "signalfd" );
+    exit( -1 );
+  }
+
+  Running * running = NULL;
+  int open = 1;
+  CgiFrame frame;
+
+  while ( open || running != NULL ) {
+    struct pollfd fds[2];
+    fds[0].fd = sfd;
+    fds[0].events = POLLIN;
+    fds[1].fd = open ? fd : -1;
+    fds[1].events = POLLIN;
+
+    // look at the deadlines every second while scripts run
+    int timeout = running != NULL && cgiConfig.timeout > 0 ? 1000 : -1;
+    if ( poll( fds, 2, timeout ) < 0 ) {
+      if ( errno == EINTR ) {
+	continue;
+      }
+      perror( "poll" );
+      exit( -1 );
+    }
+
+    time_t now = time( NULL );
+    for ( Running * r = running; r != NULL; r = r->next ) {
+      if ( r->deadline != 0 && now >= r->deadline ) {
+	// still our unreaped child, so the group can't be anybody else's
+	kill( -r->pid, SIGKILL );
+	r->deadline = 0;
+      }
+    }
+
+    if ( fds[1].revents ) {
+      int attached[2];
+      ssize_t n = receiveFrame( fd, &frame, attached );
+      if ( n <= 0 ) {
+	// retired, or the server went away
+	open = 0;
+      } else if ( attached[0] != -1 ) {
+	if ( n >= (ssize_t)FRAME_HEADER && frame.type == CGI_RUN ) {
+	  frame.data[sizeof(frame.data) - 1] = '\0';
+	  running = launch( &frame, attached[0], attached[1], running );
+	} else {
+	  close( attached[0] );
+	  if ( attached[1] != -1 ) {
+	    close( attached[1] );
+	  }
+	}
+      }
+    }
+
+    if ( fds[0].revents ) {
+      struct signalfd_siginfo info;
+      while ( read( sfd, &info, sizeof(info) ) > 0 ) {
+      }
+
+      int status;
+      pid_t pid;
+      while ( (pid = waitpid( -1, &status, WNOHANG )) > 0 ) {
+	Running ** p = &running;
+	while ( *p != NULL && (*p)->pid != pid ) {
+	  p = &(*p)->next;
+	}
+	if ( *p != NULL ) {
+	  Running * r = *p;
+	  *p = r->next;
+	  sendDone( fd, r->id, status );
+	  free( r );
+	}
+      }
+    }
+  }
+  exit( 0 );
+}
+
+//------------------------------------------------------------------------
+// server side
+//------------------------------------------------------------------------
+
+// Start a worker in slot w. Called with cgiMutex held.
+static void spawnWorker( CgiWorker * w ) {
+  int sv[2];
+  w->fd = -1;
+  w->launched = 0;
+  w->retiring = 0;
+  w->running = 0;
+  w->jobs = NULL;
+
+  if ( socketpair( AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv ) < 0 ) {
+    perror( "socketpair" );
+    return;
+  }
+
+  // the worker kills scripts itself, it has to know when, and it
+  // starts them the same way the server would
+  char timeout[32];
+  snprintf( timeout, sizeof(timeout), "--cgi-timeout=%d", cgiConfig.timeout );
+  char * argv[] = { (char *)"myhttpd", timeout, (char *)"--cgi-worker", NULL, NULL };
+  if ( cgiConfig.fork ) {
+    argv[2] = (char *)"--cgi-fork";
+    argv[3] = (char *)"--cgi-worker";
+  }
+
+  pid_t pid;
+  if ( cgiConfig.fork ) {
+    pid = fork();
+    if ( pid == 0 ) {
+      // only async-signal-safe calls from here on, the server is threaded
+      if ( sv[1] == CGI_WORKER_FD ) {
+	fcntl( sv[1], F_SETFD, 0 );
+      } else {
+	dup2( sv[1], CGI_WORKER_FD );
+      }
+      execv( "/proc/self/exe", argv );
+      _exit( 127 );
+    }
+  } else {
+    // a dup2() onto itself clears FD_CLOEXEC
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init( &actions );
+    posix_spawn_file_actions_adddup2( &actions, sv[1], CGI_WORKER_FD );
+    errno = posix_spawn( &pid, "/proc/self/exe", &actions, NULL, argv, environ );
+    posix_spawn_file_actions_destroy( &actions );
+    if ( errno != 0 ) {
+      pid = -1;
+    }
+  }
+  close( sv[1] );
+
+  if ( pid < 0 ) {
+    perror( "cgi worker" );
+    close( sv[0] );
+    return;
+  }
+  w->pid = pid;
+  w->fd = sv[0];
+}
+
+// Scripts of a worker that went away won't report back
+static void dropJobs( CgiWorker * w ) {
+  while ( w->jobs != NULL ) {
+    CgiJob * job = w->jobs;
+    w->jobs = job->next;
+    job->script->running--;
+    free( job );
+  }
+  w->running = 0;
+}
+
+static void finishJob( CgiWorker * w, int id ) {
+  CgiJob ** p = &w->jobs;
+  while ( *p != NULL && (*p)->id != id ) {
+    p = &(*p)->next;
+  }
+  if ( *p != NULL ) {
+    CgiJob * job = *p;
+    *p = job->next;
+    job->script->running--;
+    w->running--;
+    free( job );
+  }
+}
+
+// Collect CGI_DONE frames and replace workers that exited
+static void * cgiMain( void * ) {
+  int count = cgiConfig.workers;
+  struct pollfd * fds = (struct pollfd *)malloc( count * sizeof(struct pollfd) );
+  if ( fds == NULL ) {
+    perror( "malloc" );
+    exit( -1 );
+  }
+
+  while ( 1 ) {
+    // slots only change on this thread, no need to lock to read fds
+    for ( int i = 0; i < count; i++ ) {
+      fds[i].fd = workers[i].fd;
+      fds[i].events = POLLIN;
+    }
+
+    if ( poll( fds, count, 1000 ) < 0 ) {
+      if ( errno == EINTR ) {
+	continue;
+      }
+      perror( "poll" );
+      exit( -1 );
+    }
+
+    for ( int i = 0; i < count; i++ ) {
+      CgiWorker * w = &workers[i];
+
+      if ( w->fd == -1 ) {
+	// spawning failed earlier, try again
+	pthread_mutex_lock( &cgiMutex );
+	spawnWorker( w );
+	pthread_mutex_unlock( &cgiMutex );
+	continue;
+      }
+      if ( !fds[i].revents ) {
+	continue;
+      }
+
+      CgiFrame frame;
+      ssize_t n = recv( w->fd, &frame, sizeof(frame), MSG_DONTWAIT );
+      if ( n < 0 && ( errno == EAGAIN || errno == EINTR ) ) {
+	continue;
+      }
+
+      pthread_mutex_lock( &cgiMutex );
+      if ( n >= (ssize_t)FRAME_HEADER && frame.type == CGI_DONE ) {
+	finishJob( w, frame.id );
+      } else if ( n <= 0 ) {
+	LOG( LOG_INFO, "cgi worker %d exited, starting a new one", (int)w->pid );
+	dropJobs( w );
+	close( w->fd );
+	waitpid( w->pid, NULL, 0 );
+	spawnWorker( w );
+      }
+      pthread_mutex_unlock( &cgiMutex );
+    }
+  }
+  return NULL;
+}
+
+void cgiStart() {
+  if ( cgiConfig.workers <= 0 ) {
+    return;
+  }
+
+  workers = (CgiWorker *)calloc( cgiConfig.workers, sizeof(CgiWorker) );
+  if ( workers == NULL ) {
+    perror( "calloc" );
+    exit( -1 );
+  }
+
+  pthread_mutex_lock( &cgiMutex );
+  for ( int i = 0; i < cgiConfig.workers; i++ ) {
+    spawnWorker( &workers[i] );
+  }
+  pthread_mutex_unlock( &cgiMutex );
+
+  pthread_t thread;
+  if ( pthread_create( &thread, NULL, cgiMain, NULL ) != 0 ) {
+    perror( "pthread_create" );
+    exit( -1 );
+  }
+  pthread_detach( thread );
+}
+
+int cgiEnabled() {
+  return workers != NULL;
+}
+
+static ScriptCount * findScript( const char * path ) {
+  ScriptCount * s;
+  for ( s = scripts; s != NULL; s = s->next ) {
+    if ( !strcmp( s->path, path ) ) {
+      return s;
+    }
+  }
+
+  s = (ScriptCount *)malloc( sizeof(ScriptCount) );
+  if ( s == NULL || (s->path = strdup( path )) == NULL ) {
+    free( s );
+    return NULL;
+  }
+  s->running = 0;
+  s->next = scripts;
+  scripts = s;
+  return s;
+}
+
+// Hand a script request to the least busy worker. The worker takes over
+// the script's stdout and stdin, the caller only closes its own copies.
+// Returns -1 if the script is at its limit or no worker can take it.
+int cgiSubmit( int output, const CgiRequest * request ) {
+  CgiFrame frame;
+  const char * script = request->script;
+  const char * query = request->query;
+  size_t scriptLength = strlen( script );
+  size_t queryLength = query ? strlen( query ) : 0;
+  if ( scriptLength + queryLength + 2 + request->envLength > sizeof(frame.data) ) {
+    return -1;
+  }
+
+  frame.type = CGI_RUN;
+  frame.status = 0;
+  frame.queryLength = query ? (int)queryLength : -1;
+  frame.envLength = request->envLength;
+  char * p = frame.data;
+  memcpy( p, script, scriptLength + 1 );
+  p += scriptLength + 1;
+  if ( query ) {
+    memcpy( p, query, queryLength + 1 );
+    p += queryLength + 1;
+  }
+  memcpy( p, request->env, request->envLength );
+  p += request->envLength;
+
+  int fds[2] = { output, request->input };
+  int fdCount = request->input != -1 ? 2 : 1;
+  char control[CMSG_SPACE( 2 * sizeof(int) )];
+  memset( control, 0, sizeof(control) );
+  struct iovec iov = { &frame, FRAME_HEADER + ( p - frame.data ) };
+  struct msghdr msg;
+  memset( &msg, 0, sizeof(msg) );
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = CMSG_SPACE( fdCount * sizeof(int) );
+  struct cmsghdr * cmsg = CMSG_FIRSTHDR( &msg );
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN( fdCount * sizeof(int) );
+  memcpy( CMSG_DATA( cmsg ), fds, fdCount * sizeof(int) );
+
+  pthread_mutex_lock( &cgiMutex );
+
+  ScriptCount * s = findScript( script );
+  if ( s == NULL ||
+       ( cgiConfig.maxPerScript > 0 && s->running >= cgiConfig.maxPerScript ) ) {
+    pthread_mutex_unlock( &cgiMutex );
+    return -1;
+  }
+
+  // least busy first, ties go round robin
+  CgiWorker * w = NULL;
+  nextWorker = ( nextWorker + 1 ) % cgiConfig.workers;
+  for ( int i = 0; i < cgiConfig.workers; i++ ) {
+    CgiWorker * candidate = &workers[( nextWorker + i ) % cgiConfig.workers];
+    if ( candidate->fd != -1 && !candidate->retiring &&
+	 ( w == NULL || candidate->running < w->running ) ) {
+      w = candidate;
+    }
+  }
+
+  CgiJob * job = (CgiJob *)malloc( sizeof(CgiJob) );
+  frame.id = nextId++;
+  if ( w == NULL || job == NULL ||
+       sendmsg( w->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL ) < 0 ) {
+    pthread_mutex_unlock( &cgiMutex );
+    free( job );
+    return -1;
+  }
+
+  job->id = frame.id;
+  job->script = s;
+  job->next = w->jobs;
+  w->jobs = job;
+  w->running++;
+  s->running++;
+
+  // recycle the worker: it sees end of file, finishes what it is
+  // running and exits, and cgiMain() starts a fresh one
+  if ( ++w->launched >= cgiConfig.maxRequests && cgiConfig.maxRequests > 0 ) {
+    w->retiring = 1;
+    shutdown( w->fd, SHUT_WR );
+  }
+
+  pthread_mutex_unlock( &cgiMutex );
+  return 0;
+}
+
+//------------------------------------------------------------------------
+// scripts the server forks itself
+//------------------------------------------------------------------------
+
+struct Watched {
+  pid_t pid;
+  int pidfd;       // -1 where the kernel has no pidfd_open()
+  time_t deadline; // when it gets killed, 0 never or already done
+  Watched * next;
+};
+
+static Watched * watched;
+static int wakeFd = -1; // tells the reaper about a new script
+static pthread_mutex_t watchMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t reaperOnce = PTHREAD_ONCE_INIT;
+
+// Wait for any of the watched scripts to exit or reach its deadline,
+// reap the ones that exited and kill the late ones
+static void * cgiReaper( void * ) {
+  struct pollfd * fds = NULL;
+  int capacity = 0;
+
+  while ( 1 ) {
+    pthread_mutex_lock( &watchMutex );
+    int count = 1;
+    int polling = 1;
+    int blind = 0;    // some script can't be polled for
+    time_t next = 0;
+    for ( Watched * w = watched; w != NULL; w = w->next ) {
+      count++;
+    }
+    if ( count > capacity ) {
+      struct pollfd * grown = (struct pollfd *)realloc( fds, count * 2 * sizeof(struct pollfd) );
+      if ( grown != NULL ) {
+	fds = grown;
+	capacity = count * 2;
+      }
+    }
+    if ( fds == NULL ) {
+      pthread_mutex_unlock( &watchMutex );
+      sleep( 1 );
+      continue;
+    }
+    fds[0].fd = wakeFd;
+    fds[0].events = POLLIN;
+    for ( Watched * w = watched; w != NULL; w = w->next ) {
+      if ( polling < capacity && w->pidfd != -1 ) {
+	fds[polling].fd = w->pidfd;
+	fds[polling++].events = POLLIN;
+      } else {
+	blind = 1;
+      }
+      if ( w->deadline != 0 && ( next == 0 || w->deadline < next ) ) {
+	next = w->deadline;
+      }
+    }
+    pthread_mutex_unlock( &watchMutex );
+
+    int timeout = -1;
+    if ( next != 0 ) {
+      time_t now = time( NULL );
+      timeout = next > now ? ( next - now ) * 1000 : 0;
+    }
+    // those that can't be polled for are looked at every second
+    if ( blind && ( timeout < 0 || timeout > 1000 ) ) {
+      timeout = 1000;
+    }
+
+    if ( poll( fds, polling, timeout ) < 0 && errno != EINTR ) {
+      perror( "poll" );
+      exit( -1 );
+    }
+    eventfd_t value;
+    eventfd_read( wakeFd, &value );
+
+    pthread_mutex_lock( &watchMutex );
+    time_t now = time( NULL );
+    Watched ** p = &watched;
+    while ( *p != NULL ) {
+      Watched * w = *p;
+      pid_t pid = waitpid( w->pid, NULL, WNOHANG );
+      if ( pid == w->pid || ( pid < 0 && errno == ECHILD ) ) {
+	*p = w->next;
+	if ( w->pidfd != -1 ) {
+	  close( w->pidfd );
+	}
+	free( w );
+	continue;
+      }
+      if ( w->deadline != 0 && now >= w->deadline ) {
+	// not reaped yet, so the group can't be anybody else's
+	kill( -w->pid, SIGKILL );
+	w->deadline = 0;
+      }
+      p = &w->next;
+    }
+    pthread_mutex_unlock( &watchMutex );
+  }
+  return NULL;
+}
+
+static void startReaper() {
+  wakeFd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+  pthread_t thread;
+  if ( wakeFd < 0 || pthread_create( &thread, NULL, cgiReaper, NULL ) != 0 ) {
+    perror( "cgi reaper" );
+    exit( -1 );
+  }
+  pthread_detach( thread );
+}
+
+// Hand a script the server forked to the reaper thread, which waits for
+// it and kills it once it has run for cgiConfig.timeout seconds
+void cgiWatch( pid_t pid ) {
+  pthread_once( &reaperOnce, startReaper );
+
+  Watched * w = (Watched *)malloc( sizeof(Watched) );
+  if ( w == NULL ) {
+    LOG( LOG_ERROR, "out of memory, cgi child %d won't be reaped", (int)pid );
+    return;
+  }
+  w->pid = pid;
+  w->pidfd = syscall( SYS_pidfd_open, pid, 0 );
+  w->deadline = cgiConfig.timeout > 0 ? time( NULL ) + cgiConfig.timeout : 0;
+
+  pthread_mutex_lock( &watchMutex );
+  w->next = watched;
+  watched = w;
+  pthread_mutex_unlock( &watchMutex );
+  eventfd_write( wakeFd, 1 );
+}
@@ -0,0 +1,37 @@
+#ifndef CGI_POOL_H
+#define CGI_POOL_H
+
+#include <sys/types.h>
+
+// Tunables of the CGI worker pool, see cgiStart()
+struct CgiConfig {
+  int workers;      // worker processes, 0 forks the server for every script
+  int maxRequests;  // scripts a worker launches before it is replaced
+  int maxPerScript; // scripts of the same name running at once, 0 no limit
+  long long maxBody; // largest request body passed to a script, 0 no limit
+  int timeout;      // seconds before a script is killed, 0 never
+  int fork;         // fork() for scripts instead of posix_spawn()
+};
+
+extern CgiConfig cgiConfig;
+
+// A script to run and what it is told about the request
+struct CgiRequest {
+  const char * script;
+  const char * query;       // its argument, NULL if there is none
+  const char * env;         // environment block, see cgi-env.h
+  int envLength;
+  int input;                // the script's stdin, -1 if there is no body
+};
+
+// file descriptor a worker finds its end of the control socket on
+#define CGI_WORKER_FD 3
+
+void cgiStart();
+int cgiEnabled();
+int cgiSubmit( int output, const CgiRequest * request );
+void cgiWorkerMain( int fd );
+pid_t cgiSpawn( int output, const CgiRequest * request );
+void cgiWatch( pid_t pid );
+
+#endif
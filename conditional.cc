@@ -0,0 +1,176 @@
+//------------------------------------------------------------------------
+// Conditional GET.
+//
+// Every file response carries an ETag made of the file's inode, size and
+// modification time, and a Last-Modified date. A client that already has
+// that version sends them back in If-None-Match or If-Modified-Since and
+// gets a 304 with no body instead of the whole file again. If-Range
+// uses the same validators to tell whether a partial download may be
+// resumed.
+//
+// Documents that may be sent gzipped also get "Vary: Accept-Encoding".
+//
+// --cache-control=PREFIX=S adds "Cache-Control: max-age=S" to documents
+// whose path starts with PREFIX, the longest matching prefix winning.
+//------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "conditional.h"
+#include "content-encoding.h"
+#include "mime-types.h"
+
+#define MAX_RULES 32
+#define ETAG_SIZE 64
+
+struct CacheControlRule {
+  const char * prefix;
+  size_t length;
+  long maxAge;
+};
+
+static CacheControlRule rules[MAX_RULES];
+static int ruleCount;
+
+// Add a rule given as PREFIX=SECONDS. Returns -1 if it is malformed.
+int cacheControlRule( const char * spec ) {
+  const char * equals = strrchr( spec, '=' );
+  char * end;
+  if ( equals == NULL || equals == spec || ruleCount == MAX_RULES ) {
+    return -1;
+  }
+  long maxAge = strtol( equals + 1, &end, 10 );
+  if ( end == equals + 1 || *end != '\0' || maxAge < 0 ) {
+    return -1;
+  }
+
+  rules[ruleCount].prefix = spec;
+  rules[ruleCount].length = equals - spec;
+  rules[ruleCount].maxAge = maxAge;
+  ruleCount++;
+  return 0;
+}
+
+static const CacheControlRule * findRule( const char * uri ) {
+  const CacheControlRule * best = NULL;
+  for ( int i = 0; i < ruleCount; i++ ) {
+    if ( !strncmp( uri, rules[i].prefix, rules[i].length ) &&
+	 ( best == NULL || rules[i].length > best->length ) ) {
+      best = &rules[i];
+    }
+  }
+  return best;
+}
+
+static int formatETag( char * buf, size_t size, const struct stat * st ) {
+  return snprintf( buf, size, "\"%lx-%llx-%llx%08lx\"",
+      (unsigned long)st->st_ino, (unsigned long long)st->st_size,
+      (unsigned long long)st->st_mtim.tv_sec, (unsigned long)st->st_mtim.tv_nsec );
+}
+
+// ETag, Last-Modified, Cache-Control and Vary lines of the header of a
+// document. A weak ETag says the body is only equivalent to the file, as
+// one compressed here is. Returns their length.
+int formatValidators( char * buf, size_t size, const char * uri, const struct stat * st,
+    int weak ) {
+  char etag[ETAG_SIZE];
+  formatETag( etag, sizeof(etag), st );
+
+  struct tm tm;
+  char date[64];
+  gmtime_r( &st->st_mtime, &tm );
+  strftime( date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm );
+
+  int length = snprintf( buf, size, "ETag: %s%s\r\nLast-Modified: %s\r\n",
+      weak ? "W/" : "", etag, date );
+
+  const CacheControlRule * rule = findRule( uri );
+  if ( rule != NULL && length < (int)size ) {
+    length += snprintf( buf + length, size - length,
+	"Cache-Control: max-age=%ld\r\n", rule->maxAge );
+  }
+  if ( compressible( mimeType( uri ) ) && length < (int)size ) {
+    length += snprintf( buf + length, size - length, "Vary: Accept-Encoding\r\n" );
+  }
+  return length;
+}
+
+// whether the If-None-Match list names etag, or is *
+static int etagListed( const StringView * list, const char * etag ) {
+  const char * p = list->data;
+  const char * end = list->data + list->length;
+  size_t etagLength = strlen( etag );
+
+  while ( p < end ) {
+    while ( p < end && ( *p == ' ' || *p == '\t' || *p == ',' ) ) {
+      p++;
+    }
+    const char * item = p;
+    while ( p < end && *p != ',' && *p != ' ' && *p != '\t' ) {
+      p++;
+    }
+
+    // weak comparison, a W/ prefix doesn't matter for a GET
+    if ( p - item > 2 && !memcmp( item, "W/", 2 ) ) {
+      item += 2;
+    }
+    if ( ( p - item == 1 && *item == '*' ) ||
+	 ( (size_t)( p - item ) == etagLength && !memcmp( item, etag, etagLength ) ) ) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// An HTTP date such as Last-Modified, returns 0 if it isn't one
+static int parseDate( const StringView * v, time_t * t ) {
+  char date[64];
+  struct tm tm;
+  if ( viewCopy( v, date, sizeof(date) ) < 0 ) {
+    return 0;
+  }
+  memset( &tm, 0, sizeof(tm) );
+  const char * end = strptime( date, "%a, %d %b %Y %H:%M:%S GMT", &tm );
+  if ( end == NULL || *end != '\0' ) {
+    return 0;
+  }
+  *t = timegm( &tm );
+  return 1;
+}
+
+// Whether the client's copy of the file described by st is current
+int notModified( const HttpRequest * r, const struct stat * st ) {
+  // If-None-Match wins when both are sent
+  const StringView * match = httpFindHeader( r, "If-None-Match" );
+  if ( match != NULL ) {
+    char etag[ETAG_SIZE];
+    formatETag( etag, sizeof(etag), st );
+    return etagListed( match, etag );
+  }
+
+  const StringView * since = httpFindHeader( r, "If-Modified-Since" );
+  time_t t;
+  return since != NULL && parseDate( since, &t ) && st->st_mtime <= t;
+}
+
+// Whether a Range header may be honoured: there is no If-Range, or it
+// names the current version of the file
+int rangeCurrent( const HttpRequest * r, const struct stat * st ) {
+  const StringView * ifRange = httpFindHeader( r, "If-Range" );
+  if ( ifRange == NULL ) {
+    return 1;
+  }
+
+  // an ETag has to match exactly, a weak one never does
+  if ( ifRange->length > 0 && ( ifRange->data[0] == '"' || ifRange->data[0] == 'W' ) ) {
+    char etag[ETAG_SIZE];
+    formatETag( etag, sizeof(etag), st );
+    return viewEquals( ifRange, etag );
+  }
+
+  time_t t;
+  return parseDate( ifRange, &t ) && st->st_mtime == t;
+}
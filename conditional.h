@@ -0,0 +1,15 @@
+#ifndef CONDITIONAL_H
+#define CONDITIONAL_H
+
+#include <stddef.h>
+#include <sys/stat.h>
+
+#include "http-parser.h"
+
+int cacheControlRule( const char * spec );
+int formatValidators( char * buf, size_t size, const char * uri, const struct stat * st,
+    int weak );
+int notModified( const HttpRequest * r, const struct stat * st );
+int rangeCurrent( const HttpRequest * r, const struct stat * st );
+
+#endif
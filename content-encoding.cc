@@ -0,0 +1,142 @@
+//------------------------------------------------------------------------
+// gzip content encoding.
+//
+// A client that sends "Accept-Encoding: gzip" gets text documents
+// compressed. A precompressed FILE.gz next to the file is sent if there
+// is one; otherwise the file is compressed here, once, and the result
+// kept in the file cache next to the uncompressed copy until the file
+// changes. Compressing on the fly therefore needs the cache, and is
+// limited to files the cache can hold.
+//------------------------------------------------------------------------
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "content-encoding.h"
+#include "file-cache.h"
+#include "log.h"
+
+EncodingConfig encodingConfig = { 6, 256, 1024 * 1024 };
+
+// Whether documents of this type shrink when compressed
+int compressible( const char * contentType ) {
+  return !strncmp( contentType, "text/", 5 ) ||
+    strstr( contentType, "json" ) != NULL ||
+    strstr( contentType, "xml" ) != NULL ||
+    strstr( contentType, "javascript" ) != NULL;
+}
+
+static void skipSpace( const char ** p, const char * end ) {
+  while ( *p < end && ( **p == ' ' || **p == '\t' ) ) {
+    (*p)++;
+  }
+}
+
+// Whether Accept-Encoding lets us send gzip: it is listed, or * is, and
+// not with q=0
+int acceptsGzip( const HttpRequest * r ) {
+  const StringView * accept = httpFindHeader( r, "Accept-Encoding" );
+  if ( accept == NULL ) {
+    return 0;
+  }
+
+  const char * p = accept->data;
+  const char * end = accept->data + accept->length;
+  int star = 0;
+
+  while ( p < end ) {
+    skipSpace( &p, end );
+    const char * name = p;
+    while ( p < end && *p != ',' && *p != ';' && *p != ' ' && *p != '\t' ) {
+      p++;
+    }
+    size_t length = p - name;
+
+    // only q=0 matters, anything else counts as accepting it
+    int q = 1;
+    skipSpace( &p, end );
+    if ( p < end && *p == ';' ) {
+      p++;
+      skipSpace( &p, end );
+      if ( end - p >= 2 && ( *p == 'q' || *p == 'Q' ) && p[1] == '=' ) {
+	p += 2;
+	q = 0;
+	for ( ; p < end && ( *p == '0' || *p == '.' ); p++ ) {
+	}
+	q = p < end && *p >= '1' && *p <= '9';
+      }
+    }
+    while ( p < end && *p != ',' ) {
+      p++;
+    }
+    p++;
+
+    if ( ( length == 4 && !strncasecmp( name, "gzip", 4 ) ) ||
+	 ( length == 6 && !strncasecmp( name, "x-gzip", 6 ) ) ) {
+      return q;
+    }
+    if ( length == 1 && *name == '*' ) {
+      star = q;
+    }
+  }
+  return star;
+}
+
+// Whether a file of this size gets compressed on the fly
+int worthCompressing( off_t size ) {
+  return encodingConfig.level > 0 && cacheConfig.maxBytes > 0 &&
+    (size_t)size >= encodingConfig.minSize && (size_t)size <= encodingConfig.maxFileSize;
+}
+
+// Read the size bytes of the file behind fd and gzip them. Returns a
+// malloc()ed buffer holding *length bytes, NULL on failure.
+char * gzipFile( int fd, size_t size, size_t * length ) {
+  char * in = (char *)malloc( size );
+  if ( in == NULL ) {
+    return NULL;
+  }
+  size_t got = 0;
+  while ( got < size ) {
+    ssize_t n = pread( fd, in + got, size - got, got );
+    if ( n <= 0 ) {
+      if ( n < 0 && errno == EINTR ) {
+	continue;
+      }
+      free( in );
+      return NULL;
+    }
+    got += n;
+  }
+
+  z_stream z;
+  memset( &z, 0, sizeof(z) );
+  // 16 more window bits ask for a gzip header instead of a zlib one
+  if ( deflateInit2( &z, encodingConfig.level, Z_DEFLATED, 15 + 16, 8,
+	Z_DEFAULT_STRATEGY ) != Z_OK ) {
+    free( in );
+    return NULL;
+  }
+
+  size_t bound = deflateBound( &z, size );
+  char * out = (char *)malloc( bound );
+  if ( out != NULL ) {
+    z.next_in = (Bytef *)in;
+    z.avail_in = size;
+    z.next_out = (Bytef *)out;
+    z.avail_out = bound;
+    if ( deflate( &z, Z_FINISH ) == Z_STREAM_END ) {
+      *length = z.total_out;
+    } else {
+      LOG( LOG_WARN, "deflate failed: %s", z.msg ? z.msg : "?" );
+      free( out );
+      out = NULL;
+    }
+  }
+  deflateEnd( &z );
+  free( in );
+  return out;
+}
@@ -0,0 +1,23 @@
+#ifndef CONTENT_ENCODING_H
+#define CONTENT_ENCODING_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "http-parser.h"
+
+// Tunables of gzip compression
+struct EncodingConfig {
+  int level;           // zlib level, 0 only serves precompressed .gz files
+  size_t minSize;      // smaller files are not worth compressing
+  size_t maxFileSize;  // larger ones are sent as they are
+};
+
+extern EncodingConfig encodingConfig;
+
+int compressible( const char * contentType );
+int acceptsGzip( const HttpRequest * r );
+int worthCompressing( off_t size );
+char * gzipFile( int fd, size_t size, size_t * length );
+
+#endif
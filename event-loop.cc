@@ -0,0 +1,439 @@
+//------------------------------------------------------------------------
+// Event loop used by myhttpd -e.
+//
+// Every reactor thread owns an epoll instance and waits on the shared
+// listening socket (EPOLLEXCLUSIVE, so only one thread wakes up per new
+// connection) plus the client sockets it accepted itself. Sockets are
+// non-blocking and edge-triggered; a Connection records how far along
+// its request is so respond()'s read/parse/write steps can be resumed
+// whenever the socket becomes ready again. A CGI script's stdin and
+// stdout pipes are watched alongside the socket and wake up the same
+// Connection, so a slow script never holds up the reactor.
+//
+// Each reactor keeps its connections on an idle list ordered by last
+// activity. Since the keep-alive timeout is the same for everybody, the
+// head of the list is always the next one to expire and epoll_wait()
+// only has to sleep until then.
+//
+// Out of file descriptors, accept() fails while connections are still
+// queued, and being edge-triggered the listening socket won't report
+// them again. The reactor tries again every ACCEPT_RETRY_MS instead,
+// until they are taken.
+//
+// eventLoopDrain() makes the reactors stop taking connections and return
+// once the ones they have are done, which is how a prefork worker is
+// retired. SIGQUIT is only taken while a reactor waits in epoll_pwait(),
+// so whoever blocks it elsewhere can use it to drain the loop. It wakes
+// up the other reactors through an eventfd they all watch.
+//------------------------------------------------------------------------
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "admission.h"
+#include "log.h"
+#include "metrics.h"
+#include "myhttpd.h"
+
+#define MAX_EVENTS 256
+#define ACCEPT_RETRY_MS 100
+
+struct Reactor {
+  int epfd;
+  IdleList idle;
+  Connection * closed;    // to be freed after the events at hand
+  int draining;           // no longer accepting
+  long long acceptRetry;  // when to call accept() again, 0 if not out of descriptors
+};
+
+static volatile sig_atomic_t draining;
+// written to by eventLoopDrain(), the data pointer of its event is
+// &drainFd
+static int drainFd = -1;
+
+static time_t now() {
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec;
+}
+
+static long long nowMs() {
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+void idleRemove( IdleList * l, Connection * c ) {
+  if ( c->prev ) {
+    c->prev->next = c->next;
+  } else {
+    l->head = c->next;
+  }
+  if ( c->next ) {
+    c->next->prev = c->prev;
+  } else {
+    l->tail = c->prev;
+  }
+  c->prev = c->next = NULL;
+}
+
+void idleAppend( IdleList * l, Connection * c ) {
+  c->lastActive = now();
+  c->prev = l->tail;
+  c->next = NULL;
+  if ( l->tail ) {
+    l->tail->next = c;
+  } else {
+    l->head = c;
+  }
+  l->tail = c;
+}
+
+// The least recently active connection if it saw no activity for the
+// keep-alive timeout. Otherwise NULL, and timeout is set to how many
+// milliseconds are left until that happens (-1 for an empty list).
+Connection * idleExpired( IdleList * l, int * timeout ) {
+  // without keep-alive a connection still may not sit idle forever
+  int limit = KeepAliveTimeout > 0 ? KeepAliveTimeout : 60;
+  time_t t = now();
+
+  if ( l->head == NULL ) {
+    *timeout = -1;
+    return NULL;
+  }
+  if ( t - l->head->lastActive >= limit ) {
+    return l->head;
+  }
+  *timeout = ( l->head->lastActive + limit - t ) * 1000;
+  return NULL;
+}
+
+static void setNonBlocking( int fd ) {
+  int flags = fcntl( fd, F_GETFL );
+  if ( flags < 0 || fcntl( fd, F_SETFL, flags | O_NONBLOCK ) < 0 ) {
+    perror("fcntl");
+    exit( -1 );
+  }
+}
+
+// The pipes of a CGI script mean there may be more than one event for
+// the connection in hand, so it is only freed once they have been seen
+static void closeConnection( Reactor * r, Connection * c ) {
+  idleRemove( &r->idle, c );
+  // remove it explicitly, a CGI child may still hold a copy of the
+  // socket; connectionClose() does the same for the pipes
+  epoll_ctl( r->epfd, EPOLL_CTL_DEL, c->socket, NULL );
+  connectionClose( c );
+  c->state = CONN_CLOSED;
+  c->next = r->closed;
+  r->closed = c;
+}
+
+// Add a pipe to a CGI script to the epoll set
+static int watchPipe( Reactor * r, Connection * c, int fd, uint32_t events ) {
+  struct epoll_event event;
+  event.events = events | EPOLLET;
+  event.data.ptr = c;
+  if ( fd != -1 && epoll_ctl( r->epfd, EPOLL_CTL_ADD, fd, &event ) < 0 ) {
+    LOG( LOG_ERROR, "epoll_ctl: %s", strerror(errno) );
+    return -1;
+  }
+  return 0;
+}
+
+// Run the connection state machine as far as it goes without blocking,
+// serving every request the client pipelined
+static void advance( Reactor * r, Connection * c ) {
+  int result;
+
+  // there is activity, move to the back of the idle list
+  idleRemove( &r->idle, c );
+  idleAppend( &r->idle, c );
+
+  while ( 1 ) {
+    if ( c->state == CONN_READING ) {
+      result = connectionRead( c );
+      if ( result == IO_DONE ) {
+	result = connectionRespond( c );
+      }
+      if ( result == IO_AGAIN ) {
+	return;
+      }
+      if ( result == IO_CLOSE ) {
+	closeConnection( r, c );
+	return;
+      }
+      c->state = CONN_WRITING;
+
+      // connectionClose() takes the pipes out of the epoll set again
+      if ( watchPipe( r, c, c->cgiIn, EPOLLOUT ) < 0 ||
+	   watchPipe( r, c, c->cgiOut, EPOLLIN ) < 0 ) {
+	closeConnection( r, c );
+	return;
+      }
+    }
+
+    result = connectionWrite( c );
+    if ( result == IO_AGAIN ) {
+      return;
+    }
+    if ( result == IO_CLOSE || connectionNext( c ) == IO_CLOSE ) {
+      closeConnection( r, c );
+      return;
+    }
+  }
+}
+
+// Close connections that saw no activity for the keep-alive timeout.
+// Returns how long epoll_wait() may sleep before the next one expires.
+// One waiting for a CGI script is left to the script's timeout.
+static int expireIdle( Reactor * r ) {
+  int timeout;
+  Connection * c;
+  while ( (c = idleExpired( &r->idle, &timeout )) != NULL ) {
+    if ( c->output.buffer != NULL ) {
+      idleRemove( &r->idle, c );
+      idleAppend( &r->idle, c );
+    } else {
+      closeConnection( r, c );
+    }
+  }
+  return timeout;
+}
+
+static void acceptConnections( Reactor * r, int masterSocket ) {
+  while ( 1 ) {
+    int clientSocket = accept4( masterSocket, NULL, NULL,
+	SOCK_NONBLOCK | SOCK_CLOEXEC );
+
+    if ( clientSocket < 0 ) {
+      if ( errno == EINTR || errno == ECONNABORTED ) {
+	continue;
+      }
+      if ( errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM ) {
+	if ( r->acceptRetry == 0 ) {
+	  LOG( LOG_WARN, "accept: %s, waiting for connections to close",
+	      strerror(errno) );
+	}
+	r->acceptRetry = nowMs() + ACCEPT_RETRY_MS;
+	return;
+      }
+      if ( errno != EAGAIN && errno != EWOULDBLOCK ) {
+	LOG( LOG_ERROR, "accept: %s", strerror(errno) );
+      }
+      r->acceptRetry = 0;
+      return;
+    }
+    r->acceptRetry = 0;
+    metricsAccepted( clientSocket );
+    if ( !admissionEnter( clientSocket ) ) {
+      continue;
+    }
+
+    Connection * c = (Connection *)malloc( sizeof(Connection) );
+    if ( c == NULL ) {
+      admissionLeave();
+      admissionReject( clientSocket );
+      continue;
+    }
+    connectionInit( c, clientSocket );
+    c->epfd = r->epfd;
+
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = c;
+    if ( epoll_ctl( r->epfd, EPOLL_CTL_ADD, clientSocket, &event ) < 0 ) {
+      LOG( LOG_ERROR, "epoll_ctl: %s", strerror(errno) );
+      connectionClose( c );
+      free( c );
+      continue;
+    }
+    idleAppend( &r->idle, c );
+  }
+}
+
+static void freeClosed( Reactor * r ) {
+  while ( r->closed != NULL ) {
+    Connection * c = r->closed;
+    r->closed = c->next;
+    free( c );
+  }
+}
+
+// Stop accepting and close the connections that are between requests.
+// Returns 1 once there are none left.
+static int drain( Reactor * r, int masterSocket ) {
+  if ( !r->draining ) {
+    r->draining = 1;
+    epoll_ctl( r->epfd, EPOLL_CTL_DEL, masterSocket, NULL );
+    // the wakeup for connections still queued may have come here
+    acceptConnections( r, masterSocket );
+    // whatever is still served is the last request on its connection
+    MaxKeepAliveRequests = 0;
+  }
+
+  Connection * next;
+  for ( Connection * c = r->idle.head; c != NULL; c = next ) {
+    next = c->next;
+    if ( c->state == CONN_READING && c->received == 0 && c->requests > 0 ) {
+      closeConnection( r, c );
+    }
+  }
+  freeClosed( r );
+  return r->idle.head == NULL;
+}
+
+// Have every reactor drain. Safe in a signal handler.
+void eventLoopDrain() {
+  draining = 1;
+  if ( drainFd >= 0 ) {
+    eventfd_write( drainFd, 1 );
+  }
+}
+
+static void * reactorMain( void * masterSocketDescriptor ) {
+  int masterSocket = *(int *)masterSocketDescriptor;
+
+  Reactor reactor;
+  reactor.idle.head = NULL;
+  reactor.idle.tail = NULL;
+  reactor.closed = NULL;
+  reactor.draining = 0;
+  reactor.acceptRetry = 0;
+
+  int epfd = epoll_create1( EPOLL_CLOEXEC );
+  reactor.epfd = epfd;
+  if ( epfd < 0 ) {
+    perror( "epoll_create1" );
+    exit( -1 );
+  }
+
+  // a NULL data pointer marks the listening socket
+  struct epoll_event event;
+  event.events = EPOLLIN | EPOLLET | EPOLLEXCLUSIVE;
+  event.data.ptr = NULL;
+  if ( epoll_ctl( epfd, EPOLL_CTL_ADD, masterSocket, &event ) < 0 ) {
+    perror( "epoll_ctl" );
+    exit( -1 );
+  }
+  // edge-triggered, so every reactor wakes up once for it and is not
+  // woken again while draining
+  event.events = EPOLLIN | EPOLLET;
+  event.data.ptr = &drainFd;
+  if ( epoll_ctl( epfd, EPOLL_CTL_ADD, drainFd, &event ) < 0 ) {
+    perror( "epoll_ctl" );
+    exit( -1 );
+  }
+
+  sigset_t waitSignals;
+  pthread_sigmask( SIG_SETMASK, NULL, &waitSignals );
+  sigdelset( &waitSignals, SIGQUIT );
+
+  struct epoll_event events[MAX_EVENTS];
+  while ( 1 ) {
+    if ( draining && drain( &reactor, masterSocket ) ) {
+      break;
+    }
+
+    int timeout = expireIdle( &reactor );
+    if ( reactor.acceptRetry != 0 ) {
+      long long left = reactor.acceptRetry - nowMs();
+      if ( left < 0 ) {
+	left = 0;
+      }
+      if ( timeout < 0 || left < timeout ) {
+	timeout = (int)left;
+      }
+    }
+
+    int n = epoll_pwait( epfd, events, MAX_EVENTS, timeout, &waitSignals );
+    if ( n < 0 ) {
+      if ( errno == EINTR ) {
+	continue;
+      }
+      perror( "epoll_wait" );
+      exit( -1 );
+    }
+
+    for ( int i = 0; i < n; i++ ) {
+      Connection * c = (Connection *)events[i].data.ptr;
+
+      if ( c == NULL ) {
+	acceptConnections( &reactor, masterSocket );
+      } else if ( c == (Connection *)&drainFd ) {
+	// draining is checked at the top of the loop
+	continue;
+      } else if ( c->state == CONN_CLOSED ) {
+	continue;
+      } else if ( ( events[i].events & EPOLLERR ) && c->output.buffer == NULL ) {
+	closeConnection( &reactor, c );
+      } else {
+	// an error on a script's pipe shows up when it is next used
+	advance( &reactor, c );
+      }
+    }
+
+    if ( reactor.acceptRetry != 0 && !reactor.draining && nowMs() >= reactor.acceptRetry ) {
+      acceptConnections( &reactor, masterSocket );
+    }
+
+    freeClosed( &reactor );
+  }
+  close( epfd );
+  return NULL;
+}
+
+// Serve connections from a number of reactor threads, one per core for
+// 0, the calling thread being one of them. Returns once all of them
+// drained.
+void runEventLoop( int masterSocket, int reactors ) {
+  setNonBlocking( masterSocket );
+
+  drainFd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+  if ( drainFd < 0 ) {
+    perror( "eventfd" );
+    exit( -1 );
+  }
+
+  static int masterSock;
+  masterSock = masterSocket;
+
+  long cores = reactors;
+  if ( cores < 1 ) {
+    cores = sysconf( _SC_NPROCESSORS_ONLN );
+  }
+  if ( cores < 1 ) {
+    cores = 1;
+  }
+
+  LOG( LOG_INFO, "starting %ld reactor threads", cores );
+  pthread_t * threads = (pthread_t *)malloc( cores * sizeof(pthread_t) );
+  if ( threads == NULL ) {
+    perror( "malloc" );
+    exit( -1 );
+  }
+  for ( long i = 1; i < cores; i++ ) {
+    if ( pthread_create( &threads[i], NULL, reactorMain, (void *)&masterSock ) != 0 ) {
+      perror( "pthread_create" );
+      exit( -1 );
+    }
+  }
+
+  reactorMain( (void *)&masterSock );
+
+  // the others may still be finishing their last requests
+  for ( long i = 1; i < cores; i++ ) {
+    pthread_join( threads[i], NULL );
+  }
+  free( threads );
+}
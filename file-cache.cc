@@ -0,0 +1,498 @@
+//------------------------------------------------------------------------
+// Static content cache.
+//
+// Small files are kept in memory as ready-to-send responses, keyed by
+// their path on disk. Lookups take no lock: the hash chains are only
+// changed by writers holding cacheMutex, and an entry that gets removed
+// is not freed until every reader that might still be looking at it has
+// left cacheLookup(). Readers advertise the epoch they started in through
+// a per-thread slot; removed entries are retired with a newer epoch and
+// dropped once no slot is older than that. A reference count keeps an
+// entry alive while a response is still being sent from it.
+//
+// The cache holds at most cacheConfig.maxBytes. Eviction approximates
+// LRU with a clock: a hit only sets the entry's referenced bit, and the
+// eviction sweep gives referenced entries a second chance by moving them
+// to the back instead of dropping them.
+//
+// Besides the file itself an entry can hold an encoding of it, such as
+// a gzipped copy; the path and the encoding together are the key.
+//
+// An inotify watch on the directory of every cached file invalidates
+// entries as soon as the file changes. If inotify is not available every
+// hit is checked against the file's stat() data instead.
+//------------------------------------------------------------------------
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "file-cache.h"
+
+#define CACHE_BUCKETS 4096
+#define MAX_READERS 256
+
+CacheConfig cacheConfig = { 16 * 1024 * 1024, 64 * 1024 };
+
+// epoch a reader thread entered cacheLookup() in, 0 when outside
+struct ReaderSlot {
+  unsigned long epoch;
+  int used;
+} __attribute__((aligned(64)));
+
+static ReaderSlot readers[MAX_READERS];
+static __thread ReaderSlot * mySlot;
+static pthread_key_t slotKey;
+static unsigned long globalEpoch = 1;
+
+static CacheEntry * buckets[CACHE_BUCKETS];
+static CacheEntry * lruHead;
+static CacheEntry * lruTail;
+static CacheEntry * retired;
+static size_t cachedBytes;
+
+// directories being watched, a directory reached through several
+// paths shares its watch descriptor
+struct Watch {
+  int wd;
+  char * dir;
+};
+
+static Watch * watches;
+static int watchCount;
+static int inotifyFd = -1;
+
+static pthread_mutex_t cacheMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int hashPath( const char * path ) {
+  // FNV-1a
+  unsigned int h = 2166136261u;
+  for ( const char * p = path; *p; p++ ) {
+    h = ( h ^ (unsigned char)*p ) * 16777619u;
+  }
+  return h;
+}
+
+static void releaseSlot( void * slot ) {
+  ReaderSlot * s = (ReaderSlot *)slot;
+  __atomic_store_n( &s->epoch, 0, __ATOMIC_RELEASE );
+  __atomic_store_n( &s->used, 0, __ATOMIC_RELEASE );
+}
+
+// Claim a reader slot for this thread, NULL if they are all taken
+static ReaderSlot * readerSlot() {
+  if ( mySlot != NULL ) {
+    return mySlot;
+  }
+  for ( int i = 0; i < MAX_READERS; i++ ) {
+    if ( !__atomic_load_n( &readers[i].used, __ATOMIC_RELAXED ) &&
+	 !__atomic_exchange_n( &readers[i].used, 1, __ATOMIC_ACQUIRE ) ) {
+      mySlot = &readers[i];
+      // give the slot back when the thread exits
+      pthread_setspecific( slotKey, mySlot );
+      return mySlot;
+    }
+  }
+  return NULL;
+}
+
+void cacheRelease( CacheEntry * e ) {
+  if ( __atomic_sub_fetch( &e->refs, 1, __ATOMIC_ACQ_REL ) == 0 ) {
+    free( e->path );
+    free( e->data );
+    free( e );
+  }
+}
+
+// Drop the cache's reference to retired entries no reader can reach
+// anymore. Called with cacheMutex held.
+static void reclaim() {
+  unsigned long oldest = ULONG_MAX;
+  for ( int i = 0; i < MAX_READERS; i++ ) {
+    unsigned long epoch = __atomic_load_n( &readers[i].epoch, __ATOMIC_SEQ_CST );
+    if ( epoch != 0 && epoch < oldest ) {
+      oldest = epoch;
+    }
+  }
+
+  CacheEntry ** link = &retired;
+  while ( *link != NULL ) {
+    CacheEntry * e = *link;
+    if ( e->retireEpoch <= oldest ) {
+      *link = e->retiredNext;
+      cacheRelease( e );
+    } else {
+      link = &e->retiredNext;
+    }
+  }
+}
+
+// Unlink an entry so new lookups can't find it. Called with cacheMutex held.
+static void removeEntry( CacheEntry * e ) {
+  CacheEntry ** link = &buckets[e->hash % CACHE_BUCKETS];
+  while ( *link != e ) {
+    link = &(*link)->next;
+  }
+  __atomic_store_n( link, e->next, __ATOMIC_RELEASE );
+
+  if ( e->lruPrev ) {
+    e->lruPrev->lruNext = e->lruNext;
+  } else {
+    lruHead = e->lruNext;
+  }
+  if ( e->lruNext ) {
+    e->lruNext->lruPrev = e->lruPrev;
+  } else {
+    lruTail = e->lruPrev;
+  }
+  cachedBytes -= e->headerLength + e->bodyLength;
+
+  // readers that started before this point may still be walking past it
+  e->retireEpoch = __atomic_add_fetch( &globalEpoch, 1, __ATOMIC_SEQ_CST );
+  e->retiredNext = retired;
+  retired = e;
+}
+
+static void lruAppend( CacheEntry * e ) {
+  e->lruPrev = lruTail;
+  e->lruNext = NULL;
+  if ( lruTail ) {
+    lruTail->lruNext = e;
+  } else {
+    lruHead = e;
+  }
+  lruTail = e;
+}
+
+// Make room for size more bytes. Called with cacheMutex held.
+static void evict( size_t size ) {
+  while ( lruHead != NULL && cachedBytes + size > cacheConfig.maxBytes ) {
+    CacheEntry * e = lruHead;
+    if ( __atomic_exchange_n( &e->referenced, 0, __ATOMIC_RELAXED ) ) {
+      // used since the last sweep, give it a second chance
+      if ( e->lruNext != NULL ) {
+	lruHead = e->lruNext;
+	lruHead->lruPrev = NULL;
+	lruAppend( e );
+      }
+    } else {
+      removeEntry( e );
+    }
+  }
+}
+
+static CacheEntry * findEntry( const char * path, unsigned int h, int encoding ) {
+  CacheEntry * e = __atomic_load_n( &buckets[h % CACHE_BUCKETS], __ATOMIC_ACQUIRE );
+  while ( e != NULL &&
+	  ( e->hash != h || e->encoding != encoding || strcmp( e->path, path ) != 0 ) ) {
+    e = __atomic_load_n( &e->next, __ATOMIC_ACQUIRE );
+  }
+  return e;
+}
+
+static int sameFile( const struct stat * a, const struct stat * b ) {
+  return a->st_ino == b->st_ino && a->st_dev == b->st_dev &&
+    a->st_size == b->st_size &&
+    a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+    a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+// Returns the cached response for path in the given encoding with a
+// reference held, or NULL
+CacheEntry * cacheLookup( const char * path, int encoding ) {
+  if ( cacheConfig.maxBytes == 0 ) {
+    return NULL;
+  }
+
+  unsigned int h = hashPath( path );
+  CacheEntry * e;
+  ReaderSlot * slot = readerSlot();
+
+  if ( slot != NULL ) {
+    __atomic_store_n( &slot->epoch,
+	__atomic_load_n( &globalEpoch, __ATOMIC_SEQ_CST ), __ATOMIC_SEQ_CST );
+    e = findEntry( path, h, encoding );
+    if ( e != NULL ) {
+      __atomic_add_fetch( &e->refs, 1, __ATOMIC_RELAXED );
+    }
+    __atomic_store_n( &slot->epoch, 0, __ATOMIC_RELEASE );
+  } else {
+    // more threads than reader slots, fall back to the lock
+    pthread_mutex_lock( &cacheMutex );
+    e = findEntry( path, h, encoding );
+    if ( e != NULL ) {
+      __atomic_add_fetch( &e->refs, 1, __ATOMIC_RELAXED );
+    }
+    pthread_mutex_unlock( &cacheMutex );
+  }
+
+  if ( e == NULL ) {
+    return NULL;
+  }
+  __atomic_store_n( &e->referenced, 1, __ATOMIC_RELAXED );
+
+  if ( inotifyFd < 0 ) {
+    // nobody tells us about changes, look for ourselves
+    struct stat st;
+    if ( stat( path, &st ) != 0 || !sameFile( &st, &e->st ) ) {
+      cacheRelease( e );
+      cacheInvalidate( path );
+      return NULL;
+    }
+  }
+  return e;
+}
+
+// Drop every encoding of path
+void cacheInvalidate( const char * path ) {
+  unsigned int h = hashPath( path );
+  pthread_mutex_lock( &cacheMutex );
+  for ( int encoding = 0; encoding < ENCODINGS; encoding++ ) {
+    CacheEntry * e = findEntry( path, h, encoding );
+    if ( e != NULL ) {
+      removeEntry( e );
+    }
+  }
+  reclaim();
+  pthread_mutex_unlock( &cacheMutex );
+}
+
+static void invalidateAll() {
+  pthread_mutex_lock( &cacheMutex );
+  while ( lruHead != NULL ) {
+    removeEntry( lruHead );
+  }
+  reclaim();
+  pthread_mutex_unlock( &cacheMutex );
+}
+
+// Watch the directory holding path. Called with cacheMutex held.
+static void watchDirectory( const char * path ) {
+  if ( inotifyFd < 0 ) {
+    return;
+  }
+
+  const char * slash = strrchr( path, '/' );
+  if ( slash == NULL ) {
+    return;
+  }
+  int length = slash - path;
+  for ( int i = 0; i < watchCount; i++ ) {
+    if ( (int)strlen( watches[i].dir ) == length &&
+	 !strncmp( watches[i].dir, path, length ) ) {
+      return;
+    }
+  }
+
+  char * dir = strndup( path, length );
+  int wd = inotify_add_watch( inotifyFd, dir,
+      IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE | IN_MOVED_FROM |
+      IN_MOVED_TO | IN_CREATE | IN_DELETE_SELF | IN_MOVE_SELF );
+  if ( wd < 0 ) {
+    perror( "inotify_add_watch" );
+    free( dir );
+    return;
+  }
+
+  watches = (Watch *)realloc( watches, ( watchCount + 1 ) * sizeof(Watch) );
+  watches[watchCount].wd = wd;
+  watches[watchCount].dir = dir;
+  watchCount++;
+}
+
+// Turn inotify events into invalidations
+static void * watchMain( void * ) {
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+  while ( 1 ) {
+    ssize_t n = read( inotifyFd, buf, sizeof(buf) );
+    if ( n <= 0 ) {
+      if ( n < 0 && errno == EINTR ) {
+	continue;
+      }
+      perror( "inotify read" );
+      return NULL;
+    }
+
+    for ( char * p = buf; p < buf + n; ) {
+      struct inotify_event * event = (struct inotify_event *)p;
+      p += sizeof(struct inotify_event) + event->len;
+
+      if ( event->mask & ( IN_Q_OVERFLOW | IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF ) ) {
+	// lost track of something, start over
+	invalidateAll();
+	pthread_mutex_lock( &cacheMutex );
+	for ( int i = 0; i < watchCount; ) {
+	  if ( event->mask & IN_Q_OVERFLOW || watches[i].wd == event->wd ) {
+	    free( watches[i].dir );
+	    watches[i] = watches[--watchCount];
+	  } else {
+	    i++;
+	  }
+	}
+	pthread_mutex_unlock( &cacheMutex );
+	continue;
+      }
+      if ( event->len == 0 ) {
+	continue;
+      }
+
+      // collect the paths first, cacheInvalidate() takes the mutex itself
+      char paths[8][PATH_MAX];
+      int count = 0;
+      pthread_mutex_lock( &cacheMutex );
+      for ( int i = 0; i < watchCount && count < 8; i++ ) {
+	if ( watches[i].wd == event->wd ) {
+	  snprintf( paths[count++], PATH_MAX, "%s/%s", watches[i].dir, event->name );
+	}
+      }
+      pthread_mutex_unlock( &cacheMutex );
+
+      for ( int i = 0; i < count; i++ ) {
+	cacheInvalidate( paths[i] );
+      }
+    }
+  }
+}
+
+// Put e, holding size bytes, into the cache unless the file behind fd
+// has changed from st. Returns e, or NULL if it has been dropped.
+static CacheEntry * insert( CacheEntry * e, int fd, const struct stat * st, size_t size ) {
+  pthread_mutex_lock( &cacheMutex );
+
+  // a change from here on is reported after the entry is in place,
+  // one made while we were reading shows up now
+  struct stat now;
+  if ( fstat( fd, &now ) != 0 || !sameFile( &now, st ) ) {
+    pthread_mutex_unlock( &cacheMutex );
+    free( e->path );
+    free( e->data );
+    free( e );
+    return NULL;
+  }
+
+  CacheEntry * old = findEntry( e->path, e->hash, e->encoding );
+  if ( old != NULL ) {
+    removeEntry( old );
+  }
+  evict( size );
+
+  e->next = buckets[e->hash % CACHE_BUCKETS];
+  __atomic_store_n( &buckets[e->hash % CACHE_BUCKETS], e, __ATOMIC_RELEASE );
+  lruAppend( e );
+  cachedBytes += size;
+  reclaim();
+  pthread_mutex_unlock( &cacheMutex );
+
+  return e;
+}
+
+// A new entry with room for size bytes of data, NULL if there is no
+// memory or the cache could never hold it
+static CacheEntry * newEntry( const char * path, int encoding, const struct stat * st,
+    size_t headerLength, size_t bodyLength ) {
+  size_t size = headerLength + bodyLength;
+  if ( cacheConfig.maxBytes == 0 || size > cacheConfig.maxBytes ) {
+    return NULL;
+  }
+
+  CacheEntry * e = (CacheEntry *)calloc( 1, sizeof(CacheEntry) );
+  char * data = (char *)malloc( size );
+  if ( e == NULL || data == NULL ) {
+    free( e );
+    free( data );
+    return NULL;
+  }
+
+  // watch before reading so a change made meanwhile is not missed
+  pthread_mutex_lock( &cacheMutex );
+  watchDirectory( path );
+  pthread_mutex_unlock( &cacheMutex );
+
+  e->path = strdup( path );
+  e->hash = hashPath( path );
+  e->encoding = encoding;
+  e->st = *st;
+  e->refs = 2; // the cache's and the caller's
+  e->headerLength = headerLength;
+  e->bodyLength = bodyLength;
+  e->data = data;
+  return e;
+}
+
+// Read the whole file and cache it, behind header, as a response. The
+// file may already be in some encoding, a precompressed .gz for one.
+// Returns the entry with a reference held, or NULL if the file should not
+// be cached.
+CacheEntry * cacheFill( const char * path, int encoding, int fd, const struct stat * st,
+    const char * header, size_t headerLength ) {
+  if ( (size_t)st->st_size > cacheConfig.maxFileSize ) {
+    return NULL;
+  }
+
+  CacheEntry * e = newEntry( path, encoding, st, headerLength, st->st_size );
+  if ( e == NULL ) {
+    return NULL;
+  }
+
+  memcpy( e->data, header, headerLength );
+  size_t got = 0;
+  while ( got < (size_t)st->st_size ) {
+    ssize_t n = pread( fd, e->data + headerLength + got, st->st_size - got, got );
+    if ( n <= 0 ) {
+      if ( n < 0 && errno == EINTR ) {
+	continue;
+      }
+      free( e->path );
+      free( e->data );
+      free( e );
+      return NULL;
+    }
+    got += n;
+  }
+
+  return insert( e, fd, st, headerLength + st->st_size );
+}
+
+// Cache an encoding of the file behind fd, which st describes, as a
+// response made of header and body. Returns the entry with a reference
+// held, or NULL if it does not fit.
+CacheEntry * cacheStore( const char * path, int encoding, int fd, const struct stat * st,
+    const char * header, size_t headerLength, const char * body, size_t bodyLength ) {
+  CacheEntry * e = newEntry( path, encoding, st, headerLength, bodyLength );
+  if ( e == NULL ) {
+    return NULL;
+  }
+
+  memcpy( e->data, header, headerLength );
+  memcpy( e->data + headerLength, body, bodyLength );
+  return insert( e, fd, st, headerLength + bodyLength );
+}
+
+void cacheInit() {
+  if ( cacheConfig.maxBytes == 0 ) {
+    return;
+  }
+
+  pthread_key_create( &slotKey, releaseSlot );
+
+  inotifyFd = inotify_init1( IN_CLOEXEC );
+  if ( inotifyFd < 0 ) {
+    perror( "inotify_init1, checking cached files with stat() instead" );
+    return;
+  }
+
+  pthread_t thread;
+  if ( pthread_create( &thread, NULL, watchMain, NULL ) != 0 ) {
+    perror( "pthread_create" );
+    close( inotifyFd );
+    inotifyFd = -1;
+    return;
+  }
+  pthread_detach( thread );
+}
@@ -0,0 +1,51 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+// Tunables of the static content cache, see cacheInit()
+struct CacheConfig {
+  size_t maxBytes;    // budget for all cached responses, 0 disables
+  size_t maxFileSize; // larger files are always sent from disk
+};
+
+extern CacheConfig cacheConfig;
+
+// An entry holds the file as it is on disk or one of its encodings
+enum {
+  ENCODING_IDENTITY,
+  ENCODING_GZIP,
+  ENCODINGS
+};
+
+// A preassembled response: the header up to (not including) the
+// Connection line, followed by the body
+struct CacheEntry {
+  CacheEntry * next;         // hash chain
+  CacheEntry * lruPrev;      // eviction order, oldest first
+  CacheEntry * lruNext;
+  CacheEntry * retiredNext;  // waiting for readers to move on
+  unsigned long retireEpoch;
+  unsigned int hash;
+  int encoding;              // ENCODING_IDENTITY or the body's encoding
+  int refs;                  // the cache's own plus one per response
+  int referenced;            // hit since the clock hand last passed
+  struct stat st;            // what the file looked like when cached
+  char * path;
+  size_t headerLength;
+  size_t bodyLength;
+  char * data;
+};
+
+void cacheInit();
+CacheEntry * cacheLookup( const char * path, int encoding );
+CacheEntry * cacheFill( const char * path, int encoding, int fd, const struct stat * st,
+    const char * header, size_t headerLength );
+CacheEntry * cacheStore( const char * path, int encoding, int fd, const struct stat * st,
+    const char * header, size_t headerLength, const char * body, size_t bodyLength );
+void cacheRelease( CacheEntry * e );
+void cacheInvalidate( const char * path );
+
+#endif
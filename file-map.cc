@@ -0,0 +1,124 @@
+//------------------------------------------------------------------------
+// Shared mappings of large files.
+//
+// Files of at least mapMinSize bytes are mapped once and sent with
+// send() straight from the mapping. The table is keyed by device, inode,
+// size and modification time, so concurrent downloads of the same file
+// share one mapping (and the page cache pages behind it) while a file
+// that changed gets a fresh one. A mapping is unmapped when the last
+// response using it is done.
+//
+// The mapping is only ever read by the kernel inside send(): if the file
+// is truncated while it is being sent, send() fails with EFAULT instead
+// of the server taking a SIGBUS.
+//------------------------------------------------------------------------
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "file-map.h"
+#include "log.h"
+
+#define MAP_BUCKETS 256
+
+// how far ahead of the send position pages are asked for
+#define MAP_WINDOW (4 * 1024 * 1024)
+
+off_t mapMinSize = 0;
+
+static FileMap * buckets[MAP_BUCKETS];
+static pthread_mutex_t mapMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int hashFile( dev_t dev, ino_t ino ) {
+  return (unsigned int)( ino * 2654435761u ^ dev ) % MAP_BUCKETS;
+}
+
+// Find or create the mapping of the file open on fd. Returns NULL if it
+// can't be mapped, the caller then sends it from the descriptor.
+FileMap * mapAcquire( int fd, const struct stat * st ) {
+  if ( st->st_size == 0 ) {
+    return NULL;
+  }
+
+  unsigned int h = hashFile( st->st_dev, st->st_ino );
+
+  pthread_mutex_lock( &mapMutex );
+  for ( FileMap * m = buckets[h]; m != NULL; m = m->next ) {
+    if ( m->dev == st->st_dev && m->ino == st->st_ino && m->size == st->st_size &&
+	 m->mtime.tv_sec == st->st_mtim.tv_sec &&
+	 m->mtime.tv_nsec == st->st_mtim.tv_nsec ) {
+      m->refs++;
+      pthread_mutex_unlock( &mapMutex );
+      return m;
+    }
+  }
+
+  FileMap * m = (FileMap *)malloc( sizeof(FileMap) );
+  if ( m == NULL ) {
+    pthread_mutex_unlock( &mapMutex );
+    return NULL;
+  }
+
+  void * data = mmap( NULL, st->st_size, PROT_READ, MAP_SHARED, fd, 0 );
+  if ( data == MAP_FAILED ) {
+    LOG( LOG_WARN, "mmap: %s", strerror(errno) );
+    pthread_mutex_unlock( &mapMutex );
+    free( m );
+    return NULL;
+  }
+
+  // read ahead aggressively and start on the first two windows right
+  // away, mapAdvise() keeps one window ahead from there
+  madvise( data, st->st_size, MADV_SEQUENTIAL );
+  madvise( data, st->st_size < 2 * MAP_WINDOW ? st->st_size : 2 * MAP_WINDOW,
+      MADV_WILLNEED );
+
+  m->dev = st->st_dev;
+  m->ino = st->st_ino;
+  m->size = st->st_size;
+  m->mtime = st->st_mtim;
+  m->refs = 1;
+  m->data = (char *)data;
+  m->next = buckets[h];
+  buckets[h] = m;
+  pthread_mutex_unlock( &mapMutex );
+
+  return m;
+}
+
+// Called as a response moves from offset from to offset to. When that
+// crosses into a new window, ask for the window after it.
+void mapAdvise( FileMap * m, off_t from, off_t to ) {
+  if ( from / MAP_WINDOW == to / MAP_WINDOW ) {
+    return;
+  }
+
+  off_t start = ( to / MAP_WINDOW + 1 ) * (off_t)MAP_WINDOW;
+  if ( start >= m->size ) {
+    return;
+  }
+  off_t length = m->size - start < MAP_WINDOW ? m->size - start : MAP_WINDOW;
+  madvise( m->data + start, length, MADV_WILLNEED );
+}
+
+void mapRelease( FileMap * m ) {
+  pthread_mutex_lock( &mapMutex );
+  if ( --m->refs > 0 ) {
+    pthread_mutex_unlock( &mapMutex );
+    return;
+  }
+
+  FileMap ** p = &buckets[hashFile( m->dev, m->ino )];
+  while ( *p != m ) {
+    p = &(*p)->next;
+  }
+  *p = m->next;
+  pthread_mutex_unlock( &mapMutex );
+
+  munmap( m->data, m->size );
+  free( m );
+}
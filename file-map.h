@@ -0,0 +1,28 @@
+#ifndef FILE_MAP_H
+#define FILE_MAP_H
+
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+// Files of at least this many bytes are sent from a shared mapping,
+// 0 sends everything with sendfile()
+extern off_t mapMinSize;
+
+// A read-only mapping of a whole file, shared by every response that
+// sends the same version of the file
+struct FileMap {
+  FileMap * next;           // hash chain
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
+  int refs;                 // one per response sending from it
+  char * data;
+};
+
+FileMap * mapAcquire( int fd, const struct stat * st );
+void mapAdvise( FileMap * m, off_t from, off_t to );
+void mapRelease( FileMap * m );
+
+#endif
@@ -0,0 +1,738 @@
+//------------------------------------------------------------------------
+// Program:   http-bench
+//
+// Purpose:   load an HTTP server with many connections and measure its
+//            throughput and latency. Each thread drives its share of the
+//            connections from one epoll loop, sends requests for a mix
+//            of URLs round-robin, keeps up to depth of them in flight on
+//            a connection and records how long every response took in
+//            an HDR-style histogram.
+//
+// Syntax:    http-bench [options] host port [path ...]
+//
+//               host    - name of a computer on which server is executing
+//               port    - protocol port number server is using
+//               path    - documents to request, added to the mix
+//
+//            Options:
+//               -c N    - connections, 16 by default
+//               -t N    - threads the connections are spread over, 4
+//               -d S    - seconds to measure, 10
+//               -w S    - seconds of warm-up that are not measured, 0
+//               -p N    - requests pipelined on a connection, 1
+//               -n      - a new connection for every request
+//               -f FILE - add the paths in FILE, one per line, to the mix
+//               -r DIR  - add every file under DIR, a document root, as /path
+//               -H      - print the whole latency distribution
+//
+//------------------------------------------------------------------------
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdlib.h>
+
+#define MAX_DEPTH 64
+#define MAX_PATHS 4096
+#define BUFFER_SIZE ( 64 * 1024 )
+
+// Latencies in microseconds, exact below 256 and from there on in 128
+// steps per power of two, so every value is within 1% of its bucket
+#define LINEAR 256
+#define STEP_BITS 7
+#define STEPS ( 1 << STEP_BITS )
+#define BUCKETS ( LINEAR + 40 * STEPS )
+
+struct Histogram {
+  long counts[BUCKETS];
+  long total;
+  long max;
+  double sum;
+};
+
+enum {
+  RESPONSE_HEADER,      // waiting for the whole status line and header
+  RESPONSE_BODY,        // remaining bytes of the body left
+  RESPONSE_CHUNK_SIZE,  // waiting for a chunk-size line
+  RESPONSE_CHUNK_DATA,  // remaining bytes of a chunk and its CRLF left
+  RESPONSE_TRAILER,     // waiting for the empty line after the last chunk
+  RESPONSE_UNTIL_CLOSE  // the body ends when the server closes
+};
+
+struct BenchConnection {
+  int fd;
+  int next;                    // index of the next path to request
+  int sentOnConnection;        // requests sent since it was opened
+  int closing;                 // the response being read is the last one
+  // requests in flight, oldest first, by when they were sent
+  double sentAt[MAX_DEPTH];
+  int first;
+  int inFlight;
+  // requests not written yet
+  char out[MAX_DEPTH * 512];
+  int outStart;
+  int outEnd;
+  // the response being read
+  char in[BUFFER_SIZE];
+  int inLength;
+  int state;
+  long remaining;
+};
+
+struct BenchThread {
+  pthread_t thread;
+  int first;                   // its connections, as indexes into all of them
+  int count;
+  long requests;
+  long errors;
+  long statuses[6];            // responses by status class, 1xx to 5xx
+  long long bytes;
+  Histogram latency;
+};
+
+struct sockaddr_in socketAddress;
+const char * hostName;
+const char * paths[MAX_PATHS];
+int pathCount;
+int depth = 1;
+int newConnections;
+double measureTime;
+double stopTime;
+
+  double
+now()
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+  void
+printUsage()
+{
+  printf( "Usage: http-bench [options] <host> <port> [path ...]\n");
+  printf( "\n");
+  printf( "          -c N     connections (16)\n");
+  printf( "          -t N     threads (4)\n");
+  printf( "          -d S     seconds to measure (10)\n");
+  printf( "          -w S     seconds of warm-up (0)\n");
+  printf( "          -p N     requests pipelined per connection (1)\n");
+  printf( "          -n       new connection for every request\n");
+  printf( "          -f FILE  add the paths listed in FILE\n");
+  printf( "          -r DIR   add every file under the document root DIR\n");
+  printf( "          -H       print the whole latency distribution\n");
+  printf( "\n");
+  printf( "Examples:\n");
+  printf( "\n");
+  printf( "          http-bench localhost 14566 /simple.html\n");
+  printf( "          http-bench -c 64 -p 8 -r http-root-dir/htdocs localhost 14566\n");
+  printf( "\n");
+}
+
+//------------------------------------------------------------------------
+// Latency histogram
+//------------------------------------------------------------------------
+
+static int bucketOf( long value ) {
+  if ( value < LINEAR ) {
+    return value < 0 ? 0 : value;
+  }
+  int top = 63 - __builtin_clzl( value );
+  int shift = top - STEP_BITS;
+  int bucket = LINEAR + ( shift - 1 ) * STEPS + ( ( value >> shift ) - STEPS );
+  return bucket < BUCKETS ? bucket : BUCKETS - 1;
+}
+
+// The largest value that lands in bucket
+static long bucketValue( int bucket ) {
+  if ( bucket < LINEAR ) {
+    return bucket;
+  }
+  int shift = ( bucket - LINEAR ) / STEPS + 1;
+  long step = ( bucket - LINEAR ) % STEPS + STEPS;
+  return ( ( step + 1 ) << shift ) - 1;
+}
+
+static void record( Histogram * h, long value ) {
+  h->counts[bucketOf( value )]++;
+  h->total++;
+  h->sum += value;
+  if ( value > h->max ) {
+    h->max = value;
+  }
+}
+
+static void merge( Histogram * to, const Histogram * from ) {
+  for ( int i = 0; i < BUCKETS; i++ ) {
+    to->counts[i] += from->counts[i];
+  }
+  to->total += from->total;
+  to->sum += from->sum;
+  if ( from->max > to->max ) {
+    to->max = from->max;
+  }
+}
+
+// The value below which percentile percent of all values are
+static long percentile( const Histogram * h, double percent ) {
+  long wanted = (long)( h->total * percent / 100 + 0.5 );
+  if ( wanted < 1 ) {
+    wanted = 1;
+  }
+  long seen = 0;
+  for ( int i = 0; i < BUCKETS; i++ ) {
+    seen += h->counts[i];
+    if ( seen >= wanted ) {
+      long value = bucketValue( i );
+      return value < h->max ? value : h->max;
+    }
+  }
+  return h->max;
+}
+
+// Percentiles the way HdrHistogram prints them, in milliseconds, closer
+// together towards the tail. Its plotter takes this as it is.
+static void printDistribution( const Histogram * h ) {
+  printf( "%12s %14s %10s %14s\n\n", "Value", "Percentile", "TotalCount", "1/(1-Percentile)" );
+  long seen = 0;
+  double next = 0;
+  for ( int i = 0; i < BUCKETS && seen < h->total; i++ ) {
+    if ( h->counts[i] == 0 ) {
+      continue;
+    }
+    seen += h->counts[i];
+    double fraction = (double)seen / h->total;
+    if ( fraction < next && seen < h->total ) {
+      continue;
+    }
+    long value = bucketValue( i ) < h->max ? bucketValue( i ) : h->max;
+    if ( seen < h->total ) {
+      printf( "%12.3f %14.12f %10ld %14.2f\n", value / 1000.0, fraction, seen,
+	  1 / ( 1 - fraction ) );
+    } else {
+      printf( "%12.3f %14.12f %10ld\n", value / 1000.0, fraction, seen );
+    }
+    // five lines per halving of what is left
+    double left = 1 - fraction;
+    next = fraction + left / 2 / 5;
+  }
+  printf( "#[Mean    = %12.3f, Max = %12.3f]\n", h->sum / h->total / 1000, h->max / 1000.0 );
+  printf( "#[Total count    = %12ld]\n", h->total );
+}
+
+//------------------------------------------------------------------------
+// URL mix
+//------------------------------------------------------------------------
+
+static void addPath( const char * path ) {
+  if ( pathCount == MAX_PATHS ) {
+    fprintf( stderr, "more than %d paths, ignoring %s\n", MAX_PATHS, path );
+    return;
+  }
+  paths[pathCount++] = strdup( path );
+}
+
+// One path per line, blank lines and lines starting with # skipped
+static void addPathFile( const char * name ) {
+  FILE * f = fopen( name, "r" );
+  if ( f == NULL ) {
+    perror( name );
+    exit(1);
+  }
+  char line[1024];
+  while ( fgets( line, sizeof(line), f ) != NULL ) {
+    line[strcspn( line, "\r\n" )] = '\0';
+    if ( line[0] != '\0' && line[0] != '#' ) {
+      addPath( line );
+    }
+  }
+  fclose( f );
+}
+
+// Every regular file under root/relative as /relative
+static void addDocuments( const char * root, const char * relative ) {
+  char dirName[1024];
+  snprintf( dirName, sizeof(dirName), "%s%s", root, relative );
+  DIR * dir = opendir( dirName );
+  if ( dir == NULL ) {
+    perror( dirName );
+    exit(1);
+  }
+
+  struct dirent * entry;
+  while ( ( entry = readdir( dir ) ) != NULL ) {
+    if ( entry->d_name[0] == '.' ) {
+      continue;
+    }
+    char path[1024];
+    char file[2048];
+    struct stat st;
+    snprintf( path, sizeof(path), "%s/%s", relative, entry->d_name );
+    snprintf( file, sizeof(file), "%s%s", root, path );
+    if ( stat( file, &st ) < 0 ) {
+      continue;
+    }
+    if ( S_ISDIR( st.st_mode ) ) {
+      addDocuments( root, path );
+    } else if ( S_ISREG( st.st_mode ) ) {
+      addPath( path );
+    }
+  }
+  closedir( dir );
+}
+
+//------------------------------------------------------------------------
+// Connections
+//------------------------------------------------------------------------
+
+// Queue the next request of the mix on c
+static void queueRequest( BenchConnection * c ) {
+  const char * path = paths[c->next];
+  c->next = ( c->next + 1 ) % pathCount;
+
+  int space = sizeof(c->out) - c->outEnd;
+  int n = snprintf( c->out + c->outEnd, space,
+      "GET %s HTTP/1.1\r\nHost: %s\r\n%s\r\n", path, hostName,
+      newConnections ? "Connection: close\r\n" : "" );
+  if ( n >= space ) {
+    fprintf( stderr, "request for %s too long\n", path );
+    exit(1);
+  }
+  c->outEnd += n;
+  c->sentAt[( c->first + c->inFlight ) % MAX_DEPTH] = now();
+  c->inFlight++;
+  c->sentOnConnection++;
+}
+
+// Keep depth requests in flight, or just the one for -n, and write what
+// the socket takes. Returns -1 if the connection failed.
+static int sendRequests( BenchConnection * c ) {
+  int limit = newConnections ? 1 : depth;
+  while ( c->inFlight < limit && !c->closing &&
+	  !( newConnections && c->sentOnConnection > 0 ) ) {
+    queueRequest( c );
+  }
+
+  while ( c->outStart < c->outEnd ) {
+    int n = send( c->fd, c->out + c->outStart, c->outEnd - c->outStart, MSG_NOSIGNAL );
+    if ( n < 0 ) {
+      return errno == EAGAIN || errno == EINPROGRESS ? 0 : -1;
+    }
+    c->outStart += n;
+  }
+  c->outStart = c->outEnd = 0;
+  return 0;
+}
+
+static int openConnection( int epfd, BenchConnection * c ) {
+  c->fd = socket( PF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0 );
+  if ( c->fd < 0 ) {
+    perror( "socket" );
+    exit(1);
+  }
+  int one = 1;
+  setsockopt( c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one) );
+  if ( connect( c->fd, (struct sockaddr *)&socketAddress, sizeof(socketAddress) ) < 0 &&
+       errno != EINPROGRESS ) {
+    close( c->fd );
+    c->fd = -1;
+    return -1;
+  }
+
+  c->sentOnConnection = 0;
+  c->closing = 0;
+  c->first = 0;
+  c->inFlight = 0;
+  c->outStart = c->outEnd = 0;
+  c->inLength = 0;
+  c->state = RESPONSE_HEADER;
+
+  struct epoll_event event;
+  event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+  event.data.ptr = c;
+  epoll_ctl( epfd, EPOLL_CTL_ADD, c->fd, &event );
+  if ( sendRequests( c ) < 0 ) {
+    close( c->fd );
+    c->fd = -1;
+    return -1;
+  }
+  return 0;
+}
+
+// Close c and open it again. If it failed, the requests still in flight
+// count as errors, as does every attempt to connect that fails.
+static void reopen( int epfd, BenchConnection * c, BenchThread * t, int failed ) {
+  if ( c->fd >= 0 ) {
+    close( c->fd );
+  }
+  if ( failed && now() >= measureTime ) {
+    t->errors += c->inFlight > 0 ? c->inFlight : 1;
+  }
+  while ( openConnection( epfd, c ) < 0 ) {
+    if ( now() >= stopTime ) {
+      return;
+    }
+    if ( now() >= measureTime ) {
+      t->errors++;
+    }
+    usleep( 1000 );
+  }
+}
+
+static int headerIs( const char * line, const char * lineEnd, const char * name ) {
+  int n = strlen( name );
+  return lineEnd - line > n && line[n] == ':' && !strncasecmp( line, name, n );
+}
+
+static int valueHas( const char * line, const char * lineEnd, const char * word ) {
+  int n = strlen( word );
+  for ( const char * p = line; p + n <= lineEnd; p++ ) {
+    if ( !strncasecmp( p, word, n ) ) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Parse the status line and header of length bytes at p and set up for
+// the body. Returns -1 if it isn't HTTP.
+static int startResponse( BenchConnection * c, BenchThread * t, const char * p, int length ) {
+  const char * end = p + length;
+  if ( length < 12 || strncmp( p, "HTTP/1.", 7 ) ) {
+    return -1;
+  }
+  int status = atoi( p + 9 );
+  int keepAlive = p[7] == '1';
+  long contentLength = -1;
+  int chunked = 0;
+
+  for ( p = (const char *)memchr( p, '\n', end - p ) + 1; p < end; ) {
+    const char * lineEnd = (const char *)memchr( p, '\n', end - p );
+    if ( headerIs( p, lineEnd, "Content-Length" ) ) {
+      contentLength = atol( p + 15 );
+    } else if ( headerIs( p, lineEnd, "Transfer-Encoding" ) ) {
+      chunked = valueHas( p, lineEnd, "chunked" );
+    } else if ( headerIs( p, lineEnd, "Connection" ) ) {
+      if ( valueHas( p, lineEnd, "close" ) ) {
+	keepAlive = 0;
+      } else if ( valueHas( p, lineEnd, "keep-alive" ) ) {
+	keepAlive = 1;
+      }
+    }
+    p = lineEnd + 1;
+  }
+
+  if ( now() >= measureTime && status >= 100 && status < 600 ) {
+    t->statuses[status / 100]++;
+  }
+  if ( status < 200 ) {
+    // interim, the real response follows
+    c->state = RESPONSE_HEADER;
+    return 0;
+  }
+  c->closing = !keepAlive || newConnections;
+  if ( status == 204 || status == 304 ) {
+    c->state = RESPONSE_BODY;
+    c->remaining = 0;
+  } else if ( chunked ) {
+    c->state = RESPONSE_CHUNK_SIZE;
+  } else if ( contentLength >= 0 ) {
+    c->state = RESPONSE_BODY;
+    c->remaining = contentLength;
+  } else {
+    c->state = RESPONSE_UNTIL_CLOSE;
+    c->closing = 1;
+  }
+  return 0;
+}
+
+// The oldest request in flight on c got its whole response
+static void finishResponse( BenchConnection * c, BenchThread * t ) {
+  double sent = c->sentAt[c->first];
+  c->first = ( c->first + 1 ) % MAX_DEPTH;
+  c->inFlight--;
+  c->state = RESPONSE_HEADER;
+  if ( sent >= measureTime ) {
+    t->requests++;
+    record( &t->latency, (long)( ( now() - sent ) * 1e6 ) );
+  }
+}
+
+// Consume the responses in c->in. Returns 1 if the connection is to be
+// closed, -1 if the server sent something that isn't HTTP.
+static int parseResponses( BenchConnection * c, BenchThread * t ) {
+  int used = 0;
+  int result = 0;
+  while ( result == 0 ) {
+    char * p = c->in + used;
+    int left = c->inLength - used;
+    char * line = (char *)memchr( p, '\n', left );
+
+    if ( c->state == RESPONSE_HEADER ) {
+      char * end = NULL;
+      for ( char * q = line; q != NULL; q = (char *)memchr( q + 1, '\n', p + left - q - 1 ) ) {
+	if ( q + 1 < p + left && q[1] == '\n' ) {
+	  end = q + 2;
+	  break;
+	}
+	if ( q + 2 < p + left && q[1] == '\r' && q[2] == '\n' ) {
+	  end = q + 3;
+	  break;
+	}
+      }
+      if ( end == NULL ) {
+	if ( used == 0 && left == BUFFER_SIZE ) {
+	  result = -1;
+	}
+	break;
+      }
+      if ( startResponse( c, t, p, end - p ) < 0 ) {
+	result = -1;
+	break;
+      }
+      used += end - p;
+    } else if ( c->state == RESPONSE_BODY || c->state == RESPONSE_CHUNK_DATA ) {
+      int n = left < c->remaining ? left : c->remaining;
+      used += n;
+      c->remaining -= n;
+      if ( c->remaining > 0 ) {
+	break;
+      }
+      if ( c->state == RESPONSE_CHUNK_DATA ) {
+	c->state = RESPONSE_CHUNK_SIZE;
+	continue;
+      }
+      result = c->closing;
+      finishResponse( c, t );
+    } else if ( c->state == RESPONSE_CHUNK_SIZE ) {
+      if ( line == NULL ) {
+	break;
+      }
+      long size = strtol( p, NULL, 16 );
+      used += line + 1 - p;
+      if ( size == 0 ) {
+	c->state = RESPONSE_TRAILER;
+      } else {
+	c->state = RESPONSE_CHUNK_DATA;
+	c->remaining = size + 2;
+      }
+    } else if ( c->state == RESPONSE_TRAILER ) {
+      if ( line == NULL ) {
+	break;
+      }
+      int empty = line == p || ( line == p + 1 && *p == '\r' );
+      used += line + 1 - p;
+      if ( empty ) {
+	result = c->closing;
+	finishResponse( c, t );
+      }
+    } else {
+      used = c->inLength;
+      break;
+    }
+  }
+
+  t->bytes += used;
+  memmove( c->in, c->in + used, c->inLength - used );
+  c->inLength -= used;
+  return result;
+}
+
+// Read what has arrived on c. Returns 1 if the server is done with the
+// connection, -1 if it failed.
+static int receive( BenchConnection * c, BenchThread * t ) {
+  for ( ;; ) {
+    int n = read( c->fd, c->in + c->inLength, BUFFER_SIZE - c->inLength );
+    if ( n < 0 ) {
+      return errno == EAGAIN ? 0 : -1;
+    }
+    if ( n == 0 ) {
+      // fine between responses and for one that ends this way, which
+      // like one saying Connection: close leaves the rest unanswered
+      if ( c->state == RESPONSE_UNTIL_CLOSE ) {
+	finishResponse( c, t );
+	return 1;
+      }
+      return c->inFlight == 0 && c->state == RESPONSE_HEADER ? 1 : -1;
+    }
+    c->inLength += n;
+    int result = parseResponses( c, t );
+    if ( result != 0 ) {
+      return result;
+    }
+  }
+}
+
+  void *
+benchThread( void * arg )
+{
+  BenchThread * t = (BenchThread *)arg;
+  int epfd = epoll_create1( 0 );
+  BenchConnection * connections =
+    (BenchConnection *)calloc( t->count, sizeof(BenchConnection) );
+
+  for ( int i = 0; i < t->count; i++ ) {
+    BenchConnection * c = &connections[i];
+    // connections start at different places in the mix
+    c->next = ( t->first + i ) % pathCount;
+    c->fd = -1;
+    reopen( epfd, c, t, 0 );
+  }
+
+  struct epoll_event events[64];
+  while ( now() < stopTime ) {
+    int n = epoll_wait( epfd, events, 64, 100 );
+    for ( int i = 0; i < n; i++ ) {
+      BenchConnection * c = (BenchConnection *)events[i].data.ptr;
+      int result = ( events[i].events & EPOLLERR ) ? -1 : 0;
+      if ( result == 0 && ( events[i].events & ( EPOLLIN | EPOLLHUP ) ) ) {
+	result = receive( c, t );
+      }
+      if ( result == 0 ) {
+	result = sendRequests( c );
+      }
+      if ( result != 0 ) {
+	reopen( epfd, c, t, result < 0 );
+      }
+    }
+  }
+
+  for ( int i = 0; i < t->count; i++ ) {
+    if ( connections[i].fd >= 0 ) {
+      close( connections[i].fd );
+    }
+  }
+  free( connections );
+  close( epfd );
+  return NULL;
+}
+
+  int
+main(int argc, char **argv)
+{
+  int connectionCount = 16;
+  int threads = 4;
+  int seconds = 10;
+  int warmup = 0;
+  int distribution = 0;
+
+  int opt;
+  while ( ( opt = getopt( argc, argv, "c:t:d:w:p:nf:r:H" ) ) != -1 ) {
+    switch ( opt ) {
+    case 'c': connectionCount = atoi( optarg ); break;
+    case 't': threads = atoi( optarg ); break;
+    case 'd': seconds = atoi( optarg ); break;
+    case 'w': warmup = atoi( optarg ); break;
+    case 'p': depth = atoi( optarg ); break;
+    case 'n': newConnections = 1; break;
+    case 'f': addPathFile( optarg ); break;
+    case 'r': addDocuments( optarg, "" ); break;
+    case 'H': distribution = 1; break;
+    default:
+      printUsage();
+      exit(1);
+    }
+  }
+  if ( argc - optind < 2 ) {
+    printUsage();
+    exit(1);
+  }
+
+  hostName = argv[optind];
+  int port = atoi( argv[optind + 1] );
+  for ( int i = optind + 2; i < argc; i++ ) {
+    addPath( argv[i] );
+  }
+  if ( pathCount == 0 ) {
+    addPath( "/" );
+  }
+
+  if ( port <= 0 || connectionCount <= 0 || threads <= 0 || seconds <= 0 || warmup < 0 ||
+       depth <= 0 || depth > MAX_DEPTH ) {
+    printUsage();
+    exit(1);
+  }
+  if ( threads > connectionCount ) {
+    threads = connectionCount;
+  }
+
+  memset( (char *)&socketAddress, 0, sizeof(socketAddress) );
+  socketAddress.sin_family = AF_INET;
+  socketAddress.sin_port = htons( (u_short)port );
+
+  struct hostent * ptrh = gethostbyname( hostName );
+  if ( ptrh == NULL ) {
+    fprintf( stderr, "invalid host: %s\n", hostName );
+    exit(1);
+  }
+  memcpy( &socketAddress.sin_addr, ptrh->h_addr, ptrh->h_length );
+
+  BenchThread * pool = (BenchThread *)calloc( threads, sizeof(BenchThread) );
+  measureTime = now() + warmup;
+  stopTime = measureTime + seconds;
+
+  for ( int i = 0; i < threads; i++ ) {
+    // connections spread as evenly as they go
+    pool[i].first = connectionCount * i / threads;
+    pool[i].count = connectionCount * ( i + 1 ) / threads - pool[i].first;
+    if ( pthread_create( &pool[i].thread, NULL, benchThread, &pool[i] ) != 0 ) {
+      perror( "pthread_create" );
+      exit(1);
+    }
+  }
+
+  long requests = 0;
+  long errors = 0;
+  long statuses[6] = { 0 };
+  long long bytes = 0;
+  Histogram * latency = (Histogram *)calloc( 1, sizeof(Histogram) );
+  for ( int i = 0; i < threads; i++ ) {
+    pthread_join( pool[i].thread, NULL );
+    requests += pool[i].requests;
+    errors += pool[i].errors;
+    bytes += pool[i].bytes;
+    for ( int j = 0; j < 6; j++ ) {
+      statuses[j] += pool[i].statuses[j];
+    }
+    merge( latency, &pool[i].latency );
+  }
+
+  printf( "%d connections over %d threads, %d paths, %s\n",
+      connectionCount, threads, pathCount,
+      newConnections ? "a new connection per request" :
+      depth > 1 ? "keep-alive, pipelined" : "keep-alive" );
+  printf( "%ld requests, %ld errors in %d s\n", requests, errors, seconds );
+  printf( "responses: 1xx %ld, 2xx %ld, 3xx %ld, 4xx %ld, 5xx %ld\n",
+      statuses[1], statuses[2], statuses[3], statuses[4], statuses[5] );
+  printf( "%.0f requests/s, %.2f MB/s\n",
+      (double)requests / seconds, bytes / 1e6 / seconds );
+  if ( latency->total > 0 ) {
+    printf( "latency ms: mean %.3f, p50 %.3f, p90 %.3f, p99 %.3f, p99.9 %.3f, max %.3f\n",
+	latency->sum / latency->total / 1000,
+	percentile( latency, 50 ) / 1000.0, percentile( latency, 90 ) / 1000.0,
+	percentile( latency, 99 ) / 1000.0, percentile( latency, 99.9 ) / 1000.0,
+	latency->max / 1000.0 );
+    if ( distribution ) {
+      printf( "\n" );
+      printDistribution( latency );
+    }
+  }
+
+  free( latency );
+  free( pool );
+  exit(0);
+}
@@ -0,0 +1,193 @@
+//------------------------------------------------------------------------
+// Incremental HTTP request parser.
+//
+// httpParse() is called again every time more bytes arrive and picks up
+// where it stopped, so a request split across segments costs no more
+// than one that arrived whole. It keeps no state outside the HttpRequest
+// and never allocates: method, URI, version and headers are views into
+// the receive buffer. Lines are found with memchr(), which glibc already
+// implements with vector instructions.
+//------------------------------------------------------------------------
+
+#include <string.h>
+#include <strings.h>
+
+#include "http-parser.h"
+
+void httpParserInit( HttpRequest * r ) {
+  r->status = PARSE_AGAIN;
+  r->scanned = 0;
+  r->lineStart = 0;
+  r->length = 0;
+  r->method.data = r->uri.data = r->path.data = r->query.data = r->version.data = NULL;
+  r->method.length = r->uri.length = r->path.length = r->version.length = 0;
+  r->query.length = -1;
+  r->headerCount = 0;
+}
+
+static int isBlank( char ch ) {
+  return ch == ' ' || ch == '\t';
+}
+
+// Cut the next blank separated word off [*p, end)
+static StringView nextWord( const char ** p, const char * end ) {
+  while ( *p < end && isBlank( **p ) ) {
+    (*p)++;
+  }
+  StringView word;
+  word.data = *p;
+  while ( *p < end && !isBlank( **p ) ) {
+    (*p)++;
+  }
+  word.length = *p - word.data;
+  return word;
+}
+
+// Is there a ".." segment in the path, which would climb out of the
+// directory the path is looked up in?
+static int climbsOut( const StringView * path ) {
+  const char * p = path->data;
+  const char * end = path->data + path->length;
+  while ( p < end ) {
+    const char * slash = (const char *)memchr( p, '/', end - p );
+    const char * next = slash ? slash : end;
+    if ( next - p == 2 && p[0] == '.' && p[1] == '.' ) {
+      return 1;
+    }
+    p = next + 1;
+  }
+  return 0;
+}
+
+// METHOD SP URI SP VERSION
+static int parseRequestLine( HttpRequest * r, const char * line, const char * end ) {
+  r->method = nextWord( &line, end );
+  r->uri = nextWord( &line, end );
+  r->version = nextWord( &line, end );
+  nextWord( &line, end );
+
+  if ( r->method.length == 0 || r->uri.length == 0 || r->version.length == 0 ||
+       line != end ) {
+    return PARSE_ERROR;
+  }
+
+  const char * q = (const char *)memchr( r->uri.data, '?', r->uri.length );
+  r->path.data = r->uri.data;
+  if ( q != NULL ) {
+    r->path.length = q - r->uri.data;
+    r->query.data = q + 1;
+    r->query.length = r->uri.length - r->path.length - 1;
+  } else {
+    r->path.length = r->uri.length;
+  }
+  return climbsOut( &r->path ) ? PARSE_ERROR : PARSE_AGAIN;
+}
+
+// name ":" OWS value OWS
+static int parseHeader( HttpRequest * r, const char * line, const char * end ) {
+  // continuation lines are obsolete and a smuggling risk
+  if ( isBlank( *line ) || r->headerCount == MAX_HEADERS ) {
+    return PARSE_ERROR;
+  }
+
+  const char * colon = (const char *)memchr( line, ':', end - line );
+  if ( colon == NULL || colon == line || isBlank( colon[-1] ) ) {
+    return PARSE_ERROR;
+  }
+
+  const char * value = colon + 1;
+  while ( value < end && isBlank( *value ) ) {
+    value++;
+  }
+  while ( end > value && isBlank( end[-1] ) ) {
+    end--;
+  }
+
+  HttpHeader * h = &r->headers[r->headerCount++];
+  h->name.data = line;
+  h->name.length = colon - line;
+  h->value.data = value;
+  h->value.length = end - value;
+  return PARSE_AGAIN;
+}
+
+// Parse buffer[0, length), of which everything up to the previous call
+// has been seen already. Returns PARSE_DONE once the empty line ending
+// the header is in, PARSE_AGAIN if more bytes are needed.
+int httpParse( HttpRequest * r, const char * buffer, int length ) {
+  while ( r->status == PARSE_AGAIN ) {
+    const char * nl = (const char *)memchr( buffer + r->scanned, '\n',
+	length - r->scanned );
+    if ( nl == NULL ) {
+      r->scanned = length;
+      break;
+    }
+
+    const char * line = buffer + r->lineStart;
+    const char * end = nl;
+    if ( end > line && end[-1] == '\r' ) {
+      end--;
+    }
+    r->scanned = r->lineStart = nl + 1 - buffer;
+
+    if ( r->method.data == NULL ) {
+      // be lenient about empty lines before the request line
+      if ( end > line ) {
+	r->status = parseRequestLine( r, line, end );
+      }
+    } else if ( end == line ) {
+      r->length = r->scanned;
+      r->status = PARSE_DONE;
+    } else {
+      r->status = parseHeader( r, line, end );
+    }
+  }
+  return r->status;
+}
+
+// Value of the first header called name, NULL if there is none
+const StringView * httpFindHeader( const HttpRequest * r, const char * name ) {
+  for ( int i = 0; i < r->headerCount; i++ ) {
+    if ( viewCaseEquals( &r->headers[i].name, name ) ) {
+      return &r->headers[i].value;
+    }
+  }
+  return NULL;
+}
+
+// Does the comma separated list in value contain token?
+int httpHasToken( const StringView * value, const char * token ) {
+  const char * p = value->data;
+  const char * end = value->data + value->length;
+
+  while ( p < end ) {
+    const char * comma = (const char *)memchr( p, ',', end - p );
+    const char * next = comma ? comma : end;
+
+    StringView item = nextWord( &p, next );
+    if ( viewCaseEquals( &item, token ) ) {
+      return 1;
+    }
+    p = next + 1;
+  }
+  return 0;
+}
+
+// Comparisons with a C string
+int viewEquals( const StringView * v, const char * s ) {
+  return (int)strlen( s ) == v->length && !memcmp( v->data, s, v->length );
+}
+
+int viewCaseEquals( const StringView * v, const char * s ) {
+  return (int)strlen( s ) == v->length && !strncasecmp( v->data, s, v->length );
+}
+
+// Copy into a NUL terminated buffer. Returns -1 if it doesn't fit.
+int viewCopy( const StringView * v, char * buf, int size ) {
+  if ( v->length < 0 || v->length >= size ) {
+    return -1;
+  }
+  memcpy( buf, v->data, v->length );
+  buf[v->length] = '\0';
+  return v->length;
+}
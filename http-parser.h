@@ -0,0 +1,50 @@
+#ifndef HTTP_PARSER_H
+#define HTTP_PARSER_H
+
+#define MAX_HEADERS 32
+
+// A piece of the receive buffer. Not NUL terminated.
+struct StringView {
+  const char * data;
+  int length;
+};
+
+struct HttpHeader {
+  StringView name;
+  StringView value;
+};
+
+// result of httpParse()
+enum {
+  PARSE_DONE,   // the whole header has been parsed
+  PARSE_AGAIN,  // need more bytes
+  PARSE_ERROR   // not a request we understand
+};
+
+// Parser state and the parsed request. Views point into the buffer
+// handed to httpParse(), which must stay put until the request is served.
+struct HttpRequest {
+  int status;      // result of the last httpParse()
+  int scanned;     // bytes looked at so far
+  int lineStart;   // start of the line being parsed
+  int length;      // size of the request once done
+
+  StringView method;
+  StringView uri;
+  StringView path;   // uri up to the '?'
+  StringView query;  // after the '?', length -1 if there is none
+  StringView version;
+
+  HttpHeader headers[MAX_HEADERS];
+  int headerCount;
+};
+
+void httpParserInit( HttpRequest * r );
+int httpParse( HttpRequest * r, const char * buffer, int length );
+const StringView * httpFindHeader( const HttpRequest * r, const char * name );
+int httpHasToken( const StringView * value, const char * token );
+int viewEquals( const StringView * v, const char * s );
+int viewCaseEquals( const StringView * v, const char * s );
+int viewCopy( const StringView * v, char * buf, int size );
+
+#endif
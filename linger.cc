@@ -0,0 +1,234 @@
+//------------------------------------------------------------------------
+// Lingering close.
+//
+// A socket closed while input is still queued on it, or that gets more
+// after the close, makes the kernel answer with a reset instead of a
+// FIN, and a reset throws away whatever the client hadn't read yet:
+// a pipelining client loses the last response before the keep-alive
+// limit, a rejected one its 503. So a connection is shut down for
+// writing first, which sends the FIN after the response, and its input
+// is read and thrown away until the client closes too, or for at most
+// LINGER_MS, before the socket is closed.
+//
+// Most clients have closed, or do so within a round trip, so what is
+// there is drained at once. The others are handed to a thread that
+// waits for them with epoll, so no request thread or event loop ever
+// waits for a client to go away.
+//------------------------------------------------------------------------
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "linger.h"
+#include "log.h"
+
+// A socket waiting for its client's FIN. They are kept in the order
+// they were handed over, which is also the order of their deadlines.
+struct Lingering {
+  int socket;
+  long long deadline;
+  Lingering * next;
+  Lingering * prev;
+};
+
+static pthread_once_t lingerOnce = PTHREAD_ONCE_INIT;
+static pthread_mutex_t lingerMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t lingerDone = PTHREAD_COND_INITIALIZER;
+static int lingerEpoll = -1;
+static Lingering * oldest;
+static Lingering * newest;
+static Lingering * inherited; // the parent's, in a forked child
+
+static long long nowMs() {
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+// Read and throw away what is there. Returns 1 once the client has
+// closed, or the connection is gone, 0 if more may come.
+static int drain( int socket ) {
+  char buf[4096];
+  for ( ;; ) {
+    ssize_t n = recv( socket, buf, sizeof(buf), MSG_DONTWAIT );
+    if ( n > 0 ) {
+      continue;
+    }
+    if ( n < 0 && errno == EINTR ) {
+      continue;
+    }
+    return n == 0 || ( errno != EAGAIN && errno != EWOULDBLOCK );
+  }
+}
+
+// Called with the mutex held
+static void forget( Lingering * l ) {
+  if ( l->prev != NULL ) {
+    l->prev->next = l->next;
+  } else {
+    oldest = l->next;
+  }
+  if ( l->next != NULL ) {
+    l->next->prev = l->prev;
+  } else {
+    newest = l->prev;
+  }
+  epoll_ctl( lingerEpoll, EPOLL_CTL_DEL, l->socket, NULL );
+  close( l->socket );
+  free( l );
+  if ( oldest == NULL ) {
+    pthread_cond_broadcast( &lingerDone );
+  }
+}
+
+static void * lingerThread( void * ) {
+  struct epoll_event events[64];
+  for ( ;; ) {
+    pthread_mutex_lock( &lingerMutex );
+    // one handed over while the list was empty is looked at within
+    // LINGER_MS too
+    int timeout = LINGER_MS;
+    if ( oldest != NULL ) {
+      long long left = oldest->deadline - nowMs();
+      timeout = left > 0 ? (int)left : 0;
+    }
+    pthread_mutex_unlock( &lingerMutex );
+
+    int n = epoll_wait( lingerEpoll, events, 64, timeout );
+    if ( n < 0 && errno != EINTR ) {
+      LOG( LOG_ERROR, "linger epoll_wait: %s", strerror(errno) );
+      return NULL;
+    }
+
+    pthread_mutex_lock( &lingerMutex );
+    for ( int i = 0; i < n; i++ ) {
+      Lingering * l = (Lingering *)events[i].data.ptr;
+      if ( drain( l->socket ) ) {
+	forget( l );
+      }
+    }
+    long long now = nowMs();
+    while ( oldest != NULL && oldest->deadline <= now ) {
+      forget( oldest );
+    }
+    pthread_mutex_unlock( &lingerMutex );
+  }
+  return NULL;
+}
+
+// A forked child has none of the parent's threads. Its copies of the
+// lingering sockets are closed, the parent's thread closes the sockets
+// themselves, and the child starts a thread of its own if it needs one.
+// Only what is safe between fork() and exec() is done here, the list is
+// freed later by releaseInherited().
+static void lingerPrepare() {
+  pthread_mutex_lock( &lingerMutex );
+}
+
+static void lingerParent() {
+  pthread_mutex_unlock( &lingerMutex );
+}
+
+static void lingerChild() {
+  for ( Lingering * l = oldest; l != NULL; l = l->next ) {
+    close( l->socket );
+  }
+  if ( oldest != NULL ) {
+    newest->next = inherited;
+    inherited = oldest;
+  }
+  oldest = NULL;
+  newest = NULL;
+  if ( lingerEpoll >= 0 ) {
+    close( lingerEpoll );
+    lingerEpoll = -1;
+  }
+  lingerOnce = PTHREAD_ONCE_INIT;
+  pthread_mutex_unlock( &lingerMutex );
+}
+
+// Called with the mutex held
+static void releaseInherited() {
+  while ( inherited != NULL ) {
+    Lingering * l = inherited;
+    inherited = l->next;
+    free( l );
+  }
+}
+
+static void lingerStart() {
+  static int forkHandlers;
+  if ( !forkHandlers ) {
+    pthread_atfork( lingerPrepare, lingerParent, lingerChild );
+    forkHandlers = 1;
+  }
+  lingerEpoll = epoll_create1( EPOLL_CLOEXEC );
+  if ( lingerEpoll < 0 ) {
+    LOG( LOG_ERROR, "linger epoll_create1: %s", strerror(errno) );
+    return;
+  }
+  pthread_t thread;
+  int error = pthread_create( &thread, NULL, lingerThread, NULL );
+  if ( error != 0 ) {
+    LOG( LOG_ERROR, "linger pthread_create: %s", strerror(error) );
+    close( lingerEpoll );
+    lingerEpoll = -1;
+    return;
+  }
+  pthread_detach( thread );
+}
+
+// Close a connection whose client may still be sending. Whatever it
+// sends is read and dropped until it closes or for LINGER_MS, then the
+// socket is closed. Doesn't wait for the client.
+void lingerClose( int socket ) {
+  if ( shutdown( socket, SHUT_WR ) != 0 || drain( socket ) ) {
+    close( socket );
+    return;
+  }
+
+  pthread_once( &lingerOnce, lingerStart );
+  Lingering * l = (Lingering *)malloc( sizeof(Lingering) );
+  if ( lingerEpoll < 0 || l == NULL ) {
+    free( l );
+    close( socket );
+    return;
+  }
+  l->socket = socket;
+  l->deadline = nowMs() + LINGER_MS;
+  l->next = NULL;
+
+  pthread_mutex_lock( &lingerMutex );
+  releaseInherited();
+  l->prev = newest;
+  if ( newest != NULL ) {
+    newest->next = l;
+  } else {
+    oldest = l;
+  }
+  newest = l;
+  struct epoll_event event;
+  event.events = EPOLLIN | EPOLLRDHUP;
+  event.data.ptr = l;
+  if ( epoll_ctl( lingerEpoll, EPOLL_CTL_ADD, socket, &event ) != 0 ) {
+    forget( l );
+  }
+  pthread_mutex_unlock( &lingerMutex );
+}
+
+// Wait until every lingering socket is closed, for a process about to
+// exit, whose exit would close them at once
+void lingerFlush() {
+  pthread_mutex_lock( &lingerMutex );
+  releaseInherited();
+  while ( oldest != NULL ) {
+    pthread_cond_wait( &lingerDone, &lingerMutex );
+  }
+  pthread_mutex_unlock( &lingerMutex );
+}
@@ -0,0 +1,10 @@
+#ifndef LINGER_H
+#define LINGER_H
+
+// how long a closed connection's input is still read and thrown away
+#define LINGER_MS 2000
+
+void lingerClose( int socket );
+void lingerFlush();
+
+#endif
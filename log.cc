@@ -0,0 +1,353 @@
+//------------------------------------------------------------------------
+// Diagnostic and access log.
+//
+// A thread that logs formats its line on its own stack and appends it to
+// a ring buffer only that thread writes to, so logging takes no lock and
+// makes no system call. A writer thread drains every ring every few
+// milliseconds and writes whatever it collected with one write() per
+// log file. When a ring is full the line is dropped and counted rather
+// than making the request wait; the writer reports how many were lost.
+//
+// Rings are never freed. A thread that exits gives its ring up and the
+// next new thread takes it over, so the pool growing and shrinking
+// doesn't keep allocating.
+//
+// Timestamps are formatted once per second per thread. Until logStart()
+// runs, and in forked children where the writer thread doesn't exist,
+// lines are written directly. Prefork workers start one of their own
+// with logRestart().
+//------------------------------------------------------------------------
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+
+#define RING_SIZE (256 * 1024)
+#define MAX_RECORD 2048
+#define OUTPUT_SIZE (64 * 1024)
+#define FLUSH_INTERVAL_NS (10 * 1000 * 1000)
+
+LogConfig logConfig = { LOG_INFO, NULL, NULL };
+
+enum {
+  STREAM_DIAGNOSTIC,
+  STREAM_ACCESS,
+  STREAMS
+};
+
+// Single producer, single consumer. head and tail count bytes ever
+// written and consumed; a record is a 4 byte header (stream and length)
+// followed by the text, and may wrap around the end of data.
+struct LogRing {
+  unsigned long head __attribute__((aligned(64))); // advanced by the owner
+  unsigned long tail __attribute__((aligned(64))); // advanced by the writer
+  unsigned long dropped;
+  int owned;                                       // a live thread logs here
+  LogRing * next;
+  char data[RING_SIZE];
+};
+
+// what the writer collected for one log file
+struct Output {
+  int fd;
+  int used;
+  char buffer[OUTPUT_SIZE];
+};
+
+static const char * levelNames[] = { "error", "warn", "info", "debug" };
+
+static LogRing * rings;
+static __thread LogRing * myRing;
+static pthread_key_t ringKey;
+static int started;
+static unsigned long passes; // made by the writer over all the rings
+
+static Output outputs[STREAMS] = { { STDERR_FILENO, 0 }, { STDOUT_FILENO, 0 } };
+
+static __thread time_t stampSecond;
+static __thread char stamp[32];
+
+// Current time in common log format, formatted once per second
+const char * logTimestamp() {
+  time_t now = time( NULL );
+  if ( now != stampSecond || stamp[0] == '\0' ) {
+    struct tm tm;
+    localtime_r( &now, &tm );
+    strftime( stamp, sizeof(stamp), "%d/%b/%Y:%H:%M:%S %z", &tm );
+    stampSecond = now;
+  }
+  return stamp;
+}
+
+static void releaseRing( void * ring ) {
+  __atomic_store_n( &((LogRing *)ring)->owned, 0, __ATOMIC_RELEASE );
+}
+
+// The calling thread's ring: one given up by a thread that exited, or
+// a new one
+static LogRing * ring() {
+  if ( myRing != NULL ) {
+    return myRing;
+  }
+
+  LogRing * r;
+  for ( r = __atomic_load_n( &rings, __ATOMIC_ACQUIRE ); r != NULL; r = r->next ) {
+    int expected = 0;
+    if ( __atomic_compare_exchange_n( &r->owned, &expected, 1, 0,
+	  __ATOMIC_ACQ_REL, __ATOMIC_RELAXED ) ) {
+      break;
+    }
+  }
+
+  if ( r == NULL ) {
+    r = (LogRing *)aligned_alloc( 64, sizeof(LogRing) );
+    if ( r == NULL ) {
+      return NULL;
+    }
+    memset( r, 0, sizeof(LogRing) );
+    r->owned = 1;
+    r->next = __atomic_load_n( &rings, __ATOMIC_RELAXED );
+    while ( !__atomic_compare_exchange_n( &rings, &r->next, r, 0,
+	  __ATOMIC_RELEASE, __ATOMIC_RELAXED ) ) {
+    }
+  }
+
+  myRing = r;
+  pthread_setspecific( ringKey, r );
+  return r;
+}
+
+static void copyIn( LogRing * r, unsigned long position, const void * from, int length ) {
+  int offset = position % RING_SIZE;
+  int first = length < RING_SIZE - offset ? length : RING_SIZE - offset;
+  memcpy( r->data + offset, from, first );
+  memcpy( r->data, (const char *)from + first, length - first );
+}
+
+static void copyOut( LogRing * r, unsigned long position, void * to, int length ) {
+  int offset = position % RING_SIZE;
+  int first = length < RING_SIZE - offset ? length : RING_SIZE - offset;
+  memcpy( to, r->data + offset, first );
+  memcpy( (char *)to + first, r->data, length - first );
+}
+
+static void append( int stream, const char * text, int length ) {
+  if ( outputs[stream].fd < 0 ) {
+    return;
+  }
+
+  LogRing * r;
+  if ( !started || (r = ring()) == NULL ) {
+    write( outputs[stream].fd, text, length );
+    return;
+  }
+
+  unsigned long head = r->head;
+  unsigned long tail = __atomic_load_n( &r->tail, __ATOMIC_ACQUIRE );
+  unsigned int header = ( stream << 24 ) | length;
+
+  if ( RING_SIZE - ( head - tail ) < sizeof(header) + length ) {
+    __atomic_add_fetch( &r->dropped, 1, __ATOMIC_RELAXED );
+    return;
+  }
+
+  copyIn( r, head, &header, sizeof(header) );
+  copyIn( r, head + sizeof(header), text, length );
+  __atomic_store_n( &r->head, head + sizeof(header) + length, __ATOMIC_RELEASE );
+}
+
+static void format( int stream, const char * prefix, const char * format, va_list args ) {
+  char line[MAX_RECORD];
+  int length = snprintf( line, sizeof(line), "%s", prefix );
+  length += vsnprintf( line + length, sizeof(line) - length, format, args );
+
+  // truncated lines still end with a newline
+  if ( length >= (int)sizeof(line) ) {
+    length = sizeof(line) - 1;
+  }
+  if ( length == 0 || line[length - 1] != '\n' ) {
+    line[length++] = '\n';
+  }
+  append( stream, line, length );
+}
+
+void logMessage( int level, const char * format, ... ) {
+  if ( level > logConfig.level ) {
+    return;
+  }
+
+  char prefix[64];
+  snprintf( prefix, sizeof(prefix), "[%s] [%s] ", logTimestamp(), levelNames[level] );
+
+  va_list args;
+  va_start( args, format );
+  ::format( STREAM_DIAGNOSTIC, prefix, format, args );
+  va_end( args );
+}
+
+// One line of the access log, formatted by the caller
+void logAccess( const char * format, ... ) {
+  va_list args;
+  va_start( args, format );
+  ::format( STREAM_ACCESS, "", format, args );
+  va_end( args );
+}
+
+int logAccessEnabled() {
+  return outputs[STREAM_ACCESS].fd >= 0;
+}
+
+// Level called name, -1 if there is none
+int logLevel( const char * name ) {
+  for ( int i = 0; i < (int)( sizeof(levelNames) / sizeof(levelNames[0]) ); i++ ) {
+    if ( !strcmp( name, levelNames[i] ) ) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static void flush( Output * o ) {
+  int written = 0;
+  while ( written < o->used ) {
+    ssize_t n = write( o->fd, o->buffer + written, o->used - written );
+    if ( n < 0 && errno == EINTR ) {
+      continue;
+    }
+    if ( n <= 0 ) {
+      break;
+    }
+    written += n;
+  }
+  o->used = 0;
+}
+
+static void put( Output * o, const char * text, int length ) {
+  if ( o->used + length > OUTPUT_SIZE ) {
+    flush( o );
+  }
+  memcpy( o->buffer + o->used, text, length );
+  o->used += length;
+}
+
+static void * writerMain( void * ) {
+  char text[MAX_RECORD + 64];
+
+  while ( 1 ) {
+    int busy = 0;
+
+    for ( LogRing * r = __atomic_load_n( &rings, __ATOMIC_ACQUIRE ); r != NULL; r = r->next ) {
+      unsigned long head = __atomic_load_n( &r->head, __ATOMIC_ACQUIRE );
+      unsigned long tail = r->tail;
+
+      while ( tail < head ) {
+	unsigned int header;
+	copyOut( r, tail, &header, sizeof(header) );
+	int stream = header >> 24;
+	int length = header & 0xffffff;
+	copyOut( r, tail + sizeof(header), text, length );
+	put( &outputs[stream], text, length );
+	tail += sizeof(header) + length;
+	busy = 1;
+      }
+      __atomic_store_n( &r->tail, tail, __ATOMIC_RELEASE );
+
+      unsigned long dropped = __atomic_exchange_n( &r->dropped, 0, __ATOMIC_RELAXED );
+      if ( dropped > 0 ) {
+	int length = snprintf( text, sizeof(text), "[%s] [warn] log full, %lu lines dropped\n",
+	    logTimestamp(), dropped );
+	put( &outputs[STREAM_DIAGNOSTIC], text, length );
+      }
+    }
+
+    for ( int i = 0; i < STREAMS; i++ ) {
+      if ( outputs[i].used > 0 ) {
+	flush( &outputs[i] );
+      }
+    }
+    __atomic_add_fetch( &passes, 1, __ATOMIC_RELEASE );
+
+    if ( !busy ) {
+      struct timespec interval = { 0, FLUSH_INTERVAL_NS };
+      nanosleep( &interval, NULL );
+    }
+  }
+  return NULL;
+}
+
+// forked children have no writer thread
+static void afterFork() {
+  started = 0;
+}
+
+static int openLog( const char * path ) {
+  int fd = open( path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644 );
+  if ( fd < 0 ) {
+    perror( path );
+    exit( -1 );
+  }
+  return fd;
+}
+
+static void startWriter() {
+  // signals are for the threads serving requests
+  sigset_t all, old;
+  sigfillset( &all );
+  pthread_sigmask( SIG_BLOCK, &all, &old );
+
+  pthread_t thread;
+  if ( pthread_create( &thread, NULL, writerMain, NULL ) != 0 ) {
+    perror( "pthread_create" );
+  } else {
+    pthread_detach( thread );
+    started = 1;
+  }
+  pthread_sigmask( SIG_SETMASK, &old, NULL );
+}
+
+// Wait until everything logged so far is written, for a process that
+// is about to exit. The pass under way may have started before it was.
+void logFlush() {
+  if ( !started ) {
+    return;
+  }
+  unsigned long start = __atomic_load_n( &passes, __ATOMIC_ACQUIRE );
+  while ( __atomic_load_n( &passes, __ATOMIC_ACQUIRE ) < start + 2 ) {
+    struct timespec pause = { 0, 1000 * 1000 };
+    nanosleep( &pause, NULL );
+  }
+}
+
+// Open the log files and start the writer thread
+void logStart() {
+  if ( logConfig.file != NULL ) {
+    outputs[STREAM_DIAGNOSTIC].fd = openLog( logConfig.file );
+  }
+  if ( logConfig.accessLog != NULL ) {
+    outputs[STREAM_ACCESS].fd = strcmp( logConfig.accessLog, "off" ) ?
+      openLog( logConfig.accessLog ) : -1;
+  }
+
+  pthread_key_create( &ringKey, releaseRing );
+  pthread_atfork( NULL, NULL, afterFork );
+  startWriter();
+}
+
+// Give a forked child that goes on serving requests a writer thread of
+// its own. What is left in the rings it inherited is the parent's to
+// write.
+void logRestart() {
+  for ( LogRing * r = rings; r != NULL; r = r->next ) {
+    r->tail = r->head;
+    r->dropped = 0;
+  }
+  startWriter();
+}
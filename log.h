@@ -0,0 +1,38 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdarg.h>
+
+// severity of a diagnostic message, see --log-level
+enum {
+  LOG_ERROR,
+  LOG_WARN,
+  LOG_INFO,
+  LOG_DEBUG
+};
+
+// Tunables of the log, see logStart()
+struct LogConfig {
+  int level;              // messages above this level are dropped
+  const char * file;      // diagnostic log, NULL for stderr
+  const char * accessLog; // one line per request, NULL for stdout, "off" for none
+};
+
+extern LogConfig logConfig;
+
+// Skip formatting altogether for messages that would be dropped
+#define LOG( severity, ... ) \
+  do { if ( (severity) <= logConfig.level ) logMessage( (severity), __VA_ARGS__ ); } while ( 0 )
+
+void logStart();
+void logRestart();
+void logFlush();
+void logMessage( int level, const char * format, ... )
+  __attribute__((format(printf, 2, 3)));
+void logAccess( const char * format, ... )
+  __attribute__((format(printf, 1, 2)));
+int logAccessEnabled();
+const char * logTimestamp();
+int logLevel( const char * name );
+
+#endif
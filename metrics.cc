@@ -0,0 +1,412 @@
+//------------------------------------------------------------------------
+// Request metrics, served as /server-status in Prometheus text format.
+//
+// Every thread counts into a slot of its own: responses by status code,
+// bytes sent, connections, and a latency histogram per phase of serving
+// a request. Only the owning thread writes a slot, so counting is plain
+// loads and stores, and slots are aligned so neighbours don't share
+// cache lines. Nothing is added up until somebody asks for the status.
+//
+// As with the log's rings, slots are never freed. A thread that exits
+// gives its slot up with the counts still in it, and the next new thread
+// takes it over and counts on from there. When all slots are taken, the
+// threads left over share one that is updated with atomic adds.
+//
+// The slots live in one shared mapping made before any fork, so the
+// children of -f count into it too. A forked child uses the shared slot,
+// since its parent's thread keeps counting in the one it inherited.
+// Prefork workers do take slots of their own, and the master frees them
+// when a worker exits.
+//
+// Histograms are log-linear, exact to the microsecond below 8 us and
+// then in four steps per power of two, up to 67 s.
+//------------------------------------------------------------------------
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "admission.h"
+#include "metrics.h"
+#include "scheduler.h"
+#include "thread-pool.h"
+
+#define MAX_SLOTS 256
+#define MAX_LISTEN 64
+#define MIN_STATUS 100
+#define STATUSES 500
+#define LINEAR 8
+#define STEP_BITS 2
+#define STEPS ( 1 << STEP_BITS )
+#define BUCKETS ( LINEAR + 23 * STEPS + 1 ) // the last one for everything above 67 s
+
+struct MetricsSlot {
+  int owned;                         // pid of the live thread counting here, 0 if none
+  int shared;                        // several threads or processes count here
+  int used;                          // in slot 0: slots ever taken, the rest untouched
+  long long connections;
+  long long closed;
+  long long bytes;
+  long long statuses[STATUSES];
+  long long buckets[PHASES][BUCKETS];
+  long long sums[PHASES];            // in nanoseconds
+} __attribute__((aligned(64)));
+
+static const char * phaseNames[PHASES] = {
+  "accept", "parse", "open", "send", "cgi_start", "cgi", "request"
+};
+
+// slot 0 is the shared one
+static MetricsSlot * slots;
+static __thread MetricsSlot * mySlot;
+static pthread_key_t slotKey;
+
+// when each socket was accepted, by descriptor
+static long long * acceptedAt;
+static int acceptedSize;
+
+static int listening[MAX_LISTEN];
+static int listenCount;
+static time_t startTime;
+
+long long metricsNow() {
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void releaseSlot( void * slot ) {
+  __atomic_store_n( &((MetricsSlot *)slot)->owned, 0, __ATOMIC_RELEASE );
+}
+
+// forked children share a slot, the parent still owns theirs
+static void afterFork() {
+  if ( slots != NULL ) {
+    mySlot = &slots[0];
+  }
+}
+
+// A forked child that goes on serving requests, a prefork worker,
+// counts in slots of its own like its parent does
+void metricsChild() {
+  mySlot = NULL;
+}
+
+// Free the slots of a child that exited, counts and all, as its threads
+// never got to give them up
+void metricsReclaim( pid_t pid ) {
+  for ( int i = 1; i < MAX_SLOTS; i++ ) {
+    int expected = pid;
+    __atomic_compare_exchange_n( &slots[i].owned, &expected, 0, 0,
+	__ATOMIC_ACQ_REL, __ATOMIC_RELAXED );
+  }
+}
+
+// Set up the slots. Called once, before any thread starts or fork.
+void metricsInit() {
+  slots = (MetricsSlot *)mmap( NULL, MAX_SLOTS * sizeof(MetricsSlot),
+      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0 );
+  if ( slots == MAP_FAILED ) {
+    perror( "mmap" );
+    exit( -1 );
+  }
+  slots[0].owned = 1;
+  slots[0].shared = 1;
+  slots[0].used = 1;
+
+  struct rlimit limit;
+  acceptedSize = getrlimit( RLIMIT_NOFILE, &limit ) == 0 && limit.rlim_cur < 65536 ?
+    (int)limit.rlim_cur : 65536;
+  acceptedAt = (long long *)calloc( acceptedSize, sizeof(long long) );
+
+  pthread_key_create( &slotKey, releaseSlot );
+  pthread_atfork( NULL, NULL, afterFork );
+  startTime = time( NULL );
+}
+
+// The calling thread's slot: one given up by a thread that exited, a
+// fresh one, or the shared one when there are none left
+static MetricsSlot * slot() {
+  if ( mySlot != NULL ) {
+    return mySlot;
+  }
+  if ( slots == NULL ) {
+    return NULL;
+  }
+
+  for ( int i = 1; i < MAX_SLOTS; i++ ) {
+    int expected = 0;
+    if ( __atomic_compare_exchange_n( &slots[i].owned, &expected, (int)getpid(), 0,
+	  __ATOMIC_ACQ_REL, __ATOMIC_RELAXED ) ) {
+      mySlot = &slots[i];
+      pthread_setspecific( slotKey, mySlot );
+      int used = __atomic_load_n( &slots[0].used, __ATOMIC_RELAXED );
+      while ( used < i + 1 && !__atomic_compare_exchange_n( &slots[0].used, &used, i + 1, 0,
+	    __ATOMIC_RELEASE, __ATOMIC_RELAXED ) ) {
+      }
+      return mySlot;
+    }
+  }
+  mySlot = &slots[0];
+  return mySlot;
+}
+
+static inline void add( MetricsSlot * s, long long * counter, long long n ) {
+  if ( s->shared ) {
+    __atomic_fetch_add( counter, n, __ATOMIC_RELAXED );
+  } else {
+    __atomic_store_n( counter, *counter + n, __ATOMIC_RELAXED );
+  }
+}
+
+static int bucketOf( long long us ) {
+  if ( us < LINEAR ) {
+    return us < 0 ? 0 : us;
+  }
+  int top = 63 - __builtin_clzll( us );
+  int shift = top - STEP_BITS;
+  int bucket = LINEAR + ( shift - 1 ) * STEPS + (int)( ( us >> shift ) - STEPS );
+  return bucket < BUCKETS - 1 ? bucket : BUCKETS - 1;
+}
+
+// Upper bound of bucket in microseconds
+static long long bucketLimit( int bucket ) {
+  if ( bucket < LINEAR ) {
+    return bucket + 1;
+  }
+  int shift = ( bucket - LINEAR ) / STEPS + 1;
+  long long step = ( bucket - LINEAR ) % STEPS + STEPS;
+  return ( step + 1 ) << shift;
+}
+
+// A socket accepted connections come from, for the queue gauges
+void metricsListen( int socket ) {
+  if ( listenCount < MAX_LISTEN ) {
+    listening[listenCount++] = socket;
+  }
+}
+
+// socket was just accepted
+void metricsAccepted( int socket ) {
+  if ( socket >= 0 && socket < acceptedSize ) {
+    acceptedAt[socket] = metricsNow();
+  }
+}
+
+// A thread starts serving socket
+void metricsConnection( int socket ) {
+  MetricsSlot * s = slot();
+  if ( s == NULL ) {
+    return;
+  }
+  add( s, &s->connections, 1 );
+  if ( socket >= 0 && socket < acceptedSize && acceptedAt[socket] != 0 ) {
+    metricsPhase( PHASE_ACCEPT, metricsNow() - acceptedAt[socket] );
+    acceptedAt[socket] = 0;
+  }
+}
+
+void metricsClosed() {
+  MetricsSlot * s = slot();
+  if ( s != NULL ) {
+    add( s, &s->closed, 1 );
+  }
+}
+
+void metricsPhase( int phase, long long ns ) {
+  MetricsSlot * s = slot();
+  if ( s == NULL ) {
+    return;
+  }
+  add( s, &s->buckets[phase][bucketOf( ns / 1000 )], 1 );
+  add( s, &s->sums[phase], ns );
+}
+
+// A response went out, or as much of it as the client took
+void metricsResponse( int status, long long bytes ) {
+  MetricsSlot * s = slot();
+  if ( s == NULL ) {
+    return;
+  }
+  if ( status >= MIN_STATUS && status < MIN_STATUS + STATUSES ) {
+    add( s, &s->statuses[status - MIN_STATUS], 1 );
+  }
+  add( s, &s->bytes, bytes );
+}
+
+static long long sum( const long long * counter ) {
+  size_t offset = (const char *)counter - (const char *)&slots[0];
+  long long total = 0;
+  int used = __atomic_load_n( &slots[0].used, __ATOMIC_ACQUIRE );
+  for ( int i = 0; i < used; i++ ) {
+    total += __atomic_load_n( (const long long *)( (const char *)&slots[i] + offset ),
+	__ATOMIC_RELAXED );
+  }
+  return total;
+}
+
+// The kernel's count of connections dropped because an accept queue was
+// full, for the whole host
+static long long listenOverflows() {
+  FILE * f = fopen( "/proc/net/netstat", "r" );
+  if ( f == NULL ) {
+    return -1;
+  }
+
+  // a line of names followed by a line of values
+  char names[4096];
+  char values[4096];
+  long long result = -1;
+  while ( result < 0 && fgets( names, sizeof(names), f ) != NULL &&
+	  fgets( values, sizeof(values), f ) != NULL ) {
+    if ( strncmp( names, "TcpExt:", 7 ) ) {
+      continue;
+    }
+    char * nameSave;
+    char * valueSave;
+    char * name = strtok_r( names, " \n", &nameSave );
+    char * value = strtok_r( values, " \n", &valueSave );
+    while ( name != NULL && value != NULL ) {
+      if ( !strcmp( name, "ListenOverflows" ) ) {
+	result = atoll( value );
+	break;
+      }
+      name = strtok_r( NULL, " \n", &nameSave );
+      value = strtok_r( NULL, " \n", &valueSave );
+    }
+  }
+  fclose( f );
+  return result;
+}
+
+static void header( FILE * out, const char * name, const char * type, const char * help ) {
+  fprintf( out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type );
+}
+
+// Everything counted so far, added up across all slots
+void metricsFormat( FILE * out ) {
+  if ( slots == NULL ) {
+    return;
+  }
+
+  header( out, "myhttpd_responses_total", "counter", "Responses sent, by status code." );
+  for ( int i = 0; i < STATUSES; i++ ) {
+    long long n = sum( &slots[0].statuses[i] );
+    if ( n > 0 ) {
+      fprintf( out, "myhttpd_responses_total{code=\"%d\"} %lld\n", MIN_STATUS + i, n );
+    }
+  }
+
+  header( out, "myhttpd_sent_bytes_total", "counter", "Bytes of responses sent." );
+  fprintf( out, "myhttpd_sent_bytes_total %lld\n", sum( &slots[0].bytes ) );
+
+  long long connections = sum( &slots[0].connections );
+  header( out, "myhttpd_connections_total", "counter", "Connections served." );
+  fprintf( out, "myhttpd_connections_total %lld\n", connections );
+  header( out, "myhttpd_connections_open", "gauge", "Connections being served." );
+  fprintf( out, "myhttpd_connections_open %lld\n", connections - sum( &slots[0].closed ) );
+
+  header( out, "myhttpd_phase_seconds", "histogram",
+      "Time spent in each phase of serving a request." );
+  for ( int phase = 0; phase < PHASES; phase++ ) {
+    long long count = 0;
+    for ( int i = 0; i < BUCKETS; i++ ) {
+      count += sum( &slots[0].buckets[phase][i] );
+      if ( i < BUCKETS - 1 ) {
+	fprintf( out, "myhttpd_phase_seconds_bucket{phase=\"%s\",le=\"%.6f\"} %lld\n",
+	    phaseNames[phase], bucketLimit( i ) / 1e6, count );
+      } else {
+	fprintf( out, "myhttpd_phase_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %lld\n",
+	    phaseNames[phase], count );
+      }
+    }
+    fprintf( out, "myhttpd_phase_seconds_sum{phase=\"%s\"} %.9f\n",
+	phaseNames[phase], sum( &slots[0].sums[phase] ) / 1e9 );
+    fprintf( out, "myhttpd_phase_seconds_count{phase=\"%s\"} %lld\n",
+	phaseNames[phase], count );
+  }
+
+  // how far accepting falls behind
+  long long queued = 0;
+  long long limit = 0;
+  for ( int i = 0; i < listenCount; i++ ) {
+    struct tcp_info info;
+    socklen_t length = sizeof(info);
+    if ( getsockopt( listening[i], IPPROTO_TCP, TCP_INFO, &info, &length ) == 0 ) {
+      // for a listening socket, the accept queue and its limit
+      queued += info.tcpi_unacked;
+      limit += info.tcpi_sacked;
+    }
+  }
+  header( out, "myhttpd_accept_queue_length", "gauge",
+      "Connections waiting in the kernel to be accepted." );
+  fprintf( out, "myhttpd_accept_queue_length %lld\n", queued );
+  header( out, "myhttpd_accept_queue_limit", "gauge", "Room in the kernel's accept queues." );
+  fprintf( out, "myhttpd_accept_queue_limit %lld\n", limit );
+
+  long long overflows = listenOverflows();
+  if ( overflows >= 0 ) {
+    header( out, "myhttpd_host_listen_overflows_total", "counter",
+	"Connections the host dropped on a full accept queue, any server's." );
+    fprintf( out, "myhttpd_host_listen_overflows_total %lld\n", overflows );
+  }
+
+  int shedding;
+  long long limited, late;
+  admissionCounts( &shedding, &limited, &late );
+  header( out, "myhttpd_connections_limit", "gauge",
+      "Connections served at once before new ones get a 503, 0 for no limit." );
+  fprintf( out, "myhttpd_connections_limit %d\n", admissionConfig.maxConnections );
+  header( out, "myhttpd_shedding", "gauge",
+      "1 while connections that queued too long are turned away." );
+  fprintf( out, "myhttpd_shedding %d\n", shedding );
+  header( out, "myhttpd_rejected_connections_total", "counter",
+      "Connections turned away with a 503 before being served." );
+  fprintf( out, "myhttpd_rejected_connections_total{reason=\"limit\"} %lld\n", limited );
+  fprintf( out, "myhttpd_rejected_connections_total{reason=\"queue\"} %lld\n", late );
+
+  int threads, busy, waiting, size;
+  if ( poolCounts( &threads, &busy, &waiting, &size ) == 0 ) {
+    header( out, "myhttpd_pool_threads", "gauge", "Threads of the -p pool." );
+    fprintf( out, "myhttpd_pool_threads %d\n", threads );
+    header( out, "myhttpd_pool_busy_threads", "gauge", "Pool threads serving a connection." );
+    fprintf( out, "myhttpd_pool_busy_threads %d\n", busy );
+    header( out, "myhttpd_pool_queue_length", "gauge",
+	"Accepted connections waiting for a pool thread." );
+    fprintf( out, "myhttpd_pool_queue_length %d\n", waiting );
+    header( out, "myhttpd_pool_queue_limit", "gauge", "Room in the pool's queue." );
+    fprintf( out, "myhttpd_pool_queue_limit %d\n", size );
+  }
+
+  long long steals, full;
+  if ( schedulerCounts( &threads, &busy, &waiting, &size, &steals, &full ) == 0 ) {
+    header( out, "myhttpd_stolen_tasks_total", "counter",
+	"Tasks a -s worker took from another worker's deque." );
+    fprintf( out, "myhttpd_stolen_tasks_total %lld\n", steals );
+    header( out, "myhttpd_blocking_threads", "gauge",
+	"Threads of -s for scripts and uncached files." );
+    fprintf( out, "myhttpd_blocking_threads %d\n", threads );
+    header( out, "myhttpd_blocking_busy_threads", "gauge", "Blocking threads serving a request." );
+    fprintf( out, "myhttpd_blocking_busy_threads %d\n", busy );
+    header( out, "myhttpd_blocking_queue_length", "gauge",
+	"Requests waiting for a blocking thread." );
+    fprintf( out, "myhttpd_blocking_queue_length %d\n", waiting );
+    header( out, "myhttpd_blocking_queue_limit", "gauge", "Room in each of the blocking threads' queues." );
+    fprintf( out, "myhttpd_blocking_queue_limit %d\n", size );
+    header( out, "myhttpd_blocking_refused_total", "counter",
+	"Requests that got a 503 as the blocking threads' queue was full." );
+    fprintf( out, "myhttpd_blocking_refused_total %lld\n", full );
+  }
+
+  header( out, "process_start_time_seconds", "gauge",
+      "Start time of the process since the epoch in seconds." );
+  fprintf( out, "process_start_time_seconds %lld\n", (long long)startTime );
+}
@@ -0,0 +1,31 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+// Phases of serving a connection that get a latency histogram
+enum {
+  PHASE_ACCEPT,     // accept() returning to a thread taking the connection
+  PHASE_PARSE,      // first byte of a request to its whole header
+  PHASE_OPEN,       // finding the document and queuing the response
+  PHASE_SEND,       // sending the response
+  PHASE_CGI_START,  // setting a CGI script up and starting it
+  PHASE_CGI,        // the script running and its output being passed on
+  PHASE_REQUEST,    // first byte of a request to the end of its response
+  PHASES
+};
+
+void metricsInit();
+void metricsChild();
+void metricsReclaim( pid_t pid );
+long long metricsNow();
+void metricsListen( int socket );
+void metricsAccepted( int socket );
+void metricsConnection( int socket );
+void metricsClosed();
+void metricsPhase( int phase, long long ns );
+void metricsResponse( int status, long long bytes );
+void metricsFormat( FILE * out );
+
+#endif
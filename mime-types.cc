@@ -0,0 +1,206 @@
+//------------------------------------------------------------------------
+// Content type of a document, from its file name extension.
+//
+// The built-in types and those of an optional mime.types file go into
+// one open addressing hash table when the server starts; it is never
+// changed afterwards, so lookups take no lock. A lookup hashes the
+// extension where it sits in the file name, ignoring case, and copies
+// nothing. The strings of a loaded file stay in the buffer it was read
+// into.
+//------------------------------------------------------------------------
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "log.h"
+#include "mime-types.h"
+
+#define MIME_SLOTS 4096         // a power of 2
+#define MIME_MAX_TYPES ( MIME_SLOTS / 4 * 3 )
+#define DEFAULT_TYPE "text/plain"
+
+struct MimeType {
+  const char * extension;
+  const char * type;
+};
+
+const char * mimeTypesFile = NULL;
+
+static const MimeType builtinTypes[] = {
+  { "html",  "text/html" },
+  { "htm",   "text/html" },
+  { "shtml", "text/html" },
+  { "css",   "text/css" },
+  { "csv",   "text/csv" },
+  { "txt",   "text/plain" },
+  { "md",    "text/markdown" },
+  { "xml",   "text/xml" },
+  { "ics",   "text/calendar" },
+  { "js",    "text/javascript" },
+  { "mjs",   "text/javascript" },
+  { "json",  "application/json" },
+  { "map",   "application/json" },
+  { "xhtml", "application/xhtml+xml" },
+  { "rss",   "application/rss+xml" },
+  { "atom",  "application/atom+xml" },
+  { "pdf",   "application/pdf" },
+  { "wasm",  "application/wasm" },
+  { "zip",   "application/zip" },
+  { "gz",    "application/gzip" },
+  { "tgz",   "application/gzip" },
+  { "tar",   "application/x-tar" },
+  { "bz2",   "application/x-bzip2" },
+  { "xz",    "application/x-xz" },
+  { "7z",    "application/x-7z-compressed" },
+  { "jar",   "application/java-archive" },
+  { "doc",   "application/msword" },
+  { "docx",  "application/vnd.openxmlformats-officedocument.wordprocessingml.document" },
+  { "xls",   "application/vnd.ms-excel" },
+  { "xlsx",  "application/vnd.openxmlformats-officedocument.spreadsheetml.sheet" },
+  { "ppt",   "application/vnd.ms-powerpoint" },
+  { "pptx",  "application/vnd.openxmlformats-officedocument.presentationml.presentation" },
+  { "odt",   "application/vnd.oasis.opendocument.text" },
+  { "rtf",   "application/rtf" },
+  { "bin",   "application/octet-stream" },
+  { "exe",   "application/octet-stream" },
+  { "so",    "application/octet-stream" },
+  { "iso",   "application/octet-stream" },
+  { "gif",   "image/gif" },
+  { "png",   "image/png" },
+  { "jpg",   "image/jpeg" },
+  { "jpeg",  "image/jpeg" },
+  { "webp",  "image/webp" },
+  { "avif",  "image/avif" },
+  { "svg",   "image/svg+xml" },
+  { "ico",   "image/vnd.microsoft.icon" },
+  { "bmp",   "image/bmp" },
+  { "tif",   "image/tiff" },
+  { "tiff",  "image/tiff" },
+  { "woff",  "font/woff" },
+  { "woff2", "font/woff2" },
+  { "ttf",   "font/ttf" },
+  { "otf",   "font/otf" },
+  { "mp3",   "audio/mpeg" },
+  { "ogg",   "audio/ogg" },
+  { "oga",   "audio/ogg" },
+  { "wav",   "audio/wav" },
+  { "flac",  "audio/flac" },
+  { "m4a",   "audio/mp4" },
+  { "mp4",   "video/mp4" },
+  { "m4v",   "video/mp4" },
+  { "webm",  "video/webm" },
+  { "ogv",   "video/ogg" },
+  { "mpeg",  "video/mpeg" },
+  { "mpg",   "video/mpeg" },
+  { "mov",   "video/quicktime" },
+  { "avi",   "video/x-msvideo" },
+  { "mkv",   "video/x-matroska" }
+};
+
+static MimeType table[MIME_SLOTS];
+static int types;
+
+// FNV-1a of the first length characters, lower case
+static unsigned int hashExtension( const char * extension, size_t length ) {
+  unsigned int hash = 2166136261u;
+  for ( size_t i = 0; i < length; i++ ) {
+    unsigned char ch = extension[i];
+    if ( ch >= 'A' && ch <= 'Z' ) {
+      ch += 'a' - 'A';
+    }
+    hash = ( hash ^ ch ) * 16777619u;
+  }
+  return hash;
+}
+
+// The slot extension is in, or the empty slot it would go into
+static MimeType * slot( const char * extension, size_t length ) {
+  unsigned int i = hashExtension( extension, length ) & ( MIME_SLOTS - 1 );
+  while ( table[i].extension != NULL &&
+	  !( strncasecmp( table[i].extension, extension, length ) == 0 &&
+	     table[i].extension[length] == '\0' ) ) {
+    i = ( i + 1 ) & ( MIME_SLOTS - 1 );
+  }
+  return &table[i];
+}
+
+// a later type for the same extension replaces the earlier one
+static void add( const char * extension, const char * type ) {
+  MimeType * m = slot( extension, strlen(extension) );
+  if ( m->extension == NULL ) {
+    if ( types == MIME_MAX_TYPES ) {
+      LOG( LOG_WARN, "too many mime types, ignoring .%s", extension );
+      return;
+    }
+    types++;
+  }
+  m->extension = extension;
+  m->type = type;
+}
+
+// Read a file in the format of /etc/mime.types: a type followed by its
+// extensions on each line, # starts a comment
+static void load( const char * path ) {
+  FILE * f = fopen( path, "r" );
+  if ( f == NULL ) {
+    perror( path );
+    exit( -1 );
+  }
+  fseek( f, 0, SEEK_END );
+  long size = ftell( f );
+  rewind( f );
+
+  char * text = (char *)malloc( size + 1 );
+  if ( text == NULL || (long)fread( text, 1, size, f ) != size ) {
+    perror( path );
+    exit( -1 );
+  }
+  text[size] = '\0';
+  fclose( f );
+
+  char * line = text;
+  while ( line != NULL && *line != '\0' ) {
+    char * end = strchr( line, '\n' );
+    if ( end != NULL ) {
+      *end++ = '\0';
+    }
+    char * comment = strchr( line, '#' );
+    if ( comment != NULL ) {
+      *comment = '\0';
+    }
+
+    char * save;
+    const char * type = strtok_r( line, " \t\r", &save );
+    char * extension;
+    while ( type != NULL && (extension = strtok_r( NULL, " \t\r", &save )) != NULL ) {
+      add( extension, type );
+    }
+    line = end;
+  }
+}
+
+// Fill the table, before any request is served
+void mimeInit() {
+  for ( size_t i = 0; i < sizeof(builtinTypes) / sizeof(builtinTypes[0]); i++ ) {
+    add( builtinTypes[i].extension, builtinTypes[i].type );
+  }
+  if ( mimeTypesFile != NULL ) {
+    load( mimeTypesFile );
+  }
+  LOG( LOG_DEBUG, "%d mime types", types );
+}
+
+// Content type for the extension of filename, text/plain if unknown
+const char * mimeType( const char * filename ) {
+  const char * dot = strrchr( filename, '.' );
+  if ( dot == NULL || strchr( dot, '/' ) != NULL ) {
+    return DEFAULT_TYPE;
+  }
+
+  const char * extension = dot + 1;
+  MimeType * m = slot( extension, strlen(extension) );
+  return m->extension != NULL ? m->type : DEFAULT_TYPE;
+}
@@ -0,0 +1,10 @@
+#ifndef MIME_TYPES_H
+#define MIME_TYPES_H
+
+// mime.types file loaded on top of the built-in types, NULL for none
+extern const char * mimeTypesFile;
+
+void mimeInit();
+const char * mimeType( const char * filename );
+
+#endif
@@ -0,0 +1,200 @@
+//------------------------------------------------------------------------
+// Loadable module handlers.
+//
+// A request for /mod/<name>.so runs the httprun() entry point of that
+// shared object inside the server, on the thread serving the request.
+// Only a .so right in the module directory is ever loaded: loading one
+// runs its constructors in the server, so a name with a '/' in it, or
+// one that resolves to somewhere else, is no module.
+// Modules are loaded on first use and stay loaded; every request stats
+// the file and loads a new version if it changed on disk.
+//
+// A version is loaded from a private copy in a memfd rather than from
+// the file itself. Rewriting the .so in place would otherwise change the
+// code under requests still running the old version, and dlopen() would
+// hand back the already loaded object for the same file anyway. The
+// memfd stays open while its version is loaded: dlopen() also matches
+// objects by name, so /proc/self/fd/N must not repeat between loaded
+// versions. An old version is unloaded once the last request running
+// it returns.
+//
+// Modules run in the server process: they must be thread safe and must
+// not crash, exit or leave signals changed.
+//------------------------------------------------------------------------
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "module-loader.h"
+
+static Module * modules;
+static pthread_mutex_t moduleMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int sameVersion( const struct stat * a, const struct stat * b ) {
+  return a->st_dev == b->st_dev && a->st_ino == b->st_ino &&
+    a->st_size == b->st_size &&
+    a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+    a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+static void unload( Module * m ) {
+  LOG( LOG_INFO, "unloading module %s", m->path );
+  dlclose( m->handle );
+  close( m->copy );
+  free( m->path );
+  free( m );
+}
+
+// Copy the module into a memfd and load it from there
+static Module * load( const char * path ) {
+  int fd = open( path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW );
+  if ( fd < 0 ) {
+    return NULL;
+  }
+
+  Module * m = (Module *)calloc( 1, sizeof(Module) );
+  int copy = memfd_create( "myhttpd-module", MFD_CLOEXEC );
+  if ( m == NULL || copy < 0 || fstat( fd, &m->st ) != 0 || !S_ISREG( m->st.st_mode ) ) {
+    goto fail;
+  }
+
+  for ( off_t offset = 0; offset < m->st.st_size; ) {
+    if ( sendfile( copy, fd, &offset, m->st.st_size - offset ) <= 0 ) {
+      LOG( LOG_ERROR, "%s: %s", path, strerror(errno) );
+      goto fail;
+    }
+  }
+
+  char name[64];
+  snprintf( name, sizeof(name), "/proc/self/fd/%d", copy );
+  m->handle = dlopen( name, RTLD_NOW | RTLD_LOCAL );
+  if ( m->handle == NULL ) {
+    LOG( LOG_ERROR, "%s: %s", path, dlerror() );
+    goto fail;
+  }
+
+  m->run = (httprunfunc)dlsym( m->handle, "httprun" );
+  if ( m->run == NULL ) {
+    LOG( LOG_ERROR, "%s: httprun not found", path );
+    dlclose( m->handle );
+    goto fail;
+  }
+
+  m->path = strdup( path );
+  if ( m->path == NULL ) {
+    dlclose( m->handle );
+    goto fail;
+  }
+  LOG( LOG_INFO, "loaded module %s", path );
+
+  m->copy = copy;
+  close( fd );
+  return m;
+
+fail:
+  if ( copy >= 0 ) {
+    close( copy );
+  }
+  close( fd );
+  free( m );
+  return NULL;
+}
+
+// Where the module called name in dir really is, or NULL if the name
+// isn't that of a module or it leads out of dir. The caller frees it.
+static char * modulePath( const char * dir, const char * name ) {
+  size_t length = strlen( name );
+  if ( name[0] == '.' || strchr( name, '/' ) != NULL || length <= strlen(".so") ||
+       strcmp( name + length - strlen(".so"), ".so" ) ) {
+    return NULL;
+  }
+
+  char * realDir = realpath( dir, NULL );
+  if ( realDir == NULL ) {
+    return NULL;
+  }
+  char path[PATH_MAX];
+  snprintf( path, sizeof(path), "%s/%s", realDir, name );
+  char * realPath = realpath( path, NULL );
+  size_t dirLength = strlen( realDir );
+  if ( realPath != NULL && ( strncmp( realPath, realDir, dirLength ) ||
+			     realPath[dirLength] != '/' ||
+			     strchr( realPath + dirLength + 1, '/' ) != NULL ) ) {
+    free( realPath );
+    realPath = NULL;
+  }
+  free( realDir );
+  return realPath;
+}
+
+// Get the current version of the module called name in dir, loading it
+// if needed. Returns NULL if there is no such module or it fails to load.
+Module * moduleAcquire( const char * dir, const char * name ) {
+  char * path = modulePath( dir, name );
+  struct stat st;
+  if ( path == NULL || stat( path, &st ) != 0 || !S_ISREG( st.st_mode ) ) {
+    if ( path != NULL ) {
+      LOG( LOG_DEBUG, "no module %s", path );
+    }
+    free( path );
+    return NULL;
+  }
+
+  pthread_mutex_lock( &moduleMutex );
+
+  Module ** p = &modules;
+  while ( *p != NULL && strcmp( (*p)->path, path ) ) {
+    p = &(*p)->next;
+  }
+
+  Module * m = *p;
+  if ( m != NULL && sameVersion( &m->st, &st ) ) {
+    m->refs++;
+    pthread_mutex_unlock( &moduleMutex );
+    free( path );
+    return m;
+  }
+
+  Module * stale = NULL;
+  if ( m != NULL ) {
+    // changed on disk, requests still running it keep it alive
+    *p = m->next;
+    if ( --m->refs == 0 ) {
+      stale = m;
+    }
+  }
+
+  m = load( path );
+  if ( m != NULL ) {
+    m->refs = 2;
+    m->next = modules;
+    modules = m;
+  }
+  pthread_mutex_unlock( &moduleMutex );
+  free( path );
+
+  if ( stale != NULL ) {
+    unload( stale );
+  }
+  return m;
+}
+
+void moduleRelease( Module * m ) {
+  pthread_mutex_lock( &moduleMutex );
+  int refs = --m->refs;
+  pthread_mutex_unlock( &moduleMutex );
+
+  if ( refs == 0 ) {
+    unload( m );
+  }
+}
@@ -0,0 +1,25 @@
+#ifndef MODULE_LOADER_H
+#define MODULE_LOADER_H
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+// Entry point of a module, see hello.cc. The module owns ssock and
+// closes it once the response is written.
+typedef void (*httprunfunc)(int ssock, const char * querystring);
+
+// A loaded version of a module
+struct Module {
+  Module * next;
+  char * path;
+  struct stat st;    // the file this version was loaded from
+  void * handle;
+  int copy;          // memfd it was loaded from
+  httprunfunc run;
+  int refs;          // the table's own plus one per request running it
+};
+
+Module * moduleAcquire( const char * dir, const char * name );
+void moduleRelease( Module * m );
+
+#endif
@@ -1,18 +1,49 @@
 #include <arpa/inet.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <pthread.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <stdio.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "admission.h"
+#include "byte-range.h"
+#include "cgi-env.h"
+#include "cgi-output.h"
+#include "cgi-pool.h"
+#include "conditional.h"
+#include "content-encoding.h"
+#include "file-cache.h"
+#include "file-map.h"
+#include "linger.h"
+#include "log.h"
+#include "metrics.h"
+#include "mime-types.h"
+#include "module-loader.h"
+#include "myhttpd.h"
+#include "prefork.h"
+#include "request-body.h"
+#include "scheduler.h"
+#include "thread-pool.h"
+
 const char * usage =
 "                                                               \n"
 "myhttpd server:                                                \n"
@@ -22,10 +53,116 @@ const char * usage =
 "                                                               \n"
 "To use it in one window type:                                  \n"
 "                                                               \n"
-"   myhttpd <port>   	                                        \n"
+"   myhttpd [-f|-t|-p|-r|-e|-u|-w|-s] [options] [<port>]        \n"
 "                                                               \n"
 "Where 1024 < port < 65536.             			\n"
 "                                                               \n"
+"   -f   fork a new process for each request                    \n"
+"   -t   create a new thread for each request                   \n"
+"   -p   serve requests from a pool of threads                  \n"
+"   -r   like -p, with one SO_REUSEPORT socket per thread       \n"
+"   -e   serve requests from an epoll event loop per core       \n"
+"   -u   like -e, with io_uring instead of epoll (Linux 6.1),   \n"
+"        falls back to -e where io_uring is unavailable         \n"
+"   -w   prefork worker processes that each run a -e loop with  \n"
+"        one thread, supervised by a master process             \n"
+"   -s   worker threads per core that take requests from each   \n"
+"        other, with scripts and uncached files served by a     \n"
+"        pool of blocking threads                               \n"
+"                                                               \n"
+"Pool options (-p, -r uses --pool-min threads):                 \n"
+"                                                               \n"
+"   --pool-min=N     threads always running (default: cores)    \n"
+"   --pool-max=N     threads when busy (default: 4 x cores)     \n"
+"   --pool-queue=N   connections waiting for a thread (1024)    \n"
+"   --pool-idle=S    seconds before extra threads exit (30)     \n"
+"   --pin            pin each thread to a cpu                   \n"
+"                                                               \n"
+"   kill -USR1 <pid> prints per-thread pool statistics.         \n"
+"                                                               \n"
+"Prefork options (-w):                                          \n"
+"                                                               \n"
+"   --workers=N       worker processes (default: cores)         \n"
+"   --worker-drain=S  seconds a retired worker may take to      \n"
+"                     finish its connections, 0 for no limit    \n"
+"                     (30)                                      \n"
+"                                                               \n"
+"   kill -HUP <pid>  of the master starts new workers, which    \n"
+"                    read --mime-types again, and retires the   \n"
+"                    old ones once their connections are done   \n"
+"   kill -QUIT <pid> stops once the connections are done        \n"
+"                                                               \n"
+"Scheduler options (-s):                                        \n"
+"                                                               \n"
+"   --sched-workers=N     worker threads (default: cores)       \n"
+"   --blocking-threads=N  threads for scripts and uncached      \n"
+"                         files (default: 4 x cores)            \n"
+"   --blocking-queue=N    scripts, and files, waiting for them, \n"
+"                         more of either get a 503 (1024)       \n"
+"                                                               \n"
+"Connection options:                                            \n"
+"                                                               \n"
+"   --keepalive-timeout=S   idle seconds before a persistent    \n"
+"                           connection is closed, 0 disables    \n"
+"                           keep-alive (5, always 0 without a   \n"
+"                           mode flag)                          \n"
+"   --keepalive-requests=N  requests per connection (100)       \n"
+"   --max-connections=N     served at once, more get a 503, 0   \n"
+"                           for no limit (a quarter of the file \n"
+"                           limit)                              \n"
+"   --backlog=N             connections the kernel holds for    \n"
+"                           accept(), up to somaxconn (1024)    \n"
+"   --queue-target=MS       queueing delay that is fine (5)     \n"
+"   --queue-interval=MS     how long the delay may stay above   \n"
+"                           the target before connections that  \n"
+"                           waited longer get a 503, 0 never    \n"
+"                           sheds (100)                         \n"
+"                                                               \n"
+"File options:                                                  \n"
+"                                                               \n"
+"   --cache-size=B       bytes of small files kept in memory,   \n"
+"                        0 disables the cache (16 MB)           \n"
+"   --cache-max-file=B   largest file that gets cached (64 KB)  \n"
+"   --mmap-min=B         send files of at least B bytes from a  \n"
+"                        shared mmap() instead of sendfile(),   \n"
+"                        0 disables (0)                         \n"
+"   --mime-types=F       content types by extension, in the     \n"
+"                        format of /etc/mime.types, on top of   \n"
+"                        the built-in ones                      \n"
+"   --cache-control=P=S  send Cache-Control: max-age=S with     \n"
+"                        documents under path P, may be given   \n"
+"                        more than once                         \n"
+"   --gzip-level=N       zlib level of text compressed for      \n"
+"                        clients that take gzip, 0 only sends   \n"
+"                        precompressed FILE.gz files (6)        \n"
+"   --gzip-min=B         smallest file compressed (256)         \n"
+"   --gzip-max-file=B    largest file compressed, the result    \n"
+"                        is kept in the cache (1 MB)            \n"
+"                                                               \n"
+"CGI options:                                                   \n"
+"                                                               \n"
+"   --cgi-workers=N         worker processes launching scripts, \n"
+"                           0 forks the server instead (2,      \n"
+"                           always 0 with -f)                   \n"
+"   --cgi-max-requests=N    scripts a worker launches before it \n"
+"                           is replaced (1000)                  \n"
+"   --cgi-max-per-script=N  copies of one script running at     \n"
+"                           once, 0 for no limit (0)            \n"
+"   --cgi-max-body=B        largest POST or PUT body a script   \n"
+"                           gets, 0 for no limit (16 MB)        \n"
+"   --cgi-timeout=S         seconds a script may run before it  \n"
+"                           is killed, 0 for no limit (30)      \n"
+"   --cgi-fork              fork() scripts and workers instead  \n"
+"                           of posix_spawn(), to compare        \n"
+"                                                               \n"
+"Log options:                                                   \n"
+"                                                               \n"
+"   --log-level=L    error, warn, info or debug (info)          \n"
+"   --log-file=F     diagnostic log (stderr)                    \n"
+"   --access-log=F   one line per request, off for none (stdout)\n"
+"   --server-status=P  path of the Prometheus metrics, off for  \n"
+"                      none (/server-status)                    \n"
+"                                                               \n"
 "In another window type:                                        \n"
 "                                                               \n"
 "   telnet <host> <port>                                        \n"
@@ -38,55 +175,104 @@ const char * usage =
 "the time of the day.                                           \n"
 "                                                               \n";
 
-#define MAX_MESSAGE 2000
-#define BYTES 1024
-#define DEFAULT_PORT 14566
-
 unsigned int USE_THREADS = 0;
 unsigned int USE_FORKS = 0;
 unsigned int USE_POOL = 0;
 
-int QueueLength = 5;
+int QueueLength = 1024;         // connections the kernel queues for accept()
+int KeepAliveTimeout = 5;       // seconds an idle connection is kept open
+int MaxKeepAliveRequests = 100; // requests served on one connection
 char * ROOT;
 char OPTION = '\0'; // cli flag option, if any
 const char * dir = "/http-root-dir";
-
-pthread_mutex_t mutex;
+const char * statusPath = "/server-status";
+
+// long options without a short form
+enum {
+  OPT_POOL_MIN = 256,
+  OPT_POOL_MAX,
+  OPT_POOL_QUEUE,
+  OPT_POOL_IDLE,
+  OPT_PIN,
+  OPT_WORKERS,
+  OPT_WORKER_DRAIN,
+  OPT_SCHED_WORKERS,
+  OPT_BLOCKING_THREADS,
+  OPT_BLOCKING_QUEUE,
+  OPT_KEEPALIVE_TIMEOUT,
+  OPT_KEEPALIVE_REQUESTS,
+  OPT_MAX_CONNECTIONS,
+  OPT_BACKLOG,
+  OPT_QUEUE_TARGET,
+  OPT_QUEUE_INTERVAL,
+  OPT_CACHE_SIZE,
+  OPT_CACHE_MAX_FILE,
+  OPT_MMAP_MIN,
+  OPT_MIME_TYPES,
+  OPT_CACHE_CONTROL,
+  OPT_GZIP_LEVEL,
+  OPT_GZIP_MIN,
+  OPT_GZIP_MAX_FILE,
+  OPT_CGI_WORKERS,
+  OPT_CGI_MAX_REQUESTS,
+  OPT_CGI_MAX_PER_SCRIPT,
+  OPT_CGI_MAX_BODY,
+  OPT_CGI_TIMEOUT,
+  OPT_CGI_FORK,
+  OPT_CGI_WORKER,
+  OPT_LOG_LEVEL,
+  OPT_LOG_FILE,
+  OPT_ACCESS_LOG,
+  OPT_SERVER_STATUS
+};
+
+static struct option longOptions[] = {
+  { "help",       no_argument,       NULL, 'h' },
+  { "pool-min",   required_argument, NULL, OPT_POOL_MIN },
+  { "pool-max",   required_argument, NULL, OPT_POOL_MAX },
+  { "pool-queue", required_argument, NULL, OPT_POOL_QUEUE },
+  { "pool-idle",  required_argument, NULL, OPT_POOL_IDLE },
+  { "pin",        no_argument,       NULL, OPT_PIN },
+  { "workers",            required_argument, NULL, OPT_WORKERS },
+  { "worker-drain",       required_argument, NULL, OPT_WORKER_DRAIN },
+  { "sched-workers",      required_argument, NULL, OPT_SCHED_WORKERS },
+  { "blocking-threads",   required_argument, NULL, OPT_BLOCKING_THREADS },
+  { "blocking-queue",     required_argument, NULL, OPT_BLOCKING_QUEUE },
+  { "keepalive-timeout",  required_argument, NULL, OPT_KEEPALIVE_TIMEOUT },
+  { "keepalive-requests", required_argument, NULL, OPT_KEEPALIVE_REQUESTS },
+  { "max-connections",    required_argument, NULL, OPT_MAX_CONNECTIONS },
+  { "backlog",            required_argument, NULL, OPT_BACKLOG },
+  { "queue-target",       required_argument, NULL, OPT_QUEUE_TARGET },
+  { "queue-interval",     required_argument, NULL, OPT_QUEUE_INTERVAL },
+  { "cache-size",         required_argument, NULL, OPT_CACHE_SIZE },
+  { "cache-max-file",     required_argument, NULL, OPT_CACHE_MAX_FILE },
+  { "mmap-min",           required_argument, NULL, OPT_MMAP_MIN },
+  { "mime-types",         required_argument, NULL, OPT_MIME_TYPES },
+  { "cache-control",      required_argument, NULL, OPT_CACHE_CONTROL },
+  { "gzip-level",         required_argument, NULL, OPT_GZIP_LEVEL },
+  { "gzip-min",           required_argument, NULL, OPT_GZIP_MIN },
+  { "gzip-max-file",      required_argument, NULL, OPT_GZIP_MAX_FILE },
+  { "cgi-workers",        required_argument, NULL, OPT_CGI_WORKERS },
+  { "cgi-max-requests",   required_argument, NULL, OPT_CGI_MAX_REQUESTS },
+  { "cgi-max-per-script", required_argument, NULL, OPT_CGI_MAX_PER_SCRIPT },
+  { "cgi-max-body",       required_argument, NULL, OPT_CGI_MAX_BODY },
+  { "cgi-timeout",        required_argument, NULL, OPT_CGI_TIMEOUT },
+  { "cgi-fork",           no_argument,       NULL, OPT_CGI_FORK },
+  { "cgi-worker",         no_argument,       NULL, OPT_CGI_WORKER },
+  { "log-level",          required_argument, NULL, OPT_LOG_LEVEL },
+  { "log-file",           required_argument, NULL, OPT_LOG_FILE },
+  { "access-log",         required_argument, NULL, OPT_ACCESS_LOG },
+  { "server-status",      required_argument, NULL, OPT_SERVER_STATUS },
+  { NULL,         0,                 NULL, 0 }
+};
 
 void * responseHandler(void* socketDescriptor);
 void * respond( int socketDescriptor);
 void * poolResponseHandler(void * );
+void * poolRespond( int socket );
 
-int main( int argc, char ** argv ) {
-  int port;
-
-  // handle cli arguments
-  if ( argc == 2 ) {
-    if ( argv[1][0] == '-' ) { // we have a flag and no port
-      if ( (char)argv[1][1] == '-' || argv[1][1] == 'h') { 
-	fprintf(stderr, "%s", usage);
-	exit (-1);
-      }
-      OPTION = (char)argv[1][1];
-      port = DEFAULT_PORT;
-    } else { // port and no flag
-      port = atoi( argv[1] );
-    }
-
-  } else if ( argc == 3 ) { // port and flag
-    OPTION = (char)argv[1][1];
-    port = atoi( argv[2] );
-
-  } else { // ya dun goofed
-    fprintf( stderr, "%s", usage );
-    exit( -1 );
-  }
-
-  printf("cli option = %c\n", (char)OPTION);
-
-  ROOT = getenv("PWD");
-  strncat( ROOT, dir, strlen(dir) );
-  
+// Create a socket listening on the given port
+int openMasterSocket( int port, int reusePort ) {
   // Set the IP address and port for this server
   struct sockaddr_in serverIP; 
   memset( &serverIP, 0, sizeof(serverIP) );
@@ -110,12 +296,20 @@ int main( int argc, char ** argv ) {
     exit( -1 );
   }
 
+  // With SO_REUSEPORT several sockets can be bound to the same port and
+  // the kernel spreads incoming connections across them
+  if (reusePort && setsockopt(masterSocket, SOL_SOCKET, SO_REUSEPORT,
+	(char *) &optval, sizeof( int ) ) ) {
+    perror( "setsockopt" );
+    exit( -1 );
+  }
+
   // Bind the socket to the IP address and port
   if (bind(masterSocket, (struct sockaddr *)&serverIP, sizeof(serverIP))) {
     perror("bind");
     exit( -1 );
   }
-  printf("bind done\n");
+  LOG( LOG_DEBUG, "bind done" );
 
   // Put socket in listening mode and set the 
   // size of the queue of unprocessed connections
@@ -124,49 +318,312 @@ int main( int argc, char ** argv ) {
     exit( -1 );
   }
 
-  struct sockaddr_in clientIPAddress;
-  int addressLength = sizeof( clientIPAddress );
+  return masterSocket;
+}
+
+// Accept the next connection on a blocking master socket. One that went
+// away while it was queued is skipped. Out of file descriptors, accept()
+// fails until some are closed, so it waits a little between tries rather
+// than spin. Returns -1 on any other error.
+int acceptClient( int masterSocket ) {
+  int full = 0;
+  while ( 1 ) {
+    int clientSocket = accept( masterSocket, NULL, NULL );
+    if ( clientSocket >= 0 ) {
+      return clientSocket;
+    }
+    if ( errno == EINTR || errno == ECONNABORTED ) {
+      continue;
+    }
+    if ( errno != EMFILE && errno != ENFILE && errno != ENOBUFS && errno != ENOMEM ) {
+      return -1;
+    }
+    if ( !full ) {
+      LOG( LOG_WARN, "accept: %s, waiting for connections to close", strerror(errno) );
+      full = 1;
+    }
+    usleep( 100000 );
+  }
+}
+
+int main( int argc, char ** argv ) {
+  int port = DEFAULT_PORT;
+
+  poolSetDefaults();
+
+  // handle cli arguments
+  int opt;
+  while ( (opt = getopt_long( argc, argv, "hftpreuws", longOptions, NULL )) != -1 ) {
+    switch ( opt ) {
+    case 'f':
+    case 't':
+    case 'p':
+    case 'r':
+    case 'e':
+    case 'u':
+    case 'w':
+    case 's':
+      OPTION = (char)opt;
+      break;
+    case OPT_POOL_MIN:
+      poolConfig.minThreads = atoi( optarg );
+      break;
+    case OPT_POOL_MAX:
+      poolConfig.maxThreads = atoi( optarg );
+      break;
+    case OPT_POOL_QUEUE:
+      poolConfig.queueSize = atoi( optarg );
+      break;
+    case OPT_POOL_IDLE:
+      poolConfig.idleTimeout = atoi( optarg );
+      break;
+    case OPT_PIN:
+      poolConfig.pin = 1;
+      break;
+    case OPT_WORKERS:
+      preforkConfig.workers = atoi( optarg );
+      break;
+    case OPT_WORKER_DRAIN:
+      preforkConfig.drainTimeout = atoi( optarg );
+      break;
+    case OPT_SCHED_WORKERS:
+      schedulerConfig.workers = atoi( optarg );
+      break;
+    case OPT_BLOCKING_THREADS:
+      schedulerConfig.blockingThreads = atoi( optarg );
+      break;
+    case OPT_BLOCKING_QUEUE:
+      schedulerConfig.blockingQueue = atoi( optarg );
+      break;
+    case OPT_KEEPALIVE_TIMEOUT:
+      KeepAliveTimeout = atoi( optarg );
+      break;
+    case OPT_KEEPALIVE_REQUESTS:
+      MaxKeepAliveRequests = atoi( optarg );
+      break;
+    case OPT_MAX_CONNECTIONS:
+      admissionConfig.maxConnections = atoi( optarg );
+      break;
+    case OPT_BACKLOG:
+      QueueLength = atoi( optarg );
+      break;
+    case OPT_QUEUE_TARGET:
+      admissionConfig.target = atoi( optarg );
+      break;
+    case OPT_QUEUE_INTERVAL:
+      admissionConfig.interval = atoi( optarg );
+      break;
+    case OPT_CACHE_SIZE:
+      cacheConfig.maxBytes = strtoul( optarg, NULL, 10 );
+      break;
+    case OPT_CACHE_MAX_FILE:
+      cacheConfig.maxFileSize = strtoul( optarg, NULL, 10 );
+      break;
+    case OPT_MMAP_MIN:
+      mapMinSize = strtoll( optarg, NULL, 10 );
+      break;
+    case OPT_MIME_TYPES:
+      mimeTypesFile = optarg;
+      break;
+    case OPT_CACHE_CONTROL:
+      if ( cacheControlRule( optarg ) < 0 ) {
+	fprintf( stderr, "%s", usage );
+	exit( -1 );
+      }
+      break;
+    case OPT_GZIP_LEVEL:
+      encodingConfig.level = atoi( optarg );
+      if ( encodingConfig.level < 0 || encodingConfig.level > 9 ) {
+	fprintf( stderr, "%s", usage );
+	exit( -1 );
+      }
+      break;
+    case OPT_GZIP_MIN:
+      encodingConfig.minSize = strtoul( optarg, NULL, 10 );
+      break;
+    case OPT_GZIP_MAX_FILE:
+      encodingConfig.maxFileSize = strtoul( optarg, NULL, 10 );
+      break;
+    case OPT_CGI_WORKERS:
+      cgiConfig.workers = atoi( optarg );
+      break;
+    case OPT_CGI_MAX_REQUESTS:
+      cgiConfig.maxRequests = atoi( optarg );
+      break;
+    case OPT_CGI_MAX_PER_SCRIPT:
+      cgiConfig.maxPerScript = atoi( optarg );
+      break;
+    case OPT_CGI_MAX_BODY:
+      cgiConfig.maxBody = strtoll( optarg, NULL, 10 );
+      break;
+    case OPT_CGI_TIMEOUT:
+      cgiConfig.timeout = atoi( optarg );
+      break;
+    case OPT_CGI_FORK:
+      cgiConfig.fork = 1;
+      break;
+    case OPT_CGI_WORKER:
+      // started by cgiStart(), not by hand
+      cgiWorkerMain( CGI_WORKER_FD );
+      break;
+    case OPT_LOG_LEVEL:
+      if ( (logConfig.level = logLevel( optarg )) < 0 ) {
+	fprintf( stderr, "%s", usage );
+	exit( -1 );
+      }
+      break;
+    case OPT_LOG_FILE:
+      logConfig.file = optarg;
+      break;
+    case OPT_ACCESS_LOG:
+      logConfig.accessLog = optarg;
+      break;
+    case OPT_SERVER_STATUS:
+      statusPath = strcmp( optarg, "off" ) ? optarg : NULL;
+      break;
+    default: // ya dun goofed
+      fprintf( stderr, "%s", usage );
+      exit( -1 );
+    }
+  }
+
+  if ( optind < argc ) { // port
+    port = atoi( argv[optind] );
+  }
+
+  if ( OPTION == '\0' ) {
+    // one persistent client would hold up everybody else
+    KeepAliveTimeout = 0;
+  }
+  admissionInit();
+
+  // SIGUSR1 is for the pool's statistics thread, block it before any
+  // helper thread starts so none of them takes it
+  if ( OPTION == 'p' ) {
+    sigset_t signals;
+    sigemptyset( &signals );
+    sigaddset( &signals, SIGUSR1 );
+    pthread_sigmask( SIG_BLOCK, &signals, NULL );
+  }
+
+  logStart();
+  metricsInit();
+  LOG( LOG_INFO, "cli option = %c", OPTION ? OPTION : '-' );
+
+  // documents are served from http-root-dir in the current directory
+  static char root[PATH_MAX];
+  const char * cwd = getenv("PWD");
+  if ( cwd == NULL ) {
+    cwd = ".";
+  }
+  snprintf( root, sizeof(root), "%s%s", cwd, dir );
+  ROOT = root;
+
+  // prefork workers set these up for themselves
+  if ( OPTION != 'w' ) {
+    cacheInit();
+    mimeInit();
+  }
+
+  // a script that exits without reading all of its request body would
+  // raise SIGPIPE on the next write to its stdin
+  signal( SIGPIPE, SIG_IGN );
+
+  // -f forks for every request anyway
+  if ( OPTION != 'f' && OPTION != 'w' ) {
+    cgiStart();
+  }
+  
+  int masterSocket = openMasterSocket( port, OPTION == 'r' );
+  metricsListen( masterSocket );
+
   int clientSocket;
   int * clientSock;
 
-
   if (OPTION == 'p') {
-    // spawn 5 threads with poolResponseHandler running
-    printf("creating pool of threads\n");
-    pthread_t pool[5];
-    pthread_attr_t attr;
-    pthread_attr_init(&attr);
-    pthread_attr_setscope(&attr, PTHREAD_SCOPE_SYSTEM);
+    // the accept loop below feeds the worker pool
+    LOG( LOG_INFO, "creating pool of threads" );
+    poolStart( poolRespond );
+  }
 
-    pthread_mutex_init(&mutex, NULL);
+  if (OPTION == 'w') {
+    // never returns
+    runPrefork( masterSocket );
+  }
 
-    int * masterSock;
-    masterSock = (int*)malloc( 1 );
-    *masterSock = masterSocket;
+  if (OPTION == 's') {
+    // never returns
+    runScheduler( masterSocket );
+  }
+
+  if (OPTION == 'u') {
+    // only returns if io_uring can't be used
+    LOG( LOG_INFO, "starting io_uring loop" );
+    runUringLoop( masterSocket );
+    LOG( LOG_WARN, "io_uring unavailable, using epoll instead" );
+    OPTION = 'e';
+  }
+
+  if (OPTION == 'e') {
+    // non-blocking sockets driven by epoll
+    LOG( LOG_INFO, "starting event loop" );
+    runEventLoop( masterSocket, 0 );
+
+  } else if (OPTION == 'r') {
+    // spawn a thread per pool slot with poolResponseHandler running,
+    // every thread accept()s on its own socket bound with SO_REUSEPORT
+    int threads = poolConfig.minThreads > 0 ? poolConfig.minThreads : 1;
+    LOG( LOG_INFO, "creating %d threads with their own sockets", threads );
+    pthread_t * pool = (pthread_t *)malloc( threads * sizeof(pthread_t) );
+    int * masterSock = (int *)malloc( threads * sizeof(int) );
 
     int i;
-    for (i = 0; i < 5; i++) {
+    for (i = 0; i < threads; i++) {
+      masterSock[i] = i == 0 ? masterSocket : openMasterSocket( port, 1 );
+      if ( i > 0 ) {
+	metricsListen( masterSock[i] );
+      }
+    }
+
+    for (i = 0; i < threads; i++) {
+      pthread_attr_t attr;
+      pthread_attr_init(&attr);
+      pthread_attr_setscope(&attr, PTHREAD_SCOPE_SYSTEM);
+      pinThread(&attr, i);
+
       pthread_create( &(pool[i]), &attr, 
 	  (void * (*)(void*))poolResponseHandler, 
-	  (void *) masterSock);
+	  (void *) &masterSock[i]);
     }
 
-    for (i = 0; i < 5; i++) {
+    for (i = 0; i < threads; i++) {
       pthread_join(pool[i], NULL);
     }
     
   } else {
     // loop forever
-    printf("waiting for incoming connections\n");
-    while ( (clientSocket = accept( masterSocket,
-				(struct sockaddr *)&clientIPAddress,
-				(socklen_t*)&addressLength)) ) {
+    LOG( LOG_INFO, "waiting for incoming connections" );
+    while ( (clientSocket = acceptClient( masterSocket )) >= 0 ) {
 
-      printf("connection accepted\n");
+      LOG( LOG_DEBUG, "connection accepted" );
+      metricsAccepted( clientSocket );
 
-      if ( OPTION == 't' ) { 
+      if ( OPTION == 'f' ) {
+	// children that are done no longer count against the limit
+	while ( waitpid( -1, NULL, WNOHANG ) > 0 ) {
+	  admissionLeave();
+	}
+      }
+
+      if ( OPTION == 'p' ) {
+	// queue it for the next free pool thread, which decides on
+	// admission once it has waited there too
+	poolSubmit( clientSocket );
+      } else if ( !admissionEnter( clientSocket ) ) {
+	// already turned away
+      } else if ( OPTION == 't' ) { 
 	// create a new thread for each requested
-	clientSock = (int*)malloc( 1 );
+	clientSock = (int*)malloc( sizeof(int) );
 	*clientSock = clientSocket;
 
 	pthread_t cThread;
@@ -174,25 +631,37 @@ int main( int argc, char ** argv ) {
 	pthread_attr_init(&attr);
 	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
 
-	printf("spawning thread to handle response\n");
-	if (pthread_create(&cThread, &attr, 
-	      (void * (*)(void *))responseHandler, (void *)clientSock) < 0) {
-	  perror("failed to create thread");
-	  return 1;
+	LOG( LOG_DEBUG, "spawning thread to handle response" );
+	int error = pthread_create(&cThread, &attr, 
+	    (void * (*)(void *))responseHandler, (void *)clientSock);
+	pthread_attr_destroy(&attr);
+	if ( error != 0 ) {
+	  LOG( LOG_WARN, "pthread_create: %s", strerror(error) );
+	  free( clientSock );
+	  admissionLeave();
+	  admissionReject( clientSocket );
 	}
 
       } else if ( OPTION == 'f' ) {
 	// fork for each request
-	if (fork() == 0) { // child
-	  printf("responding in forked child process\n");
+	pid_t pid = fork();
+	if (pid == 0) { // child
+	  LOG( LOG_DEBUG, "responding in forked child process" );
 	  respond( clientSocket );
+	  lingerFlush();
 	  exit(0);
+	} else if (pid < 0) {
+	  LOG( LOG_WARN, "fork: %s", strerror(errno) );
+	  admissionLeave();
+	  admissionReject( clientSocket );
 	} else { // parent
+	  // the child has its own copy of the socket, and counts
+	  // against the limit until it is reaped above
+	  close( clientSocket );
 	}
-      } else if ( OPTION == 'p' ) {
       } else { 
 	// single threaded behavior
-	printf("responding single-threaded\n");
+	LOG( LOG_DEBUG, "responding single-threaded" );
 	respond( clientSocket );
       }
     } // end of while loop
@@ -208,198 +677,1347 @@ void * poolResponseHandler(void * masterSocketDescriptor) {
   int masterSocket = *(int*)masterSocketDescriptor;
 
   while (1) {
-    struct sockaddr_in clientIPAddress;
-    int alen = sizeof( clientIPAddress);
-
-    // don't want multiple threads calling accept() at the same time
-    pthread_mutex_lock(&mutex);
-
-    int clientSocket = accept(masterSocket, 
-	(struct sockaddr*)&clientIPAddress,
-	(socklen_t*)&alen);
-
-    pthread_mutex_unlock(&mutex);
-
-    int * clientSock;
-    clientSock = (int*)malloc( 1 );
-    *clientSock = clientSocket;
+    // no locking needed, nobody else accept()s on this socket
+    int clientSocket = acceptClient( masterSocket );
 
     if (clientSocket < 0 ) {
       perror( "accept" );
       exit( -1 );
     }
+    metricsAccepted( clientSocket );
 
     //process request
-    responseHandler(clientSock);
+    if ( admissionEnter( clientSocket ) ) {
+      respond(clientSocket);
+    }
+  }
+}
+
+// Handler of the -p pool's threads. Admission is decided here rather
+// than in the accept loop, so the time spent in the pool's queue counts.
+void * poolRespond( int socket ) {
+  if ( admissionEnter( socket ) ) {
+    respond( socket );
   }
+  return 0;
 }
 
-char * findContentType( char * filename) {
-  int i;
-  char extension[10];
+// Header of a 200 response carrying a file, up to the Connection line
+int formatFileHeader( char * buf, size_t size, const char * uri, const char * contentType,
+    const struct stat * st ) {
+  int length = snprintf(buf, size,
+      "HTTP/1.1 200 Document follows\r\nServer: CS 252 lab5\r\nContent-type: %s\r\n"
+      "Content-Length: %lld\r\n",
+      contentType, (long long)st->st_size);
+  return length + formatValidators( buf + length, size - length, uri, st, 0 );
+}
 
-  // loop backwards until we find a .
-  for (i = strlen(filename); i >= 0; i--) {
-    if ( filename[i] == '.') {
-      break;
+// Header of a 200 response carrying a gzipped copy of a document, either
+// the precompressed file st describes or length bytes compressed here
+// from it
+static int formatGzipHeader( char * buf, size_t size, const char * uri,
+    const char * contentType, const struct stat * st, off_t length, int compressedHere ) {
+  int headerLength = snprintf(buf, size,
+      "HTTP/1.1 200 Document follows\r\nServer: CS 252 lab5\r\nContent-type: %s\r\n"
+      "Content-Encoding: gzip\r\nContent-Length: %lld\r\n",
+      contentType, (long long)length);
+  return headerLength + formatValidators( buf + headerLength, size - headerLength, uri, st,
+      compressedHere );
+}
+
+// The Connection line and the empty line that end the header
+static const char * connectionHeader( Connection * c ) {
+  return c->keepAlive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+}
+
+// Write the access log line of the response just sent, in common log
+// format, and count it
+static void logRequest( Connection * c ) {
+  if ( c->status == 0 ) {
+    return;
+  }
+
+  long long bytes = c->partsSent + c->headerSent + c->entrySent +
+    c->fileOffset - c->fileStart - c->piped + c->output.sent;
+  long long now = metricsNow();
+  metricsResponse( c->status, bytes );
+  if ( c->responded != 0 ) {
+    metricsPhase( c->sendPhase, now - c->responded );
+  }
+  if ( c->started != 0 ) {
+    metricsPhase( PHASE_REQUEST, now - c->started );
+  }
+
+  if ( logAccessEnabled() ) {
+    HttpRequest * r = &c->request;
+    char size[32] = "-";
+    if ( bytes > 0 ) {
+      snprintf( size, sizeof(size), "%lld", bytes );
+    }
+    logAccess( "%s - - [%s] \"%.*s %.*s %.*s\" %d %s",
+	c->peer, logTimestamp(),
+	r->method.length, r->method.data, r->uri.length, r->uri.data,
+	r->version.length, r->version.data, c->status, size );
+  }
+  c->status = 0;
+}
+
+void connectionInit( Connection * c, int socket ) {
+  c->socket = socket;
+  c->state = CONN_READING;
+  c->prev = NULL;
+  c->next = NULL;
+  c->lastActive = 0;
+  c->received = 0;
+  c->message[0] = '\0';
+  c->requestLength = 0;
+  httpParserInit( &c->request );
+  c->requests = 0;
+  c->keepAlive = 0;
+  c->headerLength = 0;
+  c->headerSent = 0;
+  c->fd = -1;
+  c->fileOffset = 0;
+  c->fileRemaining = 0;
+  c->fileStart = 0;
+  c->rangeCount = 0;
+  c->rangeIndex = 0;
+  c->partsSent = 0;
+  c->useSplice = 0;
+  c->pipe[0] = c->pipe[1] = -1;
+  c->piped = 0;
+  c->entry = NULL;
+  c->entrySent = 0;
+  c->map = NULL;
+  c->cgiIn = -1;
+  c->cgiOut = -1;
+  c->cgiDeadline = 0;
+  c->body.buffer = NULL;
+  c->output.buffer = NULL;
+  c->output.zip = NULL;
+  c->output.raw = NULL;
+  c->output.sent = 0;
+  c->epfd = -1;
+  c->status = 0;
+  c->started = 0;
+  c->responded = 0;
+  c->sendPhase = PHASE_SEND;
+  metricsConnection( socket );
+
+  strcpy( c->peer, "-" );
+  if ( logAccessEnabled() ) {
+    struct sockaddr_storage address;
+    socklen_t length = sizeof(address);
+    if ( getpeername( socket, (struct sockaddr *)&address, &length ) == 0 ) {
+      void * ip = address.ss_family == AF_INET6 ?
+	(void *)&((struct sockaddr_in6 *)&address)->sin6_addr :
+	(void *)&((struct sockaddr_in *)&address)->sin_addr;
+      inet_ntop( address.ss_family, ip, c->peer, sizeof(c->peer) );
     }
   }
-  i++;
+}
+
+// Check whether the buffer holds a whole request header. Returns
+// IO_AGAIN if more has to be received first.
+int connectionParse( Connection * c ) {
+  if ( c->received > 0 && c->started == 0 ) {
+    c->started = metricsNow();
+  }
+  if ( c->received > 0 &&
+       httpParse( &c->request, c->message, c->received ) != PARSE_AGAIN ) {
+    c->requestLength = c->request.length;
+    return IO_DONE;
+  }
 
-  // i is now the location of '.' preceding the file extension
-  int m = 0;
-  while ( filename[i] != '\0' ) {
-    extension[m] = filename[i]; // grab the extension characters
-    m++;
-    i++;
+  if ( c->received >= MAX_MESSAGE ) {
+    // the header doesn't fit in the buffer
+    c->request.status = PARSE_ERROR;
+    c->requestLength = c->received;
+    return IO_DONE;
   }
-  extension[m] = '\0'; // null terminate the extension string
+  return IO_AGAIN;
+}
+
+// Receive on the socket until the whole request header is buffered.
+// Returns IO_AGAIN if a non-blocking socket runs dry first.
+int connectionRead( Connection * c ) {
+  // a pipelined request may already be waiting in the buffer
+  while ( connectionParse( c ) == IO_AGAIN ) {
+    int n = recv( c->socket, c->message + c->received,
+	MAX_MESSAGE - c->received, 0 );
+
+    if ( n > 0 ) {
+      c->received += n;
+      c->message[c->received] = '\0';
+    } else if ( n == 0 ) { // socket closed
+      LOG( LOG_DEBUG, "client disconnected" );
+      return IO_CLOSE;
+    } else if ( errno == EINTR ) {
+      continue;
+    } else if ( errno == EAGAIN || errno == EWOULDBLOCK ) {
+      return IO_AGAIN;
+    } else { // error
+      LOG( LOG_WARN, "recv error: %s", strerror(errno) );
+      return IO_CLOSE;
+    }
+  }
+  return IO_DONE;
+}
+
+static int serveRequest( Connection * c );
 
-  printf("extension: %s\n", extension);
+// Serve the first buffered request and queue up the response. Returns
+// IO_DONE when there is something for connectionWrite() to send, or a
+// CGI script for it to pass the request body to and the output from,
+// IO_CLOSE when the request has been fully dealt with already.
+int connectionRespond( Connection * c ) {
+  long long start = metricsNow();
+  metricsPhase( PHASE_PARSE, start - c->started );
 
-  if ( !strcmp(extension, "html") ) {
-    return "text/html";
-  } else if (  !strcmp(extension, "gif")) {
-    return "image/webp";
+  int result = serveRequest( c );
+
+  // from here on a script's output is still being produced
+  c->responded = metricsNow();
+  c->sendPhase = c->output.buffer != NULL ? PHASE_CGI : PHASE_SEND;
+  metricsPhase( c->sendPhase == PHASE_CGI ? PHASE_CGI_START : PHASE_OPEN,
+      c->responded - start );
+  return result;
+}
+
+// Queue up a 404 response
+static void notFound( Connection * c ) {
+  LOG( LOG_DEBUG, "404 file not found!" );
+  const char * body = "<html><h1>404 File Not Found</h1></html>\n";
+  c->status = 404;
+  c->headerLength = snprintf(c->header, sizeof(c->header),
+      "HTTP/1.1 404 File Not Found\r\nServer: CS 252 lab5\r\nContent-type: text/html\r\n"
+      "Content-Length: %d\r\nConnection: %s\r\n\r\n%s",
+      (int)strlen(body), c->keepAlive ? "keep-alive" : "close", body);
+}
+
+// Queue up a response without a body that ends the connection, so
+// whatever is left of the request doesn't have to be read. extra holds
+// more header lines, if any.
+static void errorResponse( Connection * c, int status, const char * reason,
+    const char * extra ) {
+  c->status = status;
+  c->keepAlive = 0;
+  c->headerLength = snprintf(c->header, sizeof(c->header),
+      "HTTP/1.1 %d %s\r\nServer: CS 252 lab5\r\n%s"
+      "Content-Length: 0\r\nConnection: close\r\n\r\n",
+      status, reason, extra);
+}
+
+// Queue up a 503 for a request there is no room to serve just now
+void connectionUnavailable( Connection * c ) {
+  c->requests++;
+  c->responded = metricsNow();
+  errorResponse( c, 503, "Service Unavailable", "Retry-After: 1\r\n" );
+}
+
+// Length of the request body from Content-Length, or -1 for a chunked
+// one. Returns 0, or the status to reject the request with.
+static int requestBodyLength( const HttpRequest * r, long long * length ) {
+  // framing that can be read two ways is refused, whoever reads it the
+  // other way sees a different request (RFC 9112, 6.3)
+  const StringView * encoding = NULL;
+  const StringView * header = NULL;
+  for ( int i = 0; i < r->headerCount; i++ ) {
+    const StringView * name = &r->headers[i].name;
+    if ( viewCaseEquals( name, "Transfer-Encoding" ) ) {
+      if ( encoding != NULL ) {
+	return 400;
+      }
+      encoding = &r->headers[i].value;
+    } else if ( viewCaseEquals( name, "Content-Length" ) ) {
+      if ( header != NULL ) {
+	return 400;
+      }
+      header = &r->headers[i].value;
+    }
+  }
+
+  if ( encoding != NULL ) {
+    *length = -1;
+    if ( header != NULL ) {
+      return 400;
+    }
+    return viewCaseEquals( encoding, "chunked" ) ? 0 : 501;
+  }
+  if ( header == NULL ) {
+    return 411;
+  }
+  *length = 0;
+  for ( int i = 0; i < header->length; i++ ) {
+    if ( header->data[i] < '0' || header->data[i] > '9' || *length > ( 1LL << 50 ) ) {
+      return 400;
+    }
+    *length = *length * 10 + header->data[i] - '0';
+  }
+  return header->length > 0 ? 0 : 400;
+}
+
+// Close one of the pipes to a CGI script, taking it out of the epoll set
+// first: a script that hasn't reached exec() yet still holds a copy,
+// which would keep it in there
+static void closeCgiPipe( Connection * c, int * fd ) {
+  if ( c->epfd != -1 ) {
+    epoll_ctl( c->epfd, EPOLL_CTL_DEL, *fd, NULL );
+  }
+  close( *fd );
+  *fd = -1;
+}
+
+// The script's ends of its pipes, once it has them
+static void closeScriptEnds( int input, int output ) {
+  if ( input != -1 ) {
+    close( input );
+  }
+  if ( output != -1 ) {
+    close( output );
+  }
+}
+
+// The script doesn't take the rest of the request body, which is then
+// left unread on the connection
+static void dropBody( Connection * c ) {
+  if ( c->cgiIn != -1 ) {
+    closeCgiPipe( c, &c->cgiIn );
+  }
+  bodyFree( &c->body );
+  c->keepAlive = 0;
+}
+
+// Let go of a CGI script, whatever it is still doing
+static void cgiRelease( Connection * c ) {
+  if ( c->cgiIn != -1 ) {
+    closeCgiPipe( c, &c->cgiIn );
+  }
+  if ( c->cgiOut != -1 ) {
+    closeCgiPipe( c, &c->cgiOut );
+  }
+  bodyFree( &c->body );
+  cgiOutputFree( &c->output );
+}
+
+// Queue up a 304 response, the client has the current version of the
+// file described by st
+static void notModifiedResponse( Connection * c, const char * uri, const struct stat * st ) {
+  LOG( LOG_DEBUG, "not modified" );
+  c->status = 304;
+  c->headerLength = snprintf(c->header, sizeof(c->header),
+      "HTTP/1.1 304 Not Modified\r\nServer: CS 252 lab5\r\n");
+  c->headerLength += formatValidators(c->header + c->headerLength,
+      sizeof(c->header) - c->headerLength, uri, st, 0);
+  c->headerLength += snprintf(c->header + c->headerLength,
+      sizeof(c->header) - c->headerLength, "%s", connectionHeader(c));
+}
+
+// Queue up a 416 response, no range the client asked for is in the file
+static void rangeNotSatisfiable( Connection * c, const struct stat * st ) {
+  c->status = 416;
+  c->headerLength = snprintf(c->header, sizeof(c->header),
+      "HTTP/1.1 416 Range Not Satisfiable\r\nServer: CS 252 lab5\r\n"
+      "Content-Range: bytes */%lld\r\nContent-Length: 0\r\n%s",
+      (long long)st->st_size, connectionHeader(c));
+}
+
+// Header of one part of a multipart/byteranges body
+static int formatPartHeader( char * buf, size_t size, Connection * c, const ByteRange * range ) {
+  return snprintf(buf, size,
+      "\r\n--%016lx\r\nContent-type: %s\r\nContent-Range: bytes %lld-%lld/%lld\r\n\r\n",
+      c->boundary, c->contentType, (long long)range->first, (long long)range->last,
+      (long long)c->fileSize);
+}
+
+static int formatClosingBoundary( char * buf, size_t size, Connection * c ) {
+  return snprintf(buf, size, "\r\n--%016lx--\r\n", c->boundary);
+}
+
+// Queue up a 206 response for the count ranges in c->ranges. A single
+// range is sent as is, several as a multipart/byteranges body.
+static void partialContent( Connection * c, const char * uri, const char * contentType,
+    const struct stat * st, int count ) {
+  static unsigned long boundaries;
+  char scratch[BYTES];
+
+  c->status = 206;
+  c->fileOffset = c->ranges[0].first;
+  c->fileRemaining = c->ranges[0].last - c->ranges[0].first + 1;
+
+  if ( count == 1 ) {
+    c->headerLength = snprintf(c->header, sizeof(c->header),
+	"HTTP/1.1 206 Partial Content\r\nServer: CS 252 lab5\r\nContent-type: %s\r\n"
+	"Content-Length: %lld\r\nContent-Range: bytes %lld-%lld/%lld\r\n",
+	contentType, (long long)c->fileRemaining, (long long)c->ranges[0].first,
+	(long long)c->ranges[0].last, (long long)st->st_size);
   } else {
-    return "text/plain";
+    c->rangeCount = count;
+    c->rangeIndex = 0;
+    c->fileSize = st->st_size;
+    c->contentType = contentType;
+    c->boundary = __atomic_add_fetch( &boundaries, 1, __ATOMIC_RELAXED ) *
+      0x9e3779b97f4a7c15UL ^ (unsigned long)time( NULL );
+
+    long long length = formatClosingBoundary( scratch, sizeof(scratch), c );
+    for ( int i = 0; i < count; i++ ) {
+      length += formatPartHeader( scratch, sizeof(scratch), c, &c->ranges[i] ) +
+	c->ranges[i].last - c->ranges[i].first + 1;
+    }
+
+    c->headerLength = snprintf(c->header, sizeof(c->header),
+	"HTTP/1.1 206 Partial Content\r\nServer: CS 252 lab5\r\n"
+	"Content-type: multipart/byteranges; boundary=%016lx\r\nContent-Length: %lld\r\n",
+	c->boundary, length);
   }
+
+  c->headerLength += formatValidators(c->header + c->headerLength,
+      sizeof(c->header) - c->headerLength, uri, st, 0);
+  c->headerLength += snprintf(c->header + c->headerLength,
+      sizeof(c->header) - c->headerLength, "%s", connectionHeader(c));
+  if ( count > 1 ) {
+    c->headerLength += formatPartHeader(c->header + c->headerLength,
+	sizeof(c->header) - c->headerLength, c, &c->ranges[0]);
+  }
+  c->fileStart = c->fileOffset;
 }
 
-void * respond( int socket ) {
-  char message[MAX_MESSAGE];
-  char * request[3];
-  char data_to_send[BYTES];
-  char path[MAX_MESSAGE];
-
-  //int socket = *(int*)socketVoid;
-  int bytes_received; 
-  int bytes_read;
-  int fd;
-  
-  // clear this variable
-  setenv("QUERY_STRING", "", 1);
+// Once a part of a multipart/byteranges body has gone out, queue the
+// next one's header and range, or the closing boundary. Returns 0 when
+// there is nothing left to send.
+int connectionNextPart( Connection * c ) {
+  if ( c->rangeIndex >= c->rangeCount ) {
+    return 0;
+  }
 
-  memset( (void*)message, (int)'\0', MAX_MESSAGE );
-  // receive message on socket
-  bytes_received = recv(socket, message, MAX_MESSAGE, 0);
-  
-  if (bytes_received == -1) { // error
-    fprintf(stderr, "recv error\n");
-    printf("mesg: %s\n", message);
-  } else if (bytes_received == 0) { // socket closed
-    fprintf(stderr, "client disconnected\n");
-    fflush(stdout);
-  } else { 
-    // message received!
-    printf("\n%s", message);
-    
-    // tokenize message
-    request[0] = strtok (message, " \t\n");
-
-    if ( strncmp(request[0], "GET\0", 4) == 0 ) {
-      // if it's a GET, tokenize some more
-      request[1] = strtok (NULL, " \t");
-      request[2] = strtok (NULL, " \t\n");
-
-      // check for bad requests (error 400)
-      if ( strncmp( request[2], "HTTP/1.0", 8) != 0 && 
-	   strncmp( request[2], "HTTP/1.1", 8) != 0 ) {
-	write( socket, "HTTP/1.0 400 Bad Request\n", 25 );
-
-      } else if ( !strncmp(request[1], "/cgi-bin/", strlen("/cgi-bin/")) ) {
-	// CGI response
-	pid_t pid;
-	if ( (pid = fork()) == 0) {
-	  // in the child process
-	  
-	  // tokenize the request to separate variable=value part
-	  char * execvars[2];
-      	  execvars[0] = strtok(request[1], "?");
-	  execvars[1] = strtok(NULL, "\0");
-	  if (execvars[1] != NULL) { // only if we have variables
-	    setenv("REQUEST_METHOD", "GET", 1);
-	    setenv("QUERY_STRING", execvars[1], 1);
+  c->partsSent += c->headerSent + c->fileOffset - c->fileStart;
+  c->headerSent = 0;
+  c->rangeIndex++;
+
+  if ( c->rangeIndex < c->rangeCount ) {
+    ByteRange * range = &c->ranges[c->rangeIndex];
+    c->headerLength = formatPartHeader(c->header, sizeof(c->header), c, range);
+    c->fileOffset = range->first;
+    c->fileRemaining = range->last - range->first + 1;
+  } else {
+    c->headerLength = formatClosingBoundary(c->header, sizeof(c->header), c);
+    c->fileOffset = 0;
+  }
+  c->fileStart = c->fileOffset;
+  return 1;
+}
+
+// Queue up the metrics in Prometheus text format. They are written to a
+// memfd and go out like a file.
+static void serverStatus( Connection * c ) {
+  int fd = memfd_create( "server-status", MFD_CLOEXEC );
+  int copy = fd < 0 ? -1 : dup( fd );
+  FILE * out = copy < 0 ? NULL : fdopen( copy, "w" );
+  if ( out == NULL ) {
+    if ( copy >= 0 ) {
+      close( copy );
+    }
+    if ( fd >= 0 ) {
+      close( fd );
+    }
+    errorResponse( c, 503, "Service Unavailable", "" );
+    return;
+  }
+  metricsFormat( out );
+  fclose( out );
+
+  struct stat st;
+  fstat( fd, &st );
+  c->status = 200;
+  c->fd = fd;
+  c->fileRemaining = st.st_size;
+  c->headerLength = snprintf(c->header, sizeof(c->header),
+      "HTTP/1.1 200 Document follows\r\nServer: CS 252 lab5\r\n"
+      "Content-type: text/plain; version=0.0.4; charset=utf-8\r\n"
+      "Content-Length: %lld\r\nCache-Control: no-store\r\n%s",
+      (long long)st.st_size, connectionHeader(c));
+}
+
+// The cached copy of path to send a client: a gzipped one if it takes
+// gzip, else the plain one. For a client that takes gzip a plain copy
+// goes to *plain instead, it only does if compressing the file doesn't
+// pay and there is no precompressed copy next to it.
+static CacheEntry * cachedCopy( const char * path, const char * gzPath, int gzip,
+    CacheEntry ** plain ) {
+  CacheEntry * e = NULL;
+  *plain = NULL;
+  if ( gzip && (e = cacheLookup(gzPath, ENCODING_GZIP)) == NULL ) {
+    e = cacheLookup(path, ENCODING_GZIP);
+  }
+  if ( e == NULL && (e = cacheLookup(path, ENCODING_IDENTITY)) != NULL && gzip ) {
+    *plain = e;
+    e = NULL;
+  }
+  return e;
+}
+
+// What serving the buffered request may have to wait for, so the -s
+// scheduler can keep its own threads to what never blocks. A file does
+// unless the cache has the copy this client gets; a range of it always
+// comes from the file.
+int connectionBlocking( Connection * c ) {
+  HttpRequest * r = &c->request;
+  char uri[MAX_MESSAGE + 1];
+  char path[MAX_MESSAGE + PATH_MAX];
+
+  // a bad request just gets an error
+  if ( r->status == PARSE_ERROR || viewCopy( &r->path, uri, sizeof(uri) ) < 0 ) {
+    return BLOCKS_NEVER;
+  }
+  if ( !strncmp(uri, "/cgi-bin/", strlen("/cgi-bin/")) ||
+       !strncmp(uri, "/mod/", strlen("/mod/")) ) {
+    return BLOCKS_ON_SCRIPT;
+  }
+  if ( !viewEquals( &r->method, "GET" ) ||
+       ( statusPath != NULL && !strcmp( uri, statusPath ) ) ) {
+    return BLOCKS_NEVER;
+  }
+  if ( httpFindHeader( r, "Range" ) != NULL ) {
+    return BLOCKS_ON_DISK;
+  }
+
+  // the copy serveRequest() would send this client
+  if ( !strcmp( uri, "/" ) ) {
+    strcpy( uri, "/index.html" );
+  }
+  snprintf( path, sizeof(path), "%s/htdocs%s", ROOT, uri );
+  char gzPath[sizeof(path) + 3];
+  snprintf( gzPath, sizeof(gzPath), "%s.gz", path );
+  int gzip = compressible( mimeType(uri) ) && acceptsGzip( r );
+  CacheEntry * plain;
+  CacheEntry * e = cachedCopy( path, gzPath, gzip, &plain );
+  if ( e != NULL ) {
+    cacheRelease( e );
+    return BLOCKS_NEVER;
+  }
+  if ( plain == NULL ) {
+    return BLOCKS_ON_DISK;
+  }
+  // the plain copy only does if there is nothing better to send
+  int blocks = worthCompressing( plain->bodyLength ) || access( gzPath, F_OK ) == 0 ?
+    BLOCKS_ON_DISK : BLOCKS_NEVER;
+  cacheRelease( plain );
+  return blocks;
+}
+
+static int serveRequest( Connection * c ) {
+  HttpRequest * r = &c->request;
+  char uri[MAX_MESSAGE + 1];
+  char path[MAX_MESSAGE + PATH_MAX];
+  int socket = c->socket;
+
+  // message received!
+  LOG( LOG_DEBUG, "request:\n%.*s", c->requestLength, c->message );
+
+  // check for bad requests (error 400)
+  if ( r->status == PARSE_ERROR ||
+       !( viewEquals( &r->version, "HTTP/1.0" ) || viewEquals( &r->version, "HTTP/1.1" ) ) ) {
+    errorResponse( c, 400, "Bad Request", "" );
+    return IO_DONE;
+  }
+
+  // a body only comes with POST and PUT, and only CGI scripts take one
+  int hasBody = viewEquals( &r->method, "POST" ) || viewEquals( &r->method, "PUT" );
+  if ( !hasBody && !viewEquals( &r->method, "GET" ) ) {
+    errorResponse( c, 501, "Not Implemented", "" );
+    return IO_DONE;
+  }
+
+  // HTTP/1.1 connections persist unless the client asks otherwise,
+  // HTTP/1.0 ones only if the client asks for it
+  const StringView * connection = httpFindHeader( r, "Connection" );
+  c->requests++;
+  c->keepAlive = KeepAliveTimeout > 0 && c->requests < MaxKeepAliveRequests &&
+    ( viewEquals( &r->version, "HTTP/1.1" ) ?
+      !( connection && httpHasToken( connection, "close" ) ) :
+      ( connection && httpHasToken( connection, "keep-alive" ) ) );
+
+  viewCopy( &r->path, uri, sizeof(uri) );
+
+  if ( hasBody && strncmp(uri, "/cgi-bin/", strlen("/cgi-bin/")) ) {
+    errorResponse( c, 405, "Method Not Allowed", "Allow: GET\r\n" );
+    return IO_DONE;
+  }
+
+  if ( statusPath != NULL && !strcmp( uri, statusPath ) ) {
+    serverStatus( c );
+    return IO_DONE;
+  }
+
+  if ( !strncmp(uri, "/mod/", strlen("/mod/")) ) {
+    // loadable module, runs right here on this thread
+    snprintf( path, sizeof(path), "%s/mod", ROOT );
+    const char * name = uri + strlen("/mod/");
+    Module * m = moduleAcquire( path, name );
+    if ( m == NULL ) {
+      notFound( c );
+      return IO_DONE;
+    }
+
+    // like a CGI script the module writes the rest of the header and
+    // closes the connection, so it gets a blocking copy of the socket
+    // to close and ours stays valid
+    const char * status = "HTTP/1.1 200 Document follows\r\nServer: CS 252 lab5\r\n";
+    int copy = dup( socket );
+    if ( copy < 0 ||
+	 fcntl( copy, F_SETFL, fcntl( copy, F_GETFL ) & ~O_NONBLOCK ) < 0 ||
+	 send( copy, status, strlen(status), MSG_NOSIGNAL ) < 0 ) {
+      if ( copy >= 0 ) {
+	close( copy );
+      }
+      moduleRelease( m );
+      return IO_CLOSE;
+    }
+
+    char query[MAX_MESSAGE + 1];
+    if ( viewCopy( &r->query, query, sizeof(query) ) < 0 ) {
+      query[0] = '\0';
+    }
+    LOG( LOG_DEBUG, "running module %s/%s", path, name );
+    c->status = 200;
+    m->run( copy, query );
+    moduleRelease( m );
+    return IO_CLOSE;
+  }
+
+  if ( !strncmp(uri, "/cgi-bin/", strlen("/cgi-bin/")) ) {
+    // CGI response, the script's output comes back through a pipe
+    // and connectionWrite() passes it on
+    pid_t pid;
+
+    // /cgi-bin/NAME is the script, whatever follows is its PATH_INFO
+    char * pathInfo = strchr( uri + strlen("/cgi-bin/"), '/' );
+    int scriptNameLength = pathInfo != NULL ? pathInfo - uri : (int)strlen( uri );
+    snprintf( path, sizeof(path), "%s%.*s", ROOT, scriptNameLength, uri );
+
+    // a script that isn't there is a 404 whoever would start it, and
+    // a body sent along is left unread. So is the directory, for a
+    // request without a script name.
+    struct stat script;
+    if ( stat( path, &script ) < 0 || !S_ISREG( script.st_mode ) ||
+	 access( path, X_OK ) < 0 ) {
+      c->keepAlive = c->keepAlive && !hasBody;
+      notFound( c );
+      return IO_DONE;
+    }
+
+    char query[MAX_MESSAGE + 1];
+    int hasQuery = viewCopy( &r->query, query, sizeof(query) ) >= 0;
+    LOG( LOG_DEBUG, "QUERY_STRING: %s", hasQuery ? query : "" );
+
+    // everything else the script learns about the request is in its
+    // environment, built here rather than set in ours
+    CgiEnv env;
+    char documentRoot[PATH_MAX];
+    snprintf( documentRoot, sizeof(documentRoot), "%s/htdocs", ROOT );
+    cgiEnvInit( &env );
+    cgiEnvAddView( &env, "SERVER_PROTOCOL", &r->version );
+    cgiEnvAddView( &env, "REQUEST_METHOD", &r->method );
+    cgiEnvAddView( &env, "REQUEST_URI", &r->uri );
+    cgiEnvAddView( &env, "QUERY_STRING", &r->query );
+    cgiEnvAdd( &env, "DOCUMENT_ROOT", documentRoot );
+    cgiEnvAdd( &env, "SCRIPT_FILENAME", path );
+    if ( pathInfo != NULL ) {
+      char translated[sizeof(path)];
+      snprintf( translated, sizeof(translated), "%s%s", documentRoot, pathInfo );
+      cgiEnvAdd( &env, "PATH_INFO", pathInfo );
+      cgiEnvAdd( &env, "PATH_TRANSLATED", translated );
+      *pathInfo = '\0';
+    }
+    cgiEnvAdd( &env, "SCRIPT_NAME", uri );
+    cgiEnvSocket( &env, socket, r );
+    cgiEnvHeaders( &env, r );
+
+    CgiRequest request;
+    request.script = path;
+    request.query = hasQuery ? query : NULL;
+    request.input = -1;
+
+    long long length = -1;
+    if ( hasBody ) {
+      int status = requestBodyLength( r, &length );
+      if ( status == 411 ) {
+	errorResponse( c, 411, "Length Required", "" );
+	return IO_DONE;
+      } else if ( status == 501 ) {
+	errorResponse( c, 501, "Not Implemented", "" );
+	return IO_DONE;
+      } else if ( status != 0 ) {
+	errorResponse( c, 400, "Bad Request", "" );
+	return IO_DONE;
+      }
+      if ( cgiConfig.maxBody > 0 && length > cgiConfig.maxBody ) {
+	errorResponse( c, 413, "Content Too Large", "" );
+	return IO_DONE;
+      }
+
+      // a chunked body's length isn't known up front
+      const StringView * type = httpFindHeader( r, "Content-Type" );
+      if ( type != NULL ) {
+	cgiEnvAddView( &env, "CONTENT_TYPE", type );
+      }
+      if ( length >= 0 ) {
+	char number[32];
+	snprintf( number, sizeof(number), "%lld", length );
+	cgiEnvAdd( &env, "CONTENT_LENGTH", number );
+      }
+    }
+    request.env = env.data;
+    request.envLength = env.length;
+
+    // an nph- script writes the whole response itself
+    const char * name = strrchr( path, '/' );
+    int nph = !strncmp( name, "/nph-", 5 );
+
+    // the script reads the body from one pipe, connectionWrite() streams
+    // it in from the socket as the script takes it, and writes to the
+    // other
+    int input[2] = { -1, -1 };
+    int output[2] = { -1, -1 };
+    int failed = pipe2( output, O_CLOEXEC ) < 0 ||
+      ( hasBody && pipe2( input, O_CLOEXEC ) < 0 );
+    c->cgiIn = input[1];
+    c->cgiOut = output[0];
+    if ( failed ||
+	 cgiOutputStart( &c->output, c->keepAlive, viewEquals( &r->version, "HTTP/1.1" ),
+	   acceptsGzip( r ), nph ) < 0 ||
+	 ( hasBody && bodyStart( &c->body, length, cgiConfig.maxBody,
+	   c->message + c->requestLength, c->received - c->requestLength ) < 0 ) ) {
+      closeScriptEnds( input[0], output[1] );
+      cgiRelease( c );
+      errorResponse( c, 503, "Service Unavailable", "" );
+      return IO_DONE;
+    }
+    request.input = input[0];
+
+    // what arrived of the body is the body's now, connectionBodyEnd()
+    // gives back what follows it
+    if ( hasBody ) {
+      c->received = c->requestLength;
+      c->message[c->received] = '\0';
+    }
+
+    // the event loops and blocking modes alike must not block on a
+    // script; io_uring waits on blocking pipes itself
+    if ( OPTION != 'u' ) {
+      fcntl( c->cgiOut, F_SETFL, O_NONBLOCK );
+      if ( c->cgiIn != -1 ) {
+	fcntl( c->cgiIn, F_SETFL, O_NONBLOCK );
+      }
+    }
+
+    // a client that asked first only sends the body once told to
+    const StringView * expect = httpFindHeader( r, "Expect" );
+    const char * proceed = "HTTP/1.1 100 Continue\r\n\r\n";
+    if ( hasBody && expect != NULL && viewCaseEquals( expect, "100-continue" ) &&
+	 send( socket, proceed, strlen(proceed), MSG_NOSIGNAL ) != (ssize_t)strlen(proceed) ) {
+      closeScriptEnds( input[0], output[1] );
+      return IO_CLOSE;
+    }
+
+    if ( cgiEnabled() ) {
+      // a worker process starts the script
+      if ( cgiSubmit( output[1], &request ) < 0 ) {
+	closeScriptEnds( input[0], output[1] );
+	cgiRelease( c );
+	errorResponse( c, 503, "Service Unavailable", "" );
+	return IO_DONE;
+      }
+    } else if ( (pid = cgiSpawn( output[1], &request )) < 0 ) {
+      closeScriptEnds( input[0], output[1] );
+      cgiRelease( c );
+      errorResponse( c, 503, "Service Unavailable", "" );
+      return IO_DONE;
+    } else {
+      // a thread of its own waits for the script
+      cgiWatch( pid );
+    }
+    closeScriptEnds( input[0], output[1] );
+
+    c->cgiDeadline = time( NULL ) + cgiConfig.timeout;
+    c->status = 200;
+    return IO_DONE;
+
+  } else {
+    // reply with the file
+    LOG( LOG_DEBUG, "request: %s", uri );
+
+    strcpy( path, ROOT );
+    strcpy( &path[strlen(ROOT)], "/htdocs" );
+
+    // if we get a request for '/' send index.html by default
+    if ( strncmp(uri, "/\0", 2) == 0 ) {
+      strcpy( uri, "/index.html" );        
+    }
+
+    strncat(path, uri, sizeof(path) - strlen(path) - 1);
+
+    LOG( LOG_DEBUG, "sending requested file: %s", path );
+    c->status = 200;
+
+    const char * contentType = mimeType(uri);
+
+    // a range of the file always comes from the file
+    const StringView * range = httpFindHeader( r, "Range" );
+
+    // text goes out gzipped to clients that take it
+    int gzip = range == NULL && compressible( contentType ) && acceptsGzip( r );
+    char gzPath[sizeof(path) + 3];
+    snprintf( gzPath, sizeof(gzPath), "%s.gz", path );
+
+    // small hot files come straight from memory
+    CacheEntry * plain = NULL;
+    if ( range == NULL ) {
+      c->entry = cachedCopy( path, gzPath, gzip, &plain );
+    }
+
+    struct stat st;
+    int encoding = ENCODING_IDENTITY;
+    const char * file = path;
+    c->fd = -1;
+
+    // a precompressed copy next to the file wins
+    if ( gzip && (c->fd = open(gzPath, O_RDONLY | O_CLOEXEC)) != -1 ) {
+      if ( fstat(c->fd, &st) == 0 && S_ISREG(st.st_mode) ) {
+	encoding = ENCODING_GZIP;
+	file = gzPath;
+      } else {
+	close( c->fd );
+	c->fd = -1;
+      }
+    }
+
+    if ( plain != NULL ) {
+      if ( encoding == ENCODING_IDENTITY && !worthCompressing( plain->bodyLength ) ) {
+	c->entry = plain;
+      } else {
+	cacheRelease( plain );
+      }
+    }
+
+    if ( c->entry != NULL ) {
+      LOG( LOG_DEBUG, "cache hit" );
+      if ( c->fd != -1 ) {
+	close( c->fd );
+	c->fd = -1;
+      }
+      if ( notModified( r, &c->entry->st ) ) {
+	notModifiedResponse( c, uri, &c->entry->st );
+	cacheRelease( c->entry );
+	c->entry = NULL;
+      }
+      return IO_DONE;
+    }
+
+    // open the file, connectionWrite() sends it over the socket
+    if ( c->fd != -1 ||
+	 ( (c->fd = open(path, O_RDONLY | O_CLOEXEC)) != -1 &&
+	   fstat(c->fd, &st) == 0 && S_ISREG(st.st_mode) ) ) {
+
+      if ( notModified( r, &st ) ) {
+	close( c->fd );
+	c->fd = -1;
+	notModifiedResponse( c, uri, &st );
+	return IO_DONE;
+      }
+
+      LOG( LOG_DEBUG, "writing doc, type: %s", contentType );
+
+      int ranges = range != NULL && rangeCurrent( r, &st ) ?
+	parseRanges( range, st.st_size, c->ranges ) : -1;
+      if ( ranges == 0 ) {
+	close( c->fd );
+	c->fd = -1;
+	rangeNotSatisfiable( c, &st );
+	return IO_DONE;
+      }
+
+      if ( ranges < 0 && encoding == ENCODING_IDENTITY && gzip && worthCompressing( st.st_size ) ) {
+	// compress it once, the cache keeps the result until the file changes
+	size_t length;
+	char * body = gzipFile( c->fd, st.st_size, &length );
+	if ( body != NULL ) {
+	  c->headerLength = formatGzipHeader(c->header, sizeof(c->header),
+	      uri, contentType, &st, length, 1);
+	  c->entry = cacheStore(path, ENCODING_GZIP, c->fd, &st,
+	      c->header, c->headerLength, body, length);
+	  free( body );
+	  if ( c->entry != NULL ) {
+	    close( c->fd );
+	    c->fd = -1;
+	    c->headerLength = 0;
+	    return IO_DONE;
 	  }
-	  
-	  printf("QUERY_STRING: %s\n", getenv("QUERY_STRING"));
-
-	  // expand the file location
-	  if ( !strcmp( request[1] + strlen("/cgi-bin/"), "finger") ) {
-	    execvars[1] = NULL;
-	  } 
-	  strcpy( path, ROOT );
-	  strcat( path, execvars[0]);
-	  execvars[0] = path;
-	  printf("executing: %s\nargs: %s\n", execvars[0], execvars[1]);
-
-	  // redirect output to socket
-	  dup2(socket, STDOUT_FILENO);
-	  dup2(socket, STDERR_FILENO);
-	  close(socket);
-
-	  printf("HTTP/1.1 200 Document follows\nServer: CS 252 lab5\n");
-	  execvp(execvars[0], execvars);
-	  printf("\n");
+	}
+      }
+
+      if ( ranges < 0 ) {
+	// write http header
+	if ( encoding == ENCODING_GZIP ) {
+	  c->headerLength = formatGzipHeader(c->header, sizeof(c->header),
+	      uri, contentType, &st, st.st_size, 0);
 	} else {
-	  // in the parent
-	  pid_t endID = waitpid( pid, NULL, 0 ); // wait for process
-	  printf("killed child: endID = %d\n", (int)endID);
+	  c->headerLength = formatFileHeader(c->header, sizeof(c->header),
+	      uri, contentType, &st);
+	}
+
+	// keep a copy for next time if it is small enough
+	if ( (c->entry = cacheFill(file, encoding, c->fd, &st, c->header, c->headerLength)) != NULL ) {
+	  close( c->fd );
+	  c->fd = -1;
+	  c->headerLength = 0;
+	  return IO_DONE;
 	}
 
+	c->fileRemaining = st.st_size;
+      }
+
+      // large files are sent from a mapping shared with other downloads
+      if ( mapMinSize > 0 && st.st_size >= mapMinSize &&
+	   (c->map = mapAcquire(c->fd, &st)) != NULL ) {
+	close( c->fd );
+	c->fd = -1;
+      }
+
+      if ( ranges > 0 ) {
+	partialContent( c, uri, contentType, &st, ranges );
+      } else {
+	c->headerLength += snprintf(c->header + c->headerLength,
+	    sizeof(c->header) - c->headerLength, "%s", connectionHeader(c));
+      }
+
+    // file not found
+    } else { // ERROR 404!!!
+      if ( c->fd != -1 ) {
+	close( c->fd );
+	c->fd = -1;
+      }
+      notFound( c );
+    } // end 404
+  } // end reply with file
+
+  return IO_DONE;
+}
+
+// The part of a cached response still to be sent: the stored header,
+// the Connection line and the stored body. Fills up to three iovecs
+// and returns how many, 0 once it has all gone out.
+int connectionCachedIov( Connection * c, struct iovec * iov ) {
+  CacheEntry * e = c->entry;
+  const char * connection = connectionHeader(c);
+  struct iovec parts[3] = {
+    { e->data, e->headerLength },
+    { (void *)connection, strlen(connection) },
+    { e->data + e->headerLength, e->bodyLength }
+  };
+
+  int count = 0;
+  size_t skip = c->entrySent;
+  for ( int i = 0; i < 3; i++ ) {
+    if ( skip >= parts[i].iov_len ) {
+      skip -= parts[i].iov_len;
+      continue;
+    }
+    iov[count].iov_base = (char *)parts[i].iov_base + skip;
+    iov[count].iov_len = parts[i].iov_len - skip;
+    count++;
+    skip = 0;
+  }
+  return count;
+}
+
+// The whole request body has been passed on. Whatever the client sent
+// after it goes back to the message buffer as the next request, unless
+// it doesn't fit there, and then the connection ends with this response.
+void connectionBodyEnd( Connection * c ) {
+  char * rest;
+  int n = bodyExcess( &c->body, &rest );
+  if ( n > MAX_MESSAGE - c->received ) {
+    c->keepAlive = 0;
+  } else if ( n > 0 ) {
+    memcpy( c->message + c->received, rest, n );
+    c->received += n;
+    c->message[c->received] = '\0';
+  }
+  bodyFree( &c->body );
+}
+
+// Pass the request body on to the CGI script's stdin. Returns IO_DONE
+// once all of it went through or the script stopped reading, IO_AGAIN
+// when the socket has nothing or the pipe no room right now, IO_CLOSE
+// if the body is malformed or too large, or the client went away.
+static int connectionBody( Connection * c ) {
+  while ( 1 ) {
+    char * data;
+    int length;
+    ssize_t n;
+
+    switch ( bodyNext( &c->body, &data, &length ) ) {
+    case BODY_DATA:
+      n = write( c->cgiIn, data, length );
+      if ( n > 0 ) {
+	bodyConsumed( &c->body, n );
+	continue;
+      }
+      if ( n < 0 && errno == EPIPE ) {
+	// the script exited or closed its stdin, its output is the answer
+	dropBody( c );
+	return IO_DONE;
+      }
+      break;
+
+    case BODY_MORE:
+      data = bodySpace( &c->body, &length );
+      n = recv( c->socket, data, length, 0 );
+      if ( n > 0 ) {
+	bodyReceived( &c->body, n );
+	continue;
+      }
+      if ( n == 0 ) {
+	LOG( LOG_DEBUG, "client disconnected in the request body" );
+	return IO_CLOSE;
+      }
+      break;
+
+    case BODY_END:
+      // the script sees the end of its input
+      closeCgiPipe( c, &c->cgiIn );
+      connectionBodyEnd( c );
+      return IO_DONE;
+
+    default:
+      LOG( LOG_INFO, "malformed or too large request body" );
+      return IO_CLOSE;
+    }
+
+    if ( errno == EINTR ) {
+      continue;
+    }
+    return errno == EAGAIN || errno == EWOULDBLOCK ? IO_AGAIN : IO_CLOSE;
+  }
+}
+
+// n bytes of the script's output were read into cgiOutputSpace(), 0
+// when it ended. A script that didn't write a proper header gets the
+// client a 502 instead, or a 504 if it was killed for taking too long.
+void connectionCgiRead( Connection * c, int n ) {
+  if ( n == 0 ) {
+    closeCgiPipe( c, &c->cgiOut );
+  }
+  if ( cgiOutputReceived( &c->output, n ) < 0 ) {
+    if ( c->cgiOut != -1 ) {
+      closeCgiPipe( c, &c->cgiOut );
+    }
+    cgiOutputFree( &c->output );
+    if ( cgiConfig.timeout > 0 && time( NULL ) >= c->cgiDeadline ) {
+      errorResponse( c, 504, "Gateway Timeout", "" );
+    } else {
+      errorResponse( c, 502, "Bad Gateway", "" );
+    }
+    return;
+  }
+  if ( c->output.status != 0 ) {
+    c->status = c->output.status;
+    c->keepAlive = c->keepAlive && c->output.keepAlive;
+  }
+}
+
+// Pass the request body to a CGI script and its output on to the
+// client, as far as either goes right now. Returns IO_DONE once the
+// whole response has been sent, or an error response queued instead.
+static int connectionCgi( Connection * c ) {
+  if ( c->body.buffer != NULL && connectionBody( c ) == IO_CLOSE ) {
+    return IO_CLOSE;
+  }
+
+  while ( c->output.buffer != NULL ) {
+    char * data;
+    int space;
+    ssize_t n;
+
+    int pending = cgiOutputPending( &c->output, &data );
+    if ( pending > 0 ) {
+      n = send( c->socket, data, pending, MSG_NOSIGNAL );
+      if ( n >= 0 ) {
+	cgiOutputSent( &c->output, n );
+	continue;
+      }
+    } else if ( cgiOutputDone( &c->output ) ) {
+      cgiOutputFree( &c->output );
+      break;
+    } else {
+      data = cgiOutputSpace( &c->output, &space );
+      n = read( c->cgiOut, data, space );
+      if ( n >= 0 ) {
+	connectionCgiRead( c, n );
+	continue;
+      }
+    }
+
+    if ( errno == EINTR ) {
+      continue;
+    }
+    return errno == EAGAIN || errno == EWOULDBLOCK ? IO_AGAIN : IO_CLOSE;
+  }
+
+  if ( c->body.buffer != NULL ) {
+    // the script is done without reading all of it
+    dropBody( c );
+  }
+  return IO_DONE;
+}
+
+// Send the queued header followed by the file, if any. Returns IO_AGAIN
+// if a non-blocking socket fills up before everything went out.
+//
+// The file goes out with sendfile(), so its contents never pass through
+// user space. Where the file system can't do sendfile() the data is
+// spliced into a pipe and from there into the socket. The header is
+// sent with MSG_MORE while a body follows so both leave in the same
+// segments instead of the header going out on its own.
+int connectionWrite( Connection * c ) {
+  while ( 1 ) {
+    ssize_t n;
+
+    if ( c->body.buffer != NULL || c->output.buffer != NULL ) {
+      // a CGI script is running
+      int result = connectionCgi( c );
+      if ( result != IO_DONE ) {
+	return result;
+      }
+      continue;
+
+    } else if ( c->entry != NULL ) {
+      // a cached response goes out in one sendmsg()
+      struct iovec iov[3];
+      struct msghdr msg;
+      memset( &msg, 0, sizeof(msg) );
+      msg.msg_iov = iov;
+      msg.msg_iovlen = connectionCachedIov( c, iov );
+
+      if ( msg.msg_iovlen == 0 ) {
+	cacheRelease( c->entry );
+	c->entry = NULL;
+	continue;
+      }
+
+      n = sendmsg( c->socket, &msg, MSG_NOSIGNAL );
+      if ( n >= 0 ) {
+	c->entrySent += n;
+	continue;
+      }
+
+    } else if ( c->headerSent < c->headerLength ) {
+      int flags = MSG_NOSIGNAL | ( c->fileRemaining > 0 ? MSG_MORE : 0 );
+      n = send( c->socket, c->header + c->headerSent,
+	  c->headerLength - c->headerSent, flags );
+      if ( n >= 0 ) {
+	c->headerSent += n;
+	continue;
+      }
+
+    } else if ( c->piped > 0 ) {
+      // flush what is sitting in the pipe
+      n = splice( c->pipe[0], NULL, c->socket, NULL, c->piped,
+	  SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+      if ( n > 0 ) {
+	c->piped -= n;
+	continue;
+      }
+
+    } else if ( c->map != NULL && c->fileRemaining > 0 ) {
+      size_t chunk = c->fileRemaining < SENDFILE_CHUNK ?
+	c->fileRemaining : SENDFILE_CHUNK;
+
+      n = send( c->socket, c->map->data + c->fileOffset, chunk, MSG_NOSIGNAL );
+      if ( n > 0 ) {
+	mapAdvise( c->map, c->fileOffset, c->fileOffset + n );
+	c->fileOffset += n;
+	c->fileRemaining -= n;
+	continue;
+      }
+
+    } else if ( c->fd != -1 && c->fileRemaining > 0 ) {
+      size_t chunk = c->fileRemaining < SENDFILE_CHUNK ?
+	c->fileRemaining : SENDFILE_CHUNK;
+
+      if ( !c->useSplice ) {
+	n = sendfile( c->socket, c->fd, &c->fileOffset, chunk );
+	if ( n > 0 ) {
+	  c->fileRemaining -= n;
+	  continue;
+	}
+	if ( n < 0 && ( errno == EINVAL || errno == ENOSYS ) ) {
+	  // not supported for this file, go through a pipe instead
+	  c->useSplice = 1;
+	  continue;
+	}
       } else {
-	// reply with the file
-	printf("request: %s\n", request[1]);
-
-	strcpy( path, ROOT );
-	strcpy( &path[strlen(ROOT)], "/htdocs" );
-
-	// if we get a request for '/' send index.html by default
-	if ( strncmp(request[1], "/\0", 2) == 0 ) {
-	  request[1] = "/index.html";        
-	} else if ( !strcmp( request[1], "/favicon.ico" ) ) {
-	  // ignore requests for the favicon
-	  return 0;
+	if ( c->pipe[0] == -1 && pipe2( c->pipe, O_NONBLOCK | O_CLOEXEC ) < 0 ) {
+	  return IO_CLOSE;
 	}
+	n = splice( c->fd, &c->fileOffset, c->pipe[1], NULL, chunk,
+	    SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+	if ( n > 0 ) {
+	  c->fileRemaining -= n;
+	  c->piped = n;
+	  continue;
+	}
+      }
 
-	strcat(path, request[1]);
+      if ( n == 0 ) {
+	// the file shrank under us, the Content-Length can't be met
+	return IO_CLOSE;
+      }
 
-	printf("sending requested file: %s\n", path);
-	char * contentType = findContentType(request[1]);
-	char write_buf[1024];
+    } else if ( connectionNextPart( c ) ) {
+      continue;
 
-	// read file and send it over the socket
-	if ( (fd = open(path, O_RDONLY)) != -1 ) {
+    } else {
+      if ( c->fd != -1 ) {
+	close(c->fd);
+	c->fd = -1;
+	LOG( LOG_DEBUG, "finished writing document" );
+      }
+      if ( c->map != NULL ) {
+	mapRelease( c->map );
+	c->map = NULL;
+	LOG( LOG_DEBUG, "finished writing document" );
+      }
+      logRequest( c );
+      return IO_DONE;
+    }
 
-	  printf("writing doc, type: %s\n", contentType);
+    if ( errno == EINTR ) {
+      continue;
+    } else if ( errno == EAGAIN || errno == EWOULDBLOCK ) {
+      return IO_AGAIN;
+    } else {
+      return IO_CLOSE;
+    }
+  }
+}
 
-	  // write http header
-	  sprintf(write_buf, 
-	      "HTTP/1.1 200 Document follows\nServer: CS 252 lab5\nContent-type: %s\n\n", contentType);
-	  write(socket, write_buf, strlen(write_buf));
+// Get ready for the next request on a persistent connection. Returns
+// IO_CLOSE if the connection should be closed instead.
+int connectionNext( Connection * c ) {
+  if ( !c->keepAlive ) {
+    return IO_CLOSE;
+  }
 
-	  // write document
-	  while ( (bytes_read = read(fd, data_to_send, BYTES)) > 0 ) {
-	    write (socket, data_to_send, bytes_read);
-	  }
-	  write(socket, "\n", 1);
-
-	  printf("finished writing document\n");
-	// file not found
-	} else { // ERROR 404!!!
-	  printf("404 file not found!\n");
-	  sprintf(write_buf, 
-	      "HTTP/1.1 404 File Not Found\nServer: CS 252 lab5\nContent-type: %s\n\n<html><h1>404 File Not Found</h1></html>\n",
-	      contentType);
-	  write(socket, write_buf, strlen(write_buf));
-	} // end 404
-      } // end reply with file
-    } // end GET response
-  } // end while
-
-  printf("closing socket\n");
-  shutdown( socket, 2);
-  close( socket ); // Close socket
+  // keep whatever the client pipelined behind the request just served
+  c->received -= c->requestLength;
+  memmove( c->message, c->message + c->requestLength, c->received + 1 );
+  c->requestLength = 0;
+  httpParserInit( &c->request );
+
+  c->state = CONN_READING;
+  c->headerLength = 0;
+  c->headerSent = 0;
+  c->fileOffset = 0;
+  c->fileStart = 0;
+  c->rangeCount = 0;
+  c->rangeIndex = 0;
+  c->partsSent = 0;
+  c->entrySent = 0;
+  c->output.sent = 0;
+  c->started = 0;
+  c->responded = 0;
+  return IO_DONE;
+}
+
+void connectionClose( Connection * c ) {
+  // a response that was cut short
+  logRequest( c );
+
+  // a script still running sees its pipes close, and the reaper or its
+  // worker collects it once it exits
+  cgiRelease( c );
+
+  if ( c->fd != -1 ) {
+    close( c->fd );
+    c->fd = -1;
+  }
+  if ( c->pipe[0] != -1 ) {
+    close( c->pipe[0] );
+    close( c->pipe[1] );
+  }
+  if ( c->entry != NULL ) {
+    cacheRelease( c->entry );
+    c->entry = NULL;
+  }
+  if ( c->map != NULL ) {
+    mapRelease( c->map );
+    c->map = NULL;
+  }
+  LOG( LOG_DEBUG, "closing socket" );
+  metricsClosed();
+  admissionLeave();
+  lingerClose( c->socket );
+}
+
+// connectionWrite() on a blocking socket. A CGI script's pipes never
+// block, so when the script is slow this waits for them; a socket that
+// would block has hit its timeout instead, and the connection is done.
+int connectionWriteBlocking( Connection * c ) {
+  int result;
+  while ( (result = connectionWrite( c )) == IO_AGAIN ) {
+    struct pollfd fds[2];
+    int count = 0;
+    char * data;
+    int length;
+
+    if ( c->output.buffer != NULL && cgiOutputPending( &c->output, &data ) > 0 ) {
+      return IO_CLOSE;
+    }
+    if ( c->body.buffer != NULL ) {
+      if ( bodyNext( &c->body, &data, &length ) != BODY_DATA ) {
+	return IO_CLOSE;
+      }
+      fds[count].fd = c->cgiIn;
+      fds[count].events = POLLOUT;
+      count++;
+    }
+    if ( c->cgiOut != -1 ) {
+      fds[count].fd = c->cgiOut;
+      fds[count].events = POLLIN;
+      count++;
+    }
+
+    if ( count == 0 || ( poll( fds, count, -1 ) < 0 && errno != EINTR ) ) {
+      return IO_CLOSE;
+    }
+  }
+  return result;
+}
+
+void * respond( int socket ) {
+  Connection c;
+
+  connectionInit( &c, socket );
+
+  // a blocked recv()/send() gives up once the connection has been idle
+  // for the keep-alive timeout
+  if ( KeepAliveTimeout > 0 ) {
+    struct timeval timeout;
+    timeout.tv_sec = KeepAliveTimeout;
+    timeout.tv_usec = 0;
+    setsockopt( socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout) );
+    setsockopt( socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout) );
+  }
+
+  // serve requests until the client is done or keep-alive runs out
+  while ( connectionRead( &c ) == IO_DONE &&
+	  connectionRespond( &c ) == IO_DONE &&
+	  connectionWriteBlocking( &c ) == IO_DONE &&
+	  connectionNext( &c ) == IO_DONE ) {
+  }
+  connectionClose( &c );
   return 0;
 }
 
@@ -407,6 +2025,7 @@ void * respond( int socket ) {
 // responseHandler() is called by pthread_create()
 void * responseHandler(void * socketDescriptor) {
   int socket = *(int*)socketDescriptor;
+  free( socketDescriptor );
 
   respond(socket);
   return 0;
@@ -0,0 +1,152 @@
+#ifndef MYHTTPD_H
+#define MYHTTPD_H
+
+#include <netinet/in.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#include "byte-range.h"
+#include "cgi-output.h"
+#include "http-parser.h"
+#include "request-body.h"
+
+#define MAX_MESSAGE 2000
+#define BYTES 1024
+#define SENDFILE_CHUNK (1 << 30)
+#define DEFAULT_PORT 14566
+
+struct CacheEntry;
+struct FileMap;
+
+// result of one step of the connection state machine
+enum {
+  IO_DONE,  // step finished, move on to the next one
+  IO_AGAIN, // socket would block, wait for the next epoll event
+  IO_CLOSE  // nothing more to do on this connection, close it
+};
+
+// where a connection is in its request/response cycle
+enum {
+  CONN_READING,
+  CONN_WRITING,
+  CONN_CLOSED   // closed, freed once no event can refer to it any more
+};
+
+// what serving a request may have to wait for, see connectionBlocking()
+enum {
+  BLOCKS_NEVER,
+  BLOCKS_ON_DISK,  // a file the cache doesn't have
+  BLOCKS_ON_SCRIPT // a CGI script or loadable module
+};
+
+// Everything respond() needs to serve a connection. The blocking modes
+// keep one on the stack; the event loops keep one per open connection
+// and resume it whenever the socket becomes ready again.
+struct Connection {
+  int socket;
+  int state;
+
+  // idle list of the event loop, oldest first
+  Connection * prev;
+  Connection * next;
+  time_t lastActive;
+
+  // request bytes received so far, possibly several pipelined requests
+  char message[MAX_MESSAGE + 1];
+  int received;
+  int requestLength; // size of the request being served
+  HttpRequest request;
+  int requests;      // requests served on this connection
+  int keepAlive;     // keep the connection open after this response
+
+  // response header (and small bodies such as error pages)
+  char header[BYTES];
+  int headerLength;
+  int headerSent;
+
+  // file being sent after the header, -1 if none
+  int fd;
+  off_t fileOffset;
+  off_t fileRemaining;
+  off_t fileStart; // where fileOffset started
+
+  // a multipart/byteranges body: after each range the header buffer
+  // gets the next part's header, after the last the closing boundary
+  ByteRange ranges[MAX_RANGES];
+  int rangeCount;  // 0 unless there are several ranges
+  int rangeIndex;  // the one being sent
+  off_t fileSize;
+  const char * contentType;
+  unsigned long boundary;
+  long long partsSent; // bytes of the parts already sent
+
+  // pipe the file is spliced through when sendfile() can't be used
+  int useSplice;
+  int pipe[2];
+  int piped; // bytes sitting in the pipe
+
+  // cached response being sent instead of header and file
+  CacheEntry * entry;
+  size_t entrySent;
+
+  // shared mapping the file is sent from instead of fd
+  FileMap * map;
+
+  // a CGI script: the request body streamed into its stdin, and its
+  // output read from a pipe and passed on to the client
+  int cgiIn;     // write end of the script's stdin, -1 if none
+  int cgiOut;    // read end of the script's stdout, -1 if none
+  time_t cgiDeadline; // when the script gets killed
+  RequestBody body;
+  CgiOutput output;
+  int epfd;      // epoll set the pipes are watched in, -1 if none
+
+  // for the access log
+  int status;    // of the response being sent, 0 once logged
+  char peer[INET6_ADDRSTRLEN];
+
+  // for the metrics, in metricsNow() nanoseconds
+  long long started;   // first byte of the request arrived, 0 before
+  long long responded; // the response was queued
+  int sendPhase;       // PHASE_SEND, or PHASE_CGI while a script runs
+};
+
+// Connections of one event loop thread, least recently active first
+struct IdleList {
+  Connection * head;
+  Connection * tail;
+};
+
+extern char * ROOT;
+extern char OPTION;
+extern int KeepAliveTimeout;
+extern int MaxKeepAliveRequests;
+
+int formatFileHeader( char * buf, size_t size, const char * uri, const char * contentType,
+    const struct stat * st );
+void connectionInit( Connection * c, int socket );
+int connectionParse( Connection * c );
+int connectionRead( Connection * c );
+int connectionRespond( Connection * c );
+int connectionWrite( Connection * c );
+int connectionWriteBlocking( Connection * c );
+int connectionBlocking( Connection * c );
+void connectionUnavailable( Connection * c );
+int connectionNext( Connection * c );
+void connectionClose( Connection * c );
+int connectionCachedIov( Connection * c, struct iovec * iov );
+int connectionNextPart( Connection * c );
+void connectionCgiRead( Connection * c, int n );
+void connectionBodyEnd( Connection * c );
+
+void idleRemove( IdleList * l, Connection * c );
+void idleAppend( IdleList * l, Connection * c );
+Connection * idleExpired( IdleList * l, int * timeout );
+
+void runEventLoop( int masterSocket, int reactors );
+void eventLoopDrain();
+void runUringLoop( int masterSocket );
+
+#endif
@@ -0,0 +1,136 @@
+//------------------------------------------------------------------------
+// Program:   parser-bench
+//
+// Purpose:   measure the request parser on its own. Parses a few
+//            typical requests over and over, once arriving whole and
+//            once arriving in small segments, and prints the time per
+//            request and the throughput for each.
+//
+// Syntax:    parser-bench [seconds]
+//
+//               seconds - how long to run each case, 1 by default
+//
+//------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "http-parser.h"
+
+struct BenchCase {
+  const char * name;
+  const char * request;
+};
+
+BenchCase cases[] = {
+  { "curl GET",
+    "GET /index.html HTTP/1.1\r\n"
+    "Host: localhost:14570\r\n"
+    "User-Agent: curl/8.5.0\r\n"
+    "Accept: */*\r\n"
+    "\r\n" },
+  { "browser GET",
+    "GET /htdocs/complex.html?lang=en&ref=front HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "Connection: keep-alive\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+    "(KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+    "image/avif,image/webp,*/*;q=0.8\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "Cookie: session=4f2a9c1e7b3d8a6f0e5c2b1a9d8e7f6a; theme=dark\r\n"
+    "If-None-Match: \"5e1f-61a2b3c4\"\r\n"
+    "If-Modified-Since: Sat, 17 Oct 2026 09:12:44 GMT\r\n"
+    "\r\n" },
+  { "form POST",
+    "POST /cgi-bin/post-query HTTP/1.1\r\n"
+    "Host: localhost\r\n"
+    "Content-Type: application/x-www-form-urlencoded\r\n"
+    "Content-Length: 7\r\n"
+    "\r\n"
+    "a=1&b=2" },
+};
+
+// bytes per segment when a request doesn't arrive whole
+#define SEGMENT 32
+
+  double
+now()
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Parse the request as it grows by segment bytes at a time, all of it
+// at once if segment is 0. Returns the parser's result.
+  int
+parseOnce( HttpRequest * r, const char * request, int length, int segment )
+{
+  httpParserInit( r );
+  if ( segment == 0 ) {
+    return httpParse( r, request, length );
+  }
+  int have = 0;
+  while ( r->status == PARSE_AGAIN && have < length ) {
+    have = have + segment < length ? have + segment : length;
+    httpParse( r, request, have );
+  }
+  return r->status;
+}
+
+  void
+runCase( const BenchCase * bc, int segment, double seconds )
+{
+  int length = strlen( bc->request );
+  HttpRequest r;
+  if ( parseOnce( &r, bc->request, length, segment ) != PARSE_DONE ) {
+    printf( "%-12s doesn't parse\n", bc->name );
+    exit( 1 );
+  }
+
+  long requests = 0;
+  double start = now();
+  double elapsed;
+  do {
+    // check the clock only now and then
+    for ( int i = 0; i < 1000; i++ ) {
+      parseOnce( &r, bc->request, length, segment );
+      // keep the compiler from dropping the work
+      __asm__ __volatile__( "" : : "r"( r.headerCount ) : "memory" );
+    }
+    requests += 1000;
+    elapsed = now() - start;
+  } while ( elapsed < seconds );
+
+  char how[32];
+  if ( segment == 0 ) {
+    snprintf( how, sizeof(how), "whole" );
+  } else {
+    snprintf( how, sizeof(how), "%d-byte pieces", segment );
+  }
+  printf( "%-12s %-15s %5d bytes %8.1f ns/request %8.0f MB/s\n",
+	  bc->name, how, length, elapsed * 1e9 / requests,
+	  requests * (double)length / elapsed / 1e6 );
+}
+
+  int
+main( int argc, char ** argv )
+{
+  double seconds = argc > 1 ? atof( argv[1] ) : 1;
+  if ( seconds <= 0 ) {
+    printf( "Usage: parser-bench [seconds]\n" );
+    exit( 1 );
+  }
+
+  for ( unsigned i = 0; i < sizeof(cases) / sizeof(cases[0]); i++ ) {
+    runCase( &cases[i], 0, seconds );
+    runCase( &cases[i], SEGMENT, seconds );
+  }
+  return 0;
+}
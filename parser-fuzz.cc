@@ -0,0 +1,272 @@
+//------------------------------------------------------------------------
+// Program:   parser-fuzz
+//
+// Purpose:   fuzz the incremental request parser. Each round builds a
+//            random request, mangles some of them, and feeds it to
+//            httpParse() split at random points, every piece in a
+//            buffer of its own exact size so reading past the end shows
+//            up under ASan. The outcome must be the same as parsing the
+//            whole request at once, and a request that wasn't mangled
+//            must parse to what was generated.
+//
+// Syntax:    parser-fuzz [rounds [seed]]
+//
+//               rounds - requests to try, 100000 by default
+//               seed   - random seed, from the clock by default
+//
+//------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "http-parser.h"
+
+#define MAX_REQUEST 8192
+#define MAX_PIECES 16
+
+const char * methods[] = { "GET", "HEAD", "POST", "PUT", "OPTIONS", "M-SEARCH" };
+const char * segments[] = { "index.html", "cgi-bin", "mod", "a b", "%2e%2e",
+  ".", "..", "...", "", "x?y", "~user", "\xff\x01" };
+const char * versions[] = { "HTTP/1.1", "HTTP/1.0", "HTTP/2", "http/1.1" };
+const char * names[] = { "Host", "Connection", "Content-Length",
+  "Transfer-Encoding", "Accept-Encoding", "If-Modified-Since", "Range",
+  "X-A", "User-Agent" };
+const char * values[] = { "", "x", "keep-alive, close", "chunked", "7",
+  "gzip;q=0.5, deflate", "bytes=0-1,-5", " padded\t", "a:b:c" };
+
+// what the generator put into the request
+char path[1024];
+int hasQuery;
+int headerCount;
+const char * lineEnd;
+
+  int
+pick( int n )
+{
+  return rand() % n;
+}
+
+  int
+append( char * buf, int length, const char * s )
+{
+  int n = strlen( s );
+  if ( length + n > MAX_REQUEST ) {
+    n = MAX_REQUEST - length;
+  }
+  memcpy( buf + length, s, n );
+  return length + n;
+}
+
+// A request the parser must accept, maybe followed by more bytes. Its
+// own length goes to *request, the length with those bytes is returned.
+  int
+generate( char * buf, int * request )
+{
+  lineEnd = pick( 4 ) ? "\r\n" : "\n";
+  int length = 0;
+  for ( int i = pick( 8 ) == 0 ? pick( 3 ) : 0; i > 0; i-- ) {
+    length = append( buf, length, lineEnd );
+  }
+
+  length = append( buf, length, methods[pick( 6 )] );
+  length = append( buf, length, pick( 8 ) ? " " : " \t " );
+
+  // path segments, but no ".." as that one gets refused
+  path[0] = '\0';
+  hasQuery = 0;
+  int depth = 1 + pick( 5 );
+  for ( int i = 0; i < depth; i++ ) {
+    const char * s;
+    do {
+      s = segments[pick( 12 )];
+    } while ( !strcmp( s, ".." ) || strchr( s, ' ' ) != NULL ||
+	      ( hasQuery && strchr( s, '?' ) != NULL ) );
+    strcat( path, "/" );
+    strcat( path, s );
+    hasQuery |= strchr( s, '?' ) != NULL;
+  }
+  length = append( buf, length, path );
+  if ( hasQuery ) {
+    *strchr( path, '?' ) = '\0';
+  }
+
+  length = append( buf, length, " " );
+  length = append( buf, length, versions[pick( 4 )] );
+  length = append( buf, length, lineEnd );
+
+  headerCount = pick( MAX_HEADERS + 1 );
+  for ( int i = 0; i < headerCount; i++ ) {
+    length = append( buf, length, names[pick( 9 )] );
+    length = append( buf, length, pick( 2 ) ? ": " : ":" );
+    length = append( buf, length, values[pick( 9 )] );
+    length = append( buf, length, lineEnd );
+  }
+  length = append( buf, length, lineEnd );
+
+  // a body or the next pipelined request, which must be left alone
+  *request = length;
+  for ( int i = pick( 3 ) ? 0 : pick( 64 ); i > 0; i-- ) {
+    if ( length < MAX_REQUEST ) {
+      buf[length++] = pick( 2 ) ? "\r\n:? /"[pick( 6 )] : pick( 256 );
+    }
+  }
+  return length;
+}
+
+// Change a few bytes: overwrite, insert, delete or cut off the end
+  int
+mangle( char * buf, int length )
+{
+  for ( int i = 1 + pick( 4 ); i > 0 && length > 0; i-- ) {
+    int at = pick( length );
+    char ch = pick( 2 ) ? "\r\n: \t/?."[pick( 8 )] : pick( 256 );
+    switch ( pick( 4 ) ) {
+    case 0:
+      buf[at] = ch;
+      break;
+    case 1:
+      if ( length < MAX_REQUEST ) {
+	memmove( buf + at + 1, buf + at, length - at );
+	buf[at] = ch;
+	length++;
+      }
+      break;
+    case 2:
+      memmove( buf + at, buf + at + 1, length - at - 1 );
+      length--;
+      break;
+    default:
+      length = at;
+      break;
+    }
+  }
+  return length;
+}
+
+// the pieces fed to httpParse() one after the other
+char * pieces[MAX_PIECES];
+int pieceSizes[MAX_PIECES];
+int pieceCount;
+
+// Where a view of the split parse starts in the request, -1 if it
+// points into none of the pieces or runs past the end of its piece
+  int
+offsetInPieces( const StringView * v )
+{
+  for ( int i = 0; i < pieceCount; i++ ) {
+    if ( v->data >= pieces[i] && v->data + v->length <= pieces[i] + pieceSizes[i] ) {
+      return v->data - pieces[i];
+    }
+  }
+  return -1;
+}
+
+// Is v of the split parse the same part of the request as w of the
+// whole one?
+  int
+sameView( const StringView * v, const StringView * w, const char * buf )
+{
+  if ( v->data == NULL || w->data == NULL ) {
+    return v->data == w->data;
+  }
+  return v->length == w->length && offsetInPieces( v ) == w->data - buf;
+}
+
+  void
+fail( const char * why, const char * buf, int length )
+{
+  printf( "parser-fuzz: %s, request:\n", why );
+  fwrite( buf, 1, length, stdout );
+  printf( "\n" );
+  exit( 1 );
+}
+
+  int
+main( int argc, char ** argv )
+{
+  long rounds = argc > 1 ? atol( argv[1] ) : 100000;
+  unsigned int seed = argc > 2 ? strtoul( argv[2], NULL, 10 ) : time( NULL );
+  if ( rounds <= 0 ) {
+    printf( "Usage: parser-fuzz [rounds [seed]]\n" );
+    exit( 1 );
+  }
+  srand( seed );
+  printf( "parser-fuzz: %ld rounds, seed %u\n", rounds, seed );
+
+  static char buf[MAX_REQUEST];
+  long done = 0, errors = 0, again = 0;
+  for ( long round = 0; round < rounds; round++ ) {
+    int request;
+    int length = generate( buf, &request );
+    int mangled = pick( 2 );
+    if ( mangled ) {
+      length = mangle( buf, length );
+    }
+
+    // all at once
+    HttpRequest whole;
+    httpParserInit( &whole );
+    httpParse( &whole, buf, length );
+
+    // piece by piece, each call seeing a longer prefix in a new buffer
+    HttpRequest r;
+    httpParserInit( &r );
+    pieceCount = 0;
+    int have = 0;
+    while ( r.status == PARSE_AGAIN && have < length ) {
+      int n = pieceCount == MAX_PIECES - 1 ? length - have : 1 + pick( length - have );
+      have += n;
+      char * piece = (char *)malloc( have );
+      memcpy( piece, buf, have );
+      pieces[pieceCount] = piece;
+      pieceSizes[pieceCount++] = have;
+      httpParse( &r, piece, have );
+      if ( r.scanned > have || r.lineStart > r.scanned ) {
+	fail( "scanned past the end", buf, length );
+      }
+    }
+
+    if ( r.status != whole.status ) {
+      fail( "split and whole parses differ", buf, length );
+    }
+    if ( r.status == PARSE_DONE ) {
+      if ( r.length != whole.length || r.headerCount != whole.headerCount ||
+	   !sameView( &r.method, &whole.method, buf ) ||
+	   !sameView( &r.uri, &whole.uri, buf ) ||
+	   !sameView( &r.path, &whole.path, buf ) ||
+	   !sameView( &r.query, &whole.query, buf ) ||
+	   !sameView( &r.version, &whole.version, buf ) ) {
+	fail( "split and whole requests differ", buf, length );
+      }
+      for ( int i = 0; i < r.headerCount; i++ ) {
+	if ( !sameView( &r.headers[i].name, &whole.headers[i].name, buf ) ||
+	     !sameView( &r.headers[i].value, &whole.headers[i].value, buf ) ) {
+	  fail( "split and whole headers differ", buf, length );
+	}
+      }
+    }
+
+    if ( !mangled ) {
+      if ( whole.status != PARSE_DONE ) {
+	fail( "valid request not parsed", buf, length );
+      }
+      if ( whole.length != request || whole.headerCount != headerCount ||
+	   !viewEquals( &whole.path, path ) || ( whole.query.length >= 0 ) != hasQuery ) {
+	fail( "valid request parsed wrong", buf, length );
+      }
+    }
+
+    done += whole.status == PARSE_DONE;
+    errors += whole.status == PARSE_ERROR;
+    again += whole.status == PARSE_AGAIN;
+    for ( int i = 0; i < pieceCount; i++ ) {
+      free( pieces[i] );
+    }
+  }
+
+  printf( "parser-fuzz: %ld parsed, %ld refused, %ld incomplete\n",
+	  done, errors, again );
+  return 0;
+}
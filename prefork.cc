@@ -0,0 +1,270 @@
+//------------------------------------------------------------------------
+// Prefork mode used by myhttpd -w.
+//
+// The master binds the listening socket and forks the workers, which
+// inherit it. Each worker is a process of its own that runs the event
+// loop with one reactor, so workers take turns on the socket through
+// EPOLLEXCLUSIVE and serve many connections each. A crash takes down
+// only the connections of one worker, and the price of fork() is paid
+// once per worker rather than once per connection.
+//
+// The master serves nothing. It sits in sigtimedwait() and
+//  - restarts a worker that exited, waiting a second first if it died
+//    within a second of starting so a broken setup doesn't fork in a loop
+//  - on SIGHUP starts a new set of workers and sends SIGQUIT to the old
+//    ones, which stop accepting and exit once their connections are done
+//  - on SIGQUIT does the same without new workers and exits after them
+//  - on SIGTERM or SIGINT kills the workers and exits
+// A retired worker that takes longer than drainTimeout is killed.
+//
+// Workers set up their caches, content types and CGI helpers after the
+// fork, so a reload reads --mime-types again and starts with empty
+// caches. They die with the master through PR_SET_PDEATHSIG.
+//------------------------------------------------------------------------
+
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cgi-pool.h"
+#include "file-cache.h"
+#include "linger.h"
+#include "log.h"
+#include "metrics.h"
+#include "mime-types.h"
+#include "myhttpd.h"
+#include "prefork.h"
+
+PreforkConfig preforkConfig = { 0, 30 };
+
+namespace {
+
+// A live worker process
+struct Worker {
+  pid_t pid;
+  int index;       // position in the current set, -1 once retired
+  time_t started;
+  time_t deadline; // when a retired worker gets killed, 0 for never
+};
+
+}
+
+static Worker * children;
+static int childCount;
+static int childSize;
+
+// the current set: when each position gets a worker started, 0 while
+// it has one
+static time_t * restartAt;
+static int workers;
+
+static sigset_t masterSignals;
+
+static void drainHandler( int ) {
+  eventLoopDrain();
+}
+
+static void workerMain( int masterSocket, pid_t master ) {
+  prctl( PR_SET_PDEATHSIG, SIGTERM );
+  if ( getppid() != master ) {
+    exit( 0 );
+  }
+
+  // SIGHUP is for the master. SIGQUIT stays blocked except while the
+  // event loop waits, so it always interrupts that wait.
+  signal( SIGHUP, SIG_IGN );
+  struct sigaction action;
+  memset( &action, 0, sizeof(action) );
+  action.sa_handler = drainHandler;
+  sigaction( SIGQUIT, &action, NULL );
+  sigset_t signals;
+  sigemptyset( &signals );
+  sigaddset( &signals, SIGQUIT );
+  pthread_sigmask( SIG_SETMASK, &signals, NULL );
+
+  logRestart();
+  metricsChild();
+  cacheInit();
+  mimeInit();
+  cgiStart();
+
+  runEventLoop( masterSocket, 1 );
+  LOG( LOG_DEBUG, "worker %d done", (int)getpid() );
+  lingerFlush();
+  logFlush();
+  exit( 0 );
+}
+
+static void startWorker( int masterSocket, int index ) {
+  if ( childCount == childSize ) {
+    childSize = childSize > 0 ? 2 * childSize : 2 * workers;
+    children = (Worker *)realloc( children, childSize * sizeof(Worker) );
+    if ( children == NULL ) {
+      perror( "realloc" );
+      exit( -1 );
+    }
+  }
+
+  pid_t master = getpid();
+  pid_t pid = fork();
+  if ( pid == 0 ) {
+    workerMain( masterSocket, master );
+  }
+  if ( pid < 0 ) {
+    LOG( LOG_ERROR, "fork: %s", strerror(errno) );
+    restartAt[index] = time( NULL ) + 1;
+    return;
+  }
+
+  Worker * w = &children[childCount++];
+  w->pid = pid;
+  w->index = index;
+  w->started = time( NULL );
+  w->deadline = 0;
+  restartAt[index] = 0;
+  LOG( LOG_DEBUG, "started worker %d", (int)pid );
+}
+
+// Send the current set SIGQUIT, to finish up and exit
+static void retireWorkers() {
+  time_t now = time( NULL );
+  for ( int i = 0; i < childCount; i++ ) {
+    Worker * w = &children[i];
+    if ( w->index >= 0 ) {
+      restartAt[w->index] = now;
+      w->index = -1;
+      w->deadline = preforkConfig.drainTimeout > 0 ? now + preforkConfig.drainTimeout : 0;
+      kill( w->pid, SIGQUIT );
+    }
+  }
+}
+
+// Kill every worker, for good
+static void killWorkers() {
+  for ( int i = 0; i < childCount; i++ ) {
+    children[i].index = -1;
+    kill( children[i].pid, SIGTERM );
+  }
+}
+
+// Collect the workers that exited and note which positions of the
+// current set need a new one
+static void reapWorkers() {
+  pid_t pid;
+  int status;
+  while ( (pid = waitpid( -1, &status, WNOHANG )) > 0 ) {
+    metricsReclaim( pid );
+
+    int i;
+    for ( i = 0; i < childCount && children[i].pid != pid; i++ ) {
+    }
+    if ( i == childCount ) {
+      continue;
+    }
+    Worker w = children[i];
+    children[i] = children[--childCount];
+
+    if ( w.index < 0 ) {
+      LOG( LOG_INFO, "retired worker %d exited", (int)pid );
+      continue;
+    }
+    if ( WIFSIGNALED( status ) ) {
+      LOG( LOG_ERROR, "worker %d killed by signal %d, restarting", (int)pid,
+	  WTERMSIG( status ) );
+    } else {
+      LOG( LOG_ERROR, "worker %d exited with status %d, restarting", (int)pid,
+	  WEXITSTATUS( status ) );
+    }
+    time_t now = time( NULL );
+    restartAt[w.index] = now - w.started < 1 ? w.started + 1 : now;
+  }
+}
+
+// Kill retired workers that are past their deadline
+static void expireWorkers() {
+  time_t now = time( NULL );
+  for ( int i = 0; i < childCount; i++ ) {
+    Worker * w = &children[i];
+    if ( w->index < 0 && w->deadline > 0 && now >= w->deadline ) {
+      LOG( LOG_WARN, "retired worker %d still busy after %d s, killing it",
+	  (int)w->pid, preforkConfig.drainTimeout );
+      kill( w->pid, SIGKILL );
+      w->deadline = 0;
+    }
+  }
+}
+
+// Wait for the signals the master handles, up to a second
+static int nextSignal() {
+  struct timespec second = { 1, 0 };
+  int sig = sigtimedwait( &masterSignals, NULL, &second );
+  return sig < 0 ? 0 : sig;
+}
+
+// Run the master. Never returns.
+void runPrefork( int masterSocket ) {
+  workers = preforkConfig.workers;
+  if ( workers < 1 ) {
+    long cores = sysconf( _SC_NPROCESSORS_ONLN );
+    workers = cores < 1 ? 1 : (int)cores;
+  }
+  restartAt = (time_t *)malloc( workers * sizeof(time_t) );
+  if ( restartAt == NULL ) {
+    perror( "malloc" );
+    exit( -1 );
+  }
+  for ( int i = 0; i < workers; i++ ) {
+    restartAt[i] = time( NULL );
+  }
+
+  // the master takes its signals with sigtimedwait(); the workers set
+  // their own mask
+  sigemptyset( &masterSignals );
+  sigaddset( &masterSignals, SIGCHLD );
+  sigaddset( &masterSignals, SIGHUP );
+  sigaddset( &masterSignals, SIGQUIT );
+  sigaddset( &masterSignals, SIGTERM );
+  sigaddset( &masterSignals, SIGINT );
+  pthread_sigmask( SIG_BLOCK, &masterSignals, NULL );
+
+  LOG( LOG_INFO, "starting %d worker processes", workers );
+  int stopping = 0;
+  while ( !stopping || childCount > 0 ) {
+    time_t now = time( NULL );
+    for ( int i = 0; i < workers && !stopping; i++ ) {
+      if ( restartAt[i] != 0 && now >= restartAt[i] ) {
+	startWorker( masterSocket, i );
+      }
+    }
+    expireWorkers();
+
+    switch ( nextSignal() ) {
+    case SIGCHLD:
+      reapWorkers();
+      break;
+    case SIGHUP:
+      LOG( LOG_INFO, "reloading, replacing %d workers", workers );
+      retireWorkers();
+      break;
+    case SIGQUIT:
+      LOG( LOG_INFO, "stopping once the workers are done" );
+      retireWorkers();
+      stopping = 1;
+      break;
+    case SIGTERM:
+    case SIGINT:
+      LOG( LOG_INFO, "stopping" );
+      killWorkers();
+      stopping = 1;
+      break;
+    }
+  }
+  LOG( LOG_INFO, "all workers done" );
+  logFlush();
+  exit( 0 );
+}
@@ -0,0 +1,14 @@
+#ifndef PREFORK_H
+#define PREFORK_H
+
+// Tunables of the -w worker processes, see runPrefork()
+struct PreforkConfig {
+  int workers;      // worker processes, 0 for one per core
+  int drainTimeout; // seconds a retired worker may finish its connections, 0 for no limit
+};
+
+extern PreforkConfig preforkConfig;
+
+void runPrefork( int masterSocket );
+
+#endif
@@ -0,0 +1,208 @@
+//------------------------------------------------------------------------
+// Request bodies.
+//
+// A POST or PUT body is streamed to the CGI script rather than read in
+// whole: bytes received from the client go into a fixed buffer, are
+// decoded there (in place for chunked transfer encoding, where only the
+// chunk data is passed on), and the buffer is refilled as the script
+// takes them. A script that reads slowly thus holds up reading from the
+// client instead of the body piling up in the server.
+//------------------------------------------------------------------------
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "request-body.h"
+
+#define BODY_BUFFER ( 64 * 1024 )
+#define MAX_CHUNK_DIGITS 15
+
+// where chunked decoding is
+enum {
+  CHUNK_SIZE,     // expecting a chunk size line
+  CHUNK_DATA,     // passing on chunk data
+  CHUNK_DATA_END, // expecting the CRLF after the data
+  CHUNK_TRAILER,  // skipping trailer fields up to the empty line
+  CHUNK_DONE
+};
+
+// Set up for a body of length bytes, or a chunked one if length is -1,
+// the first bufferedLength bytes of which arrived with the header.
+// Returns -1 if there is no memory for it.
+int bodyStart( RequestBody * b, long long length, long long limit,
+    const char * buffered, int bufferedLength ) {
+  b->size = bufferedLength > BODY_BUFFER ? bufferedLength : BODY_BUFFER;
+  b->buffer = (char *)malloc( b->size );
+  if ( b->buffer == NULL ) {
+    return -1;
+  }
+  memcpy( b->buffer, buffered, bufferedLength );
+  b->start = 0;
+  b->end = bufferedLength;
+  b->chunked = length < 0;
+  b->state = CHUNK_SIZE;
+  b->remaining = length < 0 ? 0 : length;
+  b->total = 0;
+  b->limit = limit;
+  return 0;
+}
+
+// The next line in the buffer without its line end, or NULL if it is not
+// all there yet
+static char * nextLine( RequestBody * b, int * length ) {
+  char * line = b->buffer + b->start;
+  char * newline = (char *)memchr( line, '\n', b->end - b->start );
+  if ( newline == NULL ) {
+    return NULL;
+  }
+  b->start += newline + 1 - line;
+  *length = newline - line;
+  if ( *length > 0 && line[*length - 1] == '\r' ) {
+    (*length)--;
+  }
+  return line;
+}
+
+// Size of a chunk from its size line, -1 if it isn't one
+static long long chunkSize( const char * line, int length ) {
+  long long size = 0;
+  int digits = 0;
+  for ( ; digits < length; digits++ ) {
+    char ch = line[digits];
+    int value;
+    if ( ch >= '0' && ch <= '9' ) {
+      value = ch - '0';
+    } else if ( ch >= 'a' && ch <= 'f' ) {
+      value = ch - 'a' + 10;
+    } else if ( ch >= 'A' && ch <= 'F' ) {
+      value = ch - 'A' + 10;
+    } else {
+      break;
+    }
+    if ( digits == MAX_CHUNK_DIGITS ) {
+      return -1;
+    }
+    size = size * 16 + value;
+  }
+  // chunk extensions after a ';' are ignored
+  if ( digits == 0 || ( digits < length && line[digits] != ';' &&
+			line[digits] != ' ' && line[digits] != '\t' ) ) {
+    return -1;
+  }
+  return size;
+}
+
+// Decode what is buffered. On BODY_DATA, data and length give body bytes
+// to pass on; bodyConsumed() says how many of them were.
+int bodyNext( RequestBody * b, char ** data, int * length ) {
+  while ( 1 ) {
+    int available = b->end - b->start;
+
+    if ( !b->chunked || b->state == CHUNK_DATA ) {
+      if ( b->remaining == 0 ) {
+	if ( !b->chunked ) {
+	  return BODY_END;
+	}
+	b->state = CHUNK_DATA_END;
+	continue;
+      }
+      if ( available == 0 ) {
+	return BODY_MORE;
+      }
+      *data = b->buffer + b->start;
+      *length = available < b->remaining ? available : (int)b->remaining;
+      return BODY_DATA;
+    }
+
+    if ( b->state == CHUNK_DONE ) {
+      return BODY_END;
+    }
+
+    int lineLength;
+    char * line = nextLine( b, &lineLength );
+    if ( line == NULL ) {
+      // a line longer than the whole buffer is no chunk size line
+      return available == b->size ? BODY_ERROR : BODY_MORE;
+    }
+
+    switch ( b->state ) {
+    case CHUNK_SIZE:
+      b->remaining = chunkSize( line, lineLength );
+      if ( b->remaining < 0 ) {
+	return BODY_ERROR;
+      }
+      b->total += b->remaining;
+      if ( b->limit > 0 && b->total > b->limit ) {
+	return BODY_TOO_LARGE;
+      }
+      b->state = b->remaining > 0 ? CHUNK_DATA : CHUNK_TRAILER;
+      break;
+    case CHUNK_DATA_END:
+      if ( lineLength != 0 ) {
+	return BODY_ERROR;
+      }
+      b->state = CHUNK_SIZE;
+      break;
+    case CHUNK_TRAILER:
+      if ( lineLength == 0 ) {
+	b->state = CHUNK_DONE;
+      }
+      break;
+    }
+  }
+}
+
+void bodyConsumed( RequestBody * b, int n ) {
+  b->start += n;
+  b->remaining -= n;
+}
+
+// Room at the end of the buffer for more bytes from the client
+char * bodySpace( RequestBody * b, int * space ) {
+  if ( b->start == b->end ) {
+    b->start = b->end = 0;
+  } else if ( b->start > 0 && b->end == b->size ) {
+    memmove( b->buffer, b->buffer + b->start, b->end - b->start );
+    b->end -= b->start;
+    b->start = 0;
+  }
+  *space = b->size - b->end;
+  return b->buffer + b->end;
+}
+
+// Make room for n more bytes that have already been received, growing
+// the buffer if it has to. Returns -1 if there is no memory for them.
+int bodyReserve( RequestBody * b, int n ) {
+  int space;
+  bodySpace( b, &space );
+  if ( space < n ) {
+    if ( b->start > 0 ) {
+      memmove( b->buffer, b->buffer + b->start, b->end - b->start );
+      b->end -= b->start;
+      b->start = 0;
+    }
+    char * buffer = (char *)realloc( b->buffer, b->end + n );
+    if ( buffer == NULL ) {
+      return -1;
+    }
+    b->buffer = buffer;
+    b->size = b->end + n;
+  }
+  return 0;
+}
+
+void bodyReceived( RequestBody * b, int n ) {
+  b->end += n;
+}
+
+// Bytes received past the end of the body once bodyNext() returned
+// BODY_END, the start of whatever the client pipelined behind it
+int bodyExcess( RequestBody * b, char ** data ) {
+  *data = b->buffer + b->start;
+  return b->end - b->start;
+}
+
+void bodyFree( RequestBody * b ) {
+  free( b->buffer );
+  b->buffer = NULL;
+}
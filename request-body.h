@@ -0,0 +1,38 @@
+#ifndef REQUEST_BODY_H
+#define REQUEST_BODY_H
+
+// result of bodyNext()
+enum {
+  BODY_DATA,      // there is decoded body to pass on
+  BODY_MORE,      // need more bytes from the client
+  BODY_END,       // all of it has been passed on
+  BODY_ERROR,     // not valid chunked encoding
+  BODY_TOO_LARGE  // the chunks add up to more than the limit
+};
+
+// A request body on its way from the client to wherever it goes,
+// decoded from chunked transfer encoding if need be. Only as much of it
+// as the buffer holds is ever in memory.
+struct RequestBody {
+  char * buffer;        // NULL when there is no body
+  int size;
+  int start;            // bytes from start to end are still to be decoded
+  int end;
+  int chunked;
+  int state;            // where chunked decoding is
+  long long remaining;  // of the body, or of the current chunk
+  long long total;      // chunk sizes seen so far
+  long long limit;
+};
+
+int bodyStart( RequestBody * b, long long length, long long limit,
+    const char * buffered, int bufferedLength );
+int bodyNext( RequestBody * b, char ** data, int * length );
+void bodyConsumed( RequestBody * b, int n );
+char * bodySpace( RequestBody * b, int * space );
+int bodyReserve( RequestBody * b, int n );
+void bodyReceived( RequestBody * b, int n );
+int bodyExcess( RequestBody * b, char ** data );
+void bodyFree( RequestBody * b );
+
+#endif
@@ -0,0 +1,620 @@
+//------------------------------------------------------------------------
+// Work-stealing scheduler used by myhttpd -s.
+//
+// With -p a thread takes a connection and serves it to the end, so one
+// waiting on a slow CGI script is lost to everybody queued behind it.
+// Here connection I/O and the requests themselves are tasks that any
+// thread may run, one short step at a time, and whatever may block for
+// long goes to a pool of its own.
+//
+// Every connection is in one shared epoll set with EPOLLONESHOT, so at
+// any time it belongs to nobody but the thread that got its event, and
+// it goes back to the kernel with EPOLL_CTL_MOD when that thread is
+// done with it. A worker pushes the connections that became ready onto
+// its own Chase-Lev deque. Reading one that has a whole request pushes
+// the request as a task of its own, and a worker that runs out takes
+// tasks from the top of another's deque before it waits on epoll. An
+// eventfd in the set wakes a waiting worker when there is more work
+// than its owner is about to get to.
+//
+// A request for a CGI script or a module, or for a file the cache
+// doesn't have, goes to a pool of blocking threads instead. Those serve
+// a script over the blocking socket and hand the connection back to the
+// workers once the response is out; for a file they only open it, and
+// a worker sends it. Scripts and files wait in bounded queues of their
+// own, a full one means a 503.
+//
+// Keep-alive timeouts are checked about once a second, by whichever
+// worker comes by first. An expired connection is shut down rather than
+// closed, and the worker that gets the resulting event closes it.
+//
+// Out of file descriptors, the listening socket is left out of the
+// epoll set for ACCEPT_RETRY_MS instead of reporting the same queued
+// connections over and over.
+//------------------------------------------------------------------------
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "admission.h"
+#include "log.h"
+#include "metrics.h"
+#include "myhttpd.h"
+#include "scheduler.h"
+#include "work-deque.h"
+
+#define MAX_EVENTS 64
+#define DEQUE_SIZE 4096
+#define ACCEPT_RETRY_MS 100
+
+SchedulerConfig schedulerConfig = { 0, 0, 1024 };
+
+namespace {
+
+// A connection along with the step it is due for. Connection comes
+// first so the list of open connections can hold either.
+struct Task {
+  Connection c;
+  int registered; // in the epoll set
+  int parsed;     // a whole request is waiting to be served
+  int blocking;   // with a blocking thread, which may take a while
+  int waits;      // what the blocking thread waits for, BLOCKS_ON_*
+};
+
+// per worker thread, padded so workers don't share cache lines
+struct Worker {
+  WorkDeque tasks;
+  unsigned int seed; // picks whom to steal from
+} __attribute__((aligned(64)));
+
+}
+
+static Worker * workers;
+static int workerCount;
+static int epfd;
+static int listenSocket;
+static long long acceptRetry; // when to listen again, 0 if listening
+static int outOfFiles;        // accept() last failed for want of descriptors
+static long long stolen;
+
+// waking up a worker that waits on epoll; the data pointer of the
+// eventfd's event is &wakeFd, the listening socket's is NULL
+static int wakeFd;
+static int sleepers; // workers in epoll_wait()
+static int woken;    // the eventfd has been written and not yet read
+
+// every open connection, for the keep-alive timeout
+static pthread_mutex_t openMutex = PTHREAD_MUTEX_INITIALIZER;
+static IdleList openList;
+static time_t nextSweep;
+
+// requests waiting for a blocking thread, one queue per BLOCKS_ON_*
+struct BlockingQueue {
+  Task ** tasks;
+  int head;
+  int count;
+};
+
+// the blocking threads. Files go first, and scripts never get all of
+// the threads, so a file doesn't wait for scripts to finish.
+static pthread_mutex_t blockingMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t blockingReady = PTHREAD_COND_INITIALIZER;
+static BlockingQueue files;
+static BlockingQueue scripts;
+static int blockingThreads;
+static int scriptThreads; // most threads running scripts at once
+static int busy;
+static int scriptsRunning;
+static long long refused;
+
+static time_t now() {
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec;
+}
+
+static long long nowMs() {
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static void setBlocking( int fd, int blocking ) {
+  int flags = fcntl( fd, F_GETFL );
+  if ( flags >= 0 ) {
+    fcntl( fd, F_SETFL, blocking ? flags & ~O_NONBLOCK : flags | O_NONBLOCK );
+  }
+}
+
+// Wake a waiting worker to steal, unless one is on its way already
+static void wake() {
+  if ( __atomic_load_n( &sleepers, __ATOMIC_SEQ_CST ) > 0 &&
+       !__atomic_exchange_n( &woken, 1, __ATOMIC_ACQ_REL ) ) {
+    uint64_t one = 1;
+    if ( write( wakeFd, &one, sizeof(one) ) < 0 ) {
+      __atomic_store_n( &woken, 0, __ATOMIC_RELEASE );
+    }
+  }
+}
+
+static void closeTask( Task * t ) {
+  pthread_mutex_lock( &openMutex );
+  idleRemove( &openList, &t->c );
+  pthread_mutex_unlock( &openMutex );
+  // a CGI child may still hold a copy of the socket
+  if ( t->registered ) {
+    epoll_ctl( epfd, EPOLL_CTL_DEL, t->c.socket, NULL );
+  }
+  connectionClose( &t->c );
+  free( t );
+}
+
+// Give the connection back to the kernel until it is ready for events.
+// From here on another worker may have it.
+static void arm( Task * t, uint32_t events ) {
+  struct epoll_event event;
+  event.events = events | EPOLLRDHUP | EPOLLONESHOT;
+  event.data.ptr = t;
+  int op = t->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+  t->registered = 1;
+  if ( epoll_ctl( epfd, op, t->c.socket, &event ) < 0 ) {
+    LOG( LOG_ERROR, "epoll_ctl: %s", strerror(errno) );
+    closeTask( t );
+  }
+}
+
+static void advance( Worker * w, Task * t );
+
+// Queue a task on the worker's deque, or run it right away if full
+static void schedule( Worker * w, Task * t ) {
+  if ( dequePush( &w->tasks, t ) < 0 ) {
+    advance( w, t );
+  }
+}
+
+// Hand a request to the blocking threads. Returns -1 if their queue
+// is full.
+static int offload( Task * t, int waits ) {
+  BlockingQueue * q = waits == BLOCKS_ON_DISK ? &files : &scripts;
+  pthread_mutex_lock( &blockingMutex );
+  if ( q->count == schedulerConfig.blockingQueue ) {
+    refused++;
+    pthread_mutex_unlock( &blockingMutex );
+    return -1;
+  }
+  t->waits = waits;
+  __atomic_store_n( &t->blocking, 1, __ATOMIC_RELAXED );
+  q->tasks[(q->head + q->count++) % schedulerConfig.blockingQueue] = t;
+  pthread_cond_signal( &blockingReady );
+  pthread_mutex_unlock( &blockingMutex );
+  return 0;
+}
+
+// Run the connection as far as it goes without blocking. Reading a
+// whole request ends the step, the request is served as the next one.
+static void advance( Worker * w, Task * t ) {
+  Connection * c = &t->c;
+  int result;
+
+  __atomic_store_n( &c->lastActive, now(), __ATOMIC_RELAXED );
+
+  while ( 1 ) {
+    if ( c->state == CONN_READING ) {
+      if ( !t->parsed ) {
+	result = connectionRead( c );
+	if ( result == IO_AGAIN ) {
+	  arm( t, EPOLLIN );
+	  return;
+	}
+	if ( result == IO_CLOSE ) {
+	  closeTask( t );
+	  return;
+	}
+	// an idle worker may take the request off our hands
+	t->parsed = 1;
+	schedule( w, t );
+	if ( dequeSize( &w->tasks ) > 1 ) {
+	  wake();
+	}
+	return;
+      }
+
+      t->parsed = 0;
+      int waits = connectionBlocking( c );
+      if ( waits != BLOCKS_NEVER && offload( t, waits ) == 0 ) {
+	return;
+      }
+      if ( waits != BLOCKS_NEVER ) {
+	LOG( LOG_DEBUG, "blocking queue full, rejecting" );
+	connectionUnavailable( c );
+      } else if ( connectionRespond( c ) == IO_CLOSE ) {
+	closeTask( t );
+	return;
+      }
+      c->state = CONN_WRITING;
+    }
+
+    result = connectionWrite( c );
+    if ( result == IO_AGAIN ) {
+      arm( t, EPOLLOUT );
+      return;
+    }
+    if ( result == IO_CLOSE || connectionNext( c ) == IO_CLOSE ) {
+      closeTask( t );
+      return;
+    }
+  }
+}
+
+// Serve a request that may block. A script or module gets the whole
+// exchange done here with the socket blocking, as in the blocking
+// modes; a file only gets opened, and a worker sends it.
+static void serveBlocking( Task * t ) {
+  Connection * c = &t->c;
+  int result;
+
+  if ( t->waits == BLOCKS_ON_DISK ) {
+    if ( connectionRespond( c ) == IO_CLOSE ) {
+      closeTask( t );
+      return;
+    }
+    // start reading the file in while the task waits for a worker
+    if ( c->fd != -1 ) {
+      posix_fadvise( c->fd, c->fileOffset, c->fileRemaining, POSIX_FADV_WILLNEED );
+    }
+    c->state = CONN_WRITING;
+    __atomic_store_n( &c->lastActive, now(), __ATOMIC_RELAXED );
+    __atomic_store_n( &t->blocking, 0, __ATOMIC_RELAXED );
+    arm( t, EPOLLOUT );
+    return;
+  }
+
+  setBlocking( c->socket, 1 );
+  if ( KeepAliveTimeout > 0 ) {
+    struct timeval timeout;
+    timeout.tv_sec = KeepAliveTimeout;
+    timeout.tv_usec = 0;
+    setsockopt( c->socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout) );
+    setsockopt( c->socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout) );
+  }
+
+  result = connectionRespond( c );
+  if ( result == IO_DONE ) {
+    result = connectionWriteBlocking( c );
+  }
+  if ( result != IO_DONE || connectionNext( c ) == IO_CLOSE ) {
+    closeTask( t );
+    return;
+  }
+
+  // a pipelined request is already buffered, and a writable socket
+  // gets it to a worker at once
+  setBlocking( c->socket, 0 );
+  __atomic_store_n( &c->lastActive, now(), __ATOMIC_RELAXED );
+  __atomic_store_n( &t->blocking, 0, __ATOMIC_RELAXED );
+  arm( t, c->received > 0 ? EPOLLOUT : EPOLLIN );
+}
+
+static void * blockingMain( void * ) {
+  while ( 1 ) {
+    pthread_mutex_lock( &blockingMutex );
+    while ( files.count == 0 &&
+	    ( scripts.count == 0 || scriptsRunning == scriptThreads ) ) {
+      pthread_cond_wait( &blockingReady, &blockingMutex );
+    }
+    BlockingQueue * q = files.count > 0 ? &files : &scripts;
+    Task * t = q->tasks[q->head];
+    q->head = (q->head + 1) % schedulerConfig.blockingQueue;
+    q->count--;
+    busy++;
+    if ( q == &scripts ) {
+      scriptsRunning++;
+    }
+    pthread_mutex_unlock( &blockingMutex );
+
+    serveBlocking( t );
+
+    // this thread is the one to take the next script, if any waits
+    pthread_mutex_lock( &blockingMutex );
+    busy--;
+    if ( q == &scripts ) {
+      scriptsRunning--;
+    }
+    pthread_mutex_unlock( &blockingMutex );
+  }
+  return NULL;
+}
+
+// Have the next connection reported to one worker. Only one at a time
+// accepts.
+static void armListener() {
+  struct epoll_event event;
+  event.events = EPOLLIN | EPOLLONESHOT;
+  event.data.ptr = NULL;
+  if ( epoll_ctl( epfd, EPOLL_CTL_MOD, listenSocket, &event ) < 0 ) {
+    perror( "epoll_ctl" );
+    exit( -1 );
+  }
+}
+
+static void acceptConnections( Worker * w ) {
+  // a batch at a time, the rest wake up another worker
+  for ( int i = 0; i < MAX_EVENTS; i++ ) {
+    int clientSocket = accept4( listenSocket, NULL, NULL,
+	SOCK_NONBLOCK | SOCK_CLOEXEC );
+
+    if ( clientSocket < 0 ) {
+      if ( errno == EINTR || errno == ECONNABORTED ) {
+	continue;
+      }
+      if ( errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM ) {
+	// retryAccept() puts the listening socket back
+	if ( !outOfFiles ) {
+	  LOG( LOG_WARN, "accept: %s, waiting for connections to close",
+	      strerror(errno) );
+	  outOfFiles = 1;
+	}
+	__atomic_store_n( &acceptRetry, nowMs() + ACCEPT_RETRY_MS, __ATOMIC_RELEASE );
+	return;
+      }
+      if ( errno != EAGAIN && errno != EWOULDBLOCK ) {
+	LOG( LOG_ERROR, "accept: %s", strerror(errno) );
+      }
+      break;
+    }
+    outOfFiles = 0;
+    metricsAccepted( clientSocket );
+    if ( !admissionEnter( clientSocket ) ) {
+      continue;
+    }
+
+    Task * t = (Task *)malloc( sizeof(Task) );
+    if ( t == NULL ) {
+      admissionLeave();
+      admissionReject( clientSocket );
+      continue;
+    }
+    connectionInit( &t->c, clientSocket );
+    t->registered = 0;
+    t->parsed = 0;
+    t->blocking = 0;
+    t->waits = BLOCKS_NEVER;
+    pthread_mutex_lock( &openMutex );
+    idleAppend( &openList, &t->c );
+    pthread_mutex_unlock( &openMutex );
+
+    // the request is likely there already, so try reading before
+    // waiting for it
+    schedule( w, t );
+  }
+  armListener();
+}
+
+// Put the listening socket back into the epoll set once it is time to
+// try accept() again
+static void retryAccept() {
+  long long due = __atomic_load_n( &acceptRetry, __ATOMIC_ACQUIRE );
+  if ( due == 0 || nowMs() < due ||
+       !__atomic_compare_exchange_n( &acceptRetry, &due, 0, 0,
+	 __ATOMIC_RELAXED, __ATOMIC_RELAXED ) ) {
+    return;
+  }
+  armListener();
+}
+
+// Shut down connections that saw no activity for the keep-alive
+// timeout, at most once a second. One with a blocking thread is left
+// to the script's timeout.
+static void sweep() {
+  time_t t = now();
+  time_t due = __atomic_load_n( &nextSweep, __ATOMIC_RELAXED );
+  if ( t < due || !__atomic_compare_exchange_n( &nextSweep, &due, t + 1, 0,
+	 __ATOMIC_RELAXED, __ATOMIC_RELAXED ) ) {
+    return;
+  }
+
+  // without keep-alive a connection still may not sit idle forever
+  int limit = KeepAliveTimeout > 0 ? KeepAliveTimeout : 60;
+  pthread_mutex_lock( &openMutex );
+  for ( Connection * c = openList.head; c != NULL; c = c->next ) {
+    Task * task = (Task *)c;
+    if ( !__atomic_load_n( &task->blocking, __ATOMIC_RELAXED ) &&
+	 t - __atomic_load_n( &c->lastActive, __ATOMIC_RELAXED ) >= limit ) {
+      shutdown( c->socket, SHUT_RDWR );
+    }
+  }
+  pthread_mutex_unlock( &openMutex );
+}
+
+// Take the oldest task of another worker, starting from a random one
+static Task * steal( Worker * w ) {
+  int start = rand_r( &w->seed ) % workerCount;
+  for ( int i = 0; i < workerCount; i++ ) {
+    Worker * victim = &workers[(start + i) % workerCount];
+    if ( victim == w ) {
+      continue;
+    }
+    Task * t = (Task *)dequeSteal( &victim->tasks );
+    if ( t != NULL ) {
+      __atomic_add_fetch( &stolen, 1, __ATOMIC_RELAXED );
+      // there is more where that came from
+      if ( dequeSize( &victim->tasks ) > 0 ) {
+	wake();
+      }
+      return t;
+    }
+  }
+  return NULL;
+}
+
+// Wait for events and queue the connections they are for. The listening
+// socket gets its connections queued too.
+static void waitForWork( Worker * w ) {
+  struct epoll_event events[MAX_EVENTS];
+
+  // whoever pushes work after this sees us waiting and wakes somebody;
+  // what was pushed before is checked for once more
+  __atomic_add_fetch( &sleepers, 1, __ATOMIC_SEQ_CST );
+  Task * t = workerCount > 1 ? steal( w ) : NULL;
+  int n = 0;
+  if ( t == NULL ) {
+    int timeout = __atomic_load_n( &acceptRetry, __ATOMIC_RELAXED ) ? ACCEPT_RETRY_MS : 1000;
+    n = epoll_wait( epfd, events, MAX_EVENTS, timeout );
+  }
+  __atomic_sub_fetch( &sleepers, 1, __ATOMIC_SEQ_CST );
+
+  if ( t != NULL ) {
+    schedule( w, t );
+    return;
+  }
+  if ( n < 0 && errno != EINTR ) {
+    perror( "epoll_wait" );
+    exit( -1 );
+  }
+
+  for ( int i = 0; i < n; i++ ) {
+    void * ptr = events[i].data.ptr;
+    if ( ptr == NULL ) {
+      acceptConnections( w );
+    } else if ( ptr == &wakeFd ) {
+      uint64_t value;
+      if ( read( wakeFd, &value, sizeof(value) ) < 0 && errno != EAGAIN ) {
+	LOG( LOG_WARN, "eventfd: %s", strerror(errno) );
+      }
+      __atomic_store_n( &woken, 0, __ATOMIC_RELEASE );
+      struct epoll_event event;
+      event.events = EPOLLIN | EPOLLONESHOT;
+      event.data.ptr = &wakeFd;
+      epoll_ctl( epfd, EPOLL_CTL_MOD, wakeFd, &event );
+    } else {
+      schedule( w, (Task *)ptr );
+    }
+  }
+  if ( dequeSize( &w->tasks ) > 1 ) {
+    wake();
+  }
+}
+
+static void * workerMain( void * arg ) {
+  Worker * w = (Worker *)arg;
+  while ( 1 ) {
+    sweep();
+    retryAccept();
+    Task * t = (Task *)dequePop( &w->tasks );
+    if ( t == NULL && workerCount > 1 ) {
+      t = steal( w );
+    }
+    if ( t != NULL ) {
+      advance( w, t );
+    } else {
+      waitForWork( w );
+    }
+  }
+  return NULL;
+}
+
+static void startThread( void * (*main)( void * ), void * arg ) {
+  pthread_t thread;
+  pthread_attr_t attr;
+  pthread_attr_init( &attr );
+  pthread_attr_setdetachstate( &attr, PTHREAD_CREATE_DETACHED );
+  if ( pthread_create( &thread, &attr, main, arg ) != 0 ) {
+    perror( "pthread_create" );
+    exit( -1 );
+  }
+  pthread_attr_destroy( &attr );
+}
+
+// Serve connections with the worker and blocking threads, the calling
+// thread being the first worker. Never returns.
+void runScheduler( int masterSocket ) {
+  long cores = sysconf( _SC_NPROCESSORS_ONLN );
+  if ( cores < 1 ) {
+    cores = 1;
+  }
+  workerCount = schedulerConfig.workers > 0 ? schedulerConfig.workers : (int)cores;
+  blockingThreads = schedulerConfig.blockingThreads > 0 ?
+    schedulerConfig.blockingThreads : 4 * (int)cores;
+  if ( schedulerConfig.blockingQueue < 1 ) {
+    schedulerConfig.blockingQueue = 1;
+  }
+  // a quarter of the threads are kept for files
+  scriptThreads = blockingThreads - ( blockingThreads / 4 > 0 ? blockingThreads / 4 : 1 );
+  if ( scriptThreads < 1 ) {
+    scriptThreads = 1;
+  }
+
+  listenSocket = masterSocket;
+  setBlocking( listenSocket, 0 );
+  epfd = epoll_create1( EPOLL_CLOEXEC );
+  wakeFd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+  workers = (Worker *)aligned_alloc( 64, workerCount * sizeof(Worker) );
+  files.tasks = (Task **)malloc( schedulerConfig.blockingQueue * sizeof(Task *) );
+  scripts.tasks = (Task **)malloc( schedulerConfig.blockingQueue * sizeof(Task *) );
+  if ( epfd < 0 || wakeFd < 0 || workers == NULL || files.tasks == NULL ||
+       scripts.tasks == NULL ) {
+    perror( "runScheduler" );
+    exit( -1 );
+  }
+
+  struct epoll_event event;
+  event.events = EPOLLIN | EPOLLONESHOT;
+  event.data.ptr = NULL;
+  if ( epoll_ctl( epfd, EPOLL_CTL_ADD, listenSocket, &event ) < 0 ) {
+    perror( "epoll_ctl" );
+    exit( -1 );
+  }
+  event.data.ptr = &wakeFd;
+  if ( epoll_ctl( epfd, EPOLL_CTL_ADD, wakeFd, &event ) < 0 ) {
+    perror( "epoll_ctl" );
+    exit( -1 );
+  }
+
+  for ( int i = 0; i < workerCount; i++ ) {
+    if ( dequeInit( &workers[i].tasks, DEQUE_SIZE ) < 0 ) {
+      perror( "malloc" );
+      exit( -1 );
+    }
+    workers[i].seed = i + 1;
+  }
+
+  LOG( LOG_INFO, "starting %d worker and %d blocking threads", workerCount,
+      blockingThreads );
+  for ( int i = 0; i < blockingThreads; i++ ) {
+    startThread( blockingMain, NULL );
+  }
+  for ( int i = 1; i < workerCount; i++ ) {
+    startThread( workerMain, &workers[i] );
+  }
+  workerMain( &workers[0] );
+}
+
+// Blocking threads, how many are serving a request, the requests
+// waiting for them and the room for those, tasks stolen and requests
+// refused for want of room. Returns -1 unless running.
+int schedulerCounts( int * threads, int * working, int * waiting, int * size,
+    long long * steals, long long * full ) {
+  if ( scripts.tasks == NULL ) {
+    return -1;
+  }
+  pthread_mutex_lock( &blockingMutex );
+  *threads = blockingThreads;
+  *working = busy;
+  *waiting = files.count + scripts.count;
+  *size = schedulerConfig.blockingQueue;
+  *full = refused;
+  pthread_mutex_unlock( &blockingMutex );
+  *steals = __atomic_load_n( &stolen, __ATOMIC_RELAXED );
+  return 0;
+}
@@ -0,0 +1,17 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+// Tunables of the -s scheduler, see runScheduler()
+struct SchedulerConfig {
+  int workers;         // threads running requests, 0 for one per core
+  int blockingThreads; // threads for scripts and uncached files, 0 for 4 per core
+  int blockingQueue;   // scripts, and files, waiting for one, more get a 503
+};
+
+extern SchedulerConfig schedulerConfig;
+
+void runScheduler( int masterSocket );
+int schedulerCounts( int * threads, int * busy, int * waiting, int * size,
+    long long * stolen, long long * refused );
+
+#endif
@@ -0,0 +1,301 @@
+//------------------------------------------------------------------------
+// Worker pool used by myhttpd -p.
+//
+// The accept loop hands every connection to poolSubmit(), which puts it
+// on a bounded queue. Workers take connections off the queue and run the
+// handler on them. The pool starts with minThreads workers, adds one
+// whenever the queue holds more connections than there are idle workers
+// (or most workers are busy), and lets workers above minThreads retire
+// after idleTimeout seconds without work while less than half the pool
+// is busy.
+//
+// Each worker slot keeps its own counters; kill -USR1 prints them so an
+// uneven spread of work across the pool is easy to spot.
+//------------------------------------------------------------------------
+
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "thread-pool.h"
+
+PoolConfig poolConfig;
+
+// Private to the pool, kept out of the global namespace
+namespace {
+
+// per worker slot, padded so busy workers don't share cache lines
+struct Worker {
+  pthread_t thread;
+  int running;        // slot holds a live thread
+  int busy;           // serving a connection right now
+  int cpu;            // cpu the slot is pinned to, -1 if not pinned
+  long served;        // connections handled
+  long long busyNs;   // time spent serving
+  long long idleNs;   // time spent waiting for work
+} __attribute__((aligned(64)));
+
+struct QueueEntry {
+  int socket;
+  long long queued;   // when the connection was accepted
+};
+
+}
+
+static Worker * workers;
+static QueueEntry * queue;
+static int head;
+static int count;
+
+static int threads;   // live workers
+static int busy;      // workers serving a connection
+static long dispatched;
+static long long waitNs;
+static long long startNs;
+
+static void * (*poolHandler)( int socket );
+
+static pthread_mutex_t poolMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t notEmpty = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t notFull = PTHREAD_COND_INITIALIZER;
+
+static long long nowNs() {
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int cores() {
+  long n = sysconf( _SC_NPROCESSORS_ONLN );
+  return n < 1 ? 1 : (int)n;
+}
+
+// Defaults are sized from the number of cores: one worker per core is
+// always there, up to four per core for when workers block on disk or CGI
+void poolSetDefaults() {
+  poolConfig.minThreads = cores();
+  poolConfig.maxThreads = 4 * cores();
+  poolConfig.queueSize = 1024;
+  poolConfig.idleTimeout = 30;
+  poolConfig.pin = 0;
+}
+
+// Set attr up to run on cpu index % cores when pinning is enabled.
+// Returns the cpu, or -1 if the thread is not pinned.
+int pinThread( pthread_attr_t * attr, int index ) {
+  if ( !poolConfig.pin ) {
+    return -1;
+  }
+
+  cpu_set_t cpus;
+  CPU_ZERO( &cpus );
+  int cpu = index % cores();
+  CPU_SET( cpu, &cpus );
+  if ( pthread_attr_setaffinity_np( attr, sizeof(cpus), &cpus ) != 0 ) {
+    perror( "pthread_attr_setaffinity_np" );
+    return -1;
+  }
+  return cpu;
+}
+
+static void * workerMain( void * arg );
+
+// Start a worker in a free slot. Called with poolMutex held.
+static void startWorker() {
+  int i;
+  for ( i = 0; i < poolConfig.maxThreads; i++ ) {
+    if ( !workers[i].running ) {
+      break;
+    }
+  }
+  if ( i == poolConfig.maxThreads ) {
+    return;
+  }
+
+  Worker * w = &workers[i];
+  pthread_attr_t attr;
+  pthread_attr_init( &attr );
+  pthread_attr_setscope( &attr, PTHREAD_SCOPE_SYSTEM );
+  pthread_attr_setdetachstate( &attr, PTHREAD_CREATE_DETACHED );
+  w->cpu = pinThread( &attr, i );
+
+  w->running = 1;
+  w->busy = 0;
+  if ( pthread_create( &w->thread, &attr, workerMain, w ) != 0 ) {
+    perror( "pthread_create" );
+    w->running = 0;
+  } else {
+    threads++;
+  }
+  pthread_attr_destroy( &attr );
+}
+
+static void * workerMain( void * arg ) {
+  Worker * w = (Worker *)arg;
+  long long idleStart = nowNs();
+
+  pthread_mutex_lock( &poolMutex );
+  while ( 1 ) {
+    while ( count == 0 ) {
+      struct timespec deadline;
+      clock_gettime( CLOCK_REALTIME, &deadline );
+      deadline.tv_sec += poolConfig.idleTimeout;
+
+      int rc = pthread_cond_timedwait( &notEmpty, &poolMutex, &deadline );
+      if ( rc == ETIMEDOUT && count == 0 &&
+	   threads > poolConfig.minThreads && 2 * busy < threads ) {
+	// nothing to do for a while and the pool is mostly idle, retire
+	w->idleNs += nowNs() - idleStart;
+	w->running = 0;
+	threads--;
+	pthread_mutex_unlock( &poolMutex );
+	return NULL;
+      }
+    }
+
+    QueueEntry entry = queue[head];
+    head = ( head + 1 ) % poolConfig.queueSize;
+    count--;
+    pthread_cond_signal( &notFull );
+
+    long long start = nowNs();
+    w->idleNs += start - idleStart;
+    w->busy = 1;
+    busy++;
+    dispatched++;
+    waitNs += start - entry.queued;
+    pthread_mutex_unlock( &poolMutex );
+
+    poolHandler( entry.socket );
+
+    long long end = nowNs();
+    pthread_mutex_lock( &poolMutex );
+    w->busyNs += end - start;
+    w->served++;
+    w->busy = 0;
+    busy--;
+    idleStart = end;
+  }
+}
+
+// Print the pool statistics whenever SIGUSR1 arrives
+static void * statsMain( void * arg ) {
+  sigset_t * signals = (sigset_t *)arg;
+  int sig;
+
+  while ( sigwait( signals, &sig ) == 0 ) {
+    poolPrintStats( stderr );
+  }
+  return NULL;
+}
+
+void poolStart( void * (*handler)( int socket ) ) {
+  poolHandler = handler;
+
+  if ( poolConfig.minThreads < 1 ) {
+    poolConfig.minThreads = 1;
+  }
+  if ( poolConfig.maxThreads < poolConfig.minThreads ) {
+    poolConfig.maxThreads = poolConfig.minThreads;
+  }
+  if ( poolConfig.queueSize < 1 ) {
+    poolConfig.queueSize = 1;
+  }
+
+  workers = (Worker *)aligned_alloc( 64, poolConfig.maxThreads * sizeof(Worker) );
+  queue = (QueueEntry *)malloc( poolConfig.queueSize * sizeof(QueueEntry) );
+  if ( workers == NULL || queue == NULL ) {
+    perror( "malloc" );
+    exit( -1 );
+  }
+  memset( workers, 0, poolConfig.maxThreads * sizeof(Worker) );
+  startNs = nowNs();
+
+  // SIGUSR1 is handled by statsMain only; block it before any other
+  // thread is created so they all inherit the mask
+  static sigset_t signals;
+  sigemptyset( &signals );
+  sigaddset( &signals, SIGUSR1 );
+  pthread_sigmask( SIG_BLOCK, &signals, NULL );
+
+  pthread_t statsThread;
+  pthread_create( &statsThread, NULL, statsMain, &signals );
+  pthread_detach( statsThread );
+
+  pthread_mutex_lock( &poolMutex );
+  for ( int i = 0; i < poolConfig.minThreads; i++ ) {
+    startWorker();
+  }
+  pthread_mutex_unlock( &poolMutex );
+}
+
+// Queue an accepted connection, waiting for room if the queue is full
+void poolSubmit( int socket ) {
+  pthread_mutex_lock( &poolMutex );
+  while ( count == poolConfig.queueSize ) {
+    pthread_cond_wait( &notFull, &poolMutex );
+  }
+
+  QueueEntry * entry = &queue[( head + count ) % poolConfig.queueSize];
+  entry->socket = socket;
+  entry->queued = nowNs();
+  count++;
+
+  // grow when the backlog outnumbers the idle workers or
+  // three quarters of the pool are busy
+  int idle = threads - busy;
+  if ( threads < poolConfig.maxThreads &&
+       ( count > idle || 4 * busy >= 3 * threads ) ) {
+    startWorker();
+  }
+
+  pthread_cond_signal( &notEmpty );
+  pthread_mutex_unlock( &poolMutex );
+}
+
+// The pool's threads, the busy ones and the connections waiting in its
+// queue of size. Returns -1 if there is no pool.
+int poolCounts( int * live, int * working, int * waiting, int * size ) {
+  if ( queue == NULL ) {
+    return -1;
+  }
+  pthread_mutex_lock( &poolMutex );
+  *live = threads;
+  *working = busy;
+  *waiting = count;
+  *size = poolConfig.queueSize;
+  pthread_mutex_unlock( &poolMutex );
+  return 0;
+}
+
+void poolPrintStats( FILE * out ) {
+  pthread_mutex_lock( &poolMutex );
+
+  fprintf( out, "pool: %d threads (%d busy), min %d, max %d, "
+      "queue %d/%d, %ld dispatched, mean wait %.3f ms, up %.0f s\n",
+      threads, busy, poolConfig.minThreads, poolConfig.maxThreads,
+      count, poolConfig.queueSize, dispatched,
+      dispatched ? waitNs / 1e6 / dispatched : 0.0,
+      ( nowNs() - startNs ) / 1e9 );
+  fprintf( out, "%6s %4s %6s %10s %8s\n", "worker", "cpu", "state", "served", "busy%" );
+
+  for ( int i = 0; i < poolConfig.maxThreads; i++ ) {
+    Worker * w = &workers[i];
+    if ( !w->running && w->served == 0 ) {
+      continue;
+    }
+
+    long long total = w->busyNs + w->idleNs;
+    fprintf( out, "%6d %4d %6s %10ld %7.1f%%\n",
+	i, w->cpu,
+	!w->running ? "gone" : w->busy ? "busy" : "idle",
+	w->served,
+	total ? 100.0 * w->busyNs / total : 0.0 );
+  }
+
+  pthread_mutex_unlock( &poolMutex );
+}
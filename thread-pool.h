@@ -0,0 +1,25 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <pthread.h>
+#include <stdio.h>
+
+// Tunables of the -p worker pool, see poolSetDefaults()
+struct PoolConfig {
+  int minThreads;  // workers kept alive even when idle
+  int maxThreads;  // upper bound while the queue backs up
+  int queueSize;   // accepted connections waiting for a worker
+  int idleTimeout; // seconds before an idle worker above minThreads retires
+  int pin;         // pin worker slot i to cpu i % cores
+};
+
+extern PoolConfig poolConfig;
+
+void poolSetDefaults();
+void poolStart( void * (*handler)( int socket ) );
+void poolSubmit( int socket );
+int poolCounts( int * live, int * working, int * waiting, int * size );
+void poolPrintStats( FILE * out );
+int pinThread( pthread_attr_t * attr, int index );
+
+#endif
@@ -0,0 +1,913 @@
+//------------------------------------------------------------------------
+// io_uring event loop used by myhttpd -u.
+//
+// Works like the epoll reactors of event-loop.cc, one thread per core
+// with the same idle list, but instead of waiting for sockets to become
+// ready and then making the system calls itself, every thread queues the
+// operations on its own io_uring and only collects the results:
+//
+//  - one multishot accept on the shared listening socket, which is
+//    registered with the ring so the kernel doesn't look it up each time
+//  - one multishot recv per connection, filling buffers the ring was
+//    provided with; the data is copied into the Connection right away
+//    and the buffer handed back, so a few hundred serve every connection
+//  - the response as send/sendmsg operations, and files as a splice from
+//    the file into a pipe linked to a splice from the pipe to the socket
+//  - a POST body for a CGI script as plain recv operations into the body
+//    buffer alternating with writes to the script's stdin; the multishot
+//    recv is cancelled first so it can't read ahead of them
+//  - the script's output as reads from its stdout pipe alternating with
+//    sends to the socket, alongside the body; the pipes stay blocking,
+//    so the reads and writes wait in the kernel's worker threads
+//
+// The ring file descriptor is registered too, and io_uring_enter() both
+// submits what was queued and waits for completions, with the timeout of
+// the idle list. Opening and stat()ing the document is still done by
+// connectionRespond() as in every other mode; it needs the result to pick
+// between the cache, a mapping and the file.
+//
+// There is no liburing here, the rings are set up with the raw system
+// calls. Buffers are handed back with IORING_OP_PROVIDE_BUFFERS, riding
+// along with the next io_uring_enter(), rather than through a registered
+// buffer ring, which some kernels accept but then never take buffers
+// from. Where io_uring can't be set up (older kernels, or disabled with
+// the kernel.io_uring_disabled sysctl) runUringLoop() returns and the
+// caller falls back to epoll.
+//
+// Out of file descriptors, the multishot accept ends with the error. It
+// is queued again ACCEPT_RETRY_MS later, not at once, where it would
+// only fail again for as long as nothing is closed.
+//------------------------------------------------------------------------
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "admission.h"
+#include "file-cache.h"
+#include "file-map.h"
+#include "log.h"
+#include "metrics.h"
+#include "myhttpd.h"
+
+#define SQ_ENTRIES 256
+#define CQ_ENTRIES 4096
+#define BUFFERS 256           // provided receive buffers per ring
+#define BUFFER_SIZE 2048
+#define BUFFER_GROUP 0
+#define PIPE_CHUNK (64 * 1024) // what a pipe holds by default
+#define LISTEN_INDEX 0        // registered file of the listening socket
+#define ACCEPT_RETRY_MS 100
+
+// what a completion is for, kept in the low bits of its user_data
+enum {
+  OP_ACCEPT,
+  OP_PROVIDE,
+  OP_RECV,
+  OP_CANCEL,
+  OP_SEND_ENTRY,
+  OP_SEND_HEADER,
+  OP_SEND_MAP,
+  OP_SPLICE_IN,
+  OP_SPLICE_OUT,
+  OP_BODY_RECV,   // CGI operations from here on
+  OP_BODY_WRITE,
+  OP_CGI_READ,
+  OP_CGI_SEND
+};
+#define OP_MASK 15UL // malloc() aligns to 16 bytes
+
+struct Uring {
+  int fd;                    // ring, or its registered index
+  unsigned enterFlags;
+  unsigned queued;           // submission entries not submitted yet
+
+  unsigned * sqHead;
+  unsigned * sqTail;
+  unsigned * sqArray;
+  unsigned sqMask;
+  unsigned sqEntries;
+  struct io_uring_sqe * sqes;
+
+  unsigned * cqHead;
+  unsigned * cqTail;
+  unsigned cqMask;
+  struct io_uring_cqe * cqes;
+
+  char * bufferData;
+
+  IdleList idle;
+  long long acceptRetry;     // when to queue the accept again, 0 if it is queued
+  int outOfFiles;            // the accept last failed for want of descriptors
+};
+
+// A Connection and the operations in flight for it. It can only be
+// freed once the kernel has completed every one of them.
+struct UringConnection {
+  Connection c;              // first, the idle list links Connections
+  int pending;               // operations submitted and not completed
+  int writes;                // of those, sending the response
+  int receiving;             // the multishot recv is armed
+  int cancelled;             // and asked to stop
+  int closing;
+  int failed;                // sending the response failed
+  int bodyBusy;              // a recv or write of a request body is in flight
+  int outputBusy;            // a read or send of CGI output is in flight
+  int stopping;              // the body isn't needed, its operation is cancelled
+  int eof;                   // the client sends nothing more
+  int overflow;              // it pipelined more than the buffer holds
+  char * spill;              // what didn't fit, maybe a request body
+  int spilled;
+  struct iovec iov[3];       // a cached response being sent
+  struct msghdr msg;
+};
+
+static void serve( Uring * r, UringConnection * u );
+static void sendResponse( Uring * r, UringConnection * u );
+
+static long long nowMs() {
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static int uringEnter( Uring * r, unsigned wait, int timeout ) {
+  struct __kernel_timespec ts;
+  struct io_uring_getevents_arg arg;
+  memset( &arg, 0, sizeof(arg) );
+  if ( timeout >= 0 ) {
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = ( timeout % 1000 ) * 1000000L;
+    arg.ts = (unsigned long)&ts;
+  }
+
+  unsigned flags = r->enterFlags | IORING_ENTER_EXT_ARG |
+    ( wait > 0 ? IORING_ENTER_GETEVENTS : 0 );
+  int n = syscall( __NR_io_uring_enter, r->fd, r->queued, wait, flags,
+      &arg, sizeof(arg) );
+  if ( n >= 0 ) {
+    r->queued -= n;
+  }
+  return n;
+}
+
+// Make sure count submission entries are free, submitting what is
+// queued if they aren't
+static void reserve( Uring * r, unsigned count ) {
+  while ( *r->sqTail + count -
+	  __atomic_load_n( r->sqHead, __ATOMIC_ACQUIRE ) > r->sqEntries ) {
+    if ( uringEnter( r, 0, -1 ) < 0 && errno != EINTR && errno != EAGAIN ) {
+      perror( "io_uring_enter" );
+      exit( -1 );
+    }
+  }
+}
+
+// Queue an operation; it is submitted by the next uringEnter()
+static struct io_uring_sqe * prepare( Uring * r, int opcode, int fd,
+    UringConnection * u, int op ) {
+  reserve( r, 1 );
+
+  unsigned tail = *r->sqTail;
+  unsigned index = tail & r->sqMask;
+  struct io_uring_sqe * sqe = &r->sqes[index];
+  memset( sqe, 0, sizeof(*sqe) );
+  sqe->opcode = opcode;
+  sqe->fd = fd;
+  sqe->user_data = (unsigned long)u | op;
+
+  r->sqArray[index] = index;
+  __atomic_store_n( r->sqTail, tail + 1, __ATOMIC_RELEASE );
+  r->queued++;
+
+  if ( u != NULL ) {
+    u->pending++;
+  }
+  return sqe;
+}
+
+static void acceptAll( Uring * r ) {
+  struct io_uring_sqe * sqe = prepare( r, IORING_OP_ACCEPT, LISTEN_INDEX, NULL, OP_ACCEPT );
+  sqe->flags = IOSQE_FIXED_FILE;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_CLOEXEC;
+}
+
+static void receive( Uring * r, UringConnection * u ) {
+  struct io_uring_sqe * sqe = prepare( r, IORING_OP_RECV, u->c.socket, u, OP_RECV );
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = BUFFER_GROUP;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  u->receiving = 1;
+}
+
+// Hand receive buffers back to the kernel. Only a failure completes.
+static void provide( Uring * r, int id, int count ) {
+  struct io_uring_sqe * sqe = prepare( r, IORING_OP_PROVIDE_BUFFERS, count, NULL, OP_PROVIDE );
+  sqe->addr = (unsigned long)( r->bufferData + id * BUFFER_SIZE );
+  sqe->len = BUFFER_SIZE;
+  sqe->off = id;
+  sqe->buf_group = BUFFER_GROUP;
+  sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+}
+
+// Start closing a connection. It is freed once nothing is in flight
+// for it anymore, so this is called again for every late completion.
+static void uringClose( Uring * r, UringConnection * u ) {
+  if ( !u->closing ) {
+    u->closing = 1;
+    idleRemove( &r->idle, &u->c );
+    int stuck = u->writes > 0 || u->bodyBusy || u->outputBusy;
+
+    if ( u->receiving ) {
+      struct io_uring_sqe * sqe = prepare( r, IORING_OP_ASYNC_CANCEL, -1, u, OP_CANCEL );
+      sqe->addr = (unsigned long)u | OP_RECV;
+    }
+    // a write the script isn't reading doesn't end on its own, nor a
+    // read of output it doesn't write
+    if ( u->bodyBusy ) {
+      struct io_uring_sqe * sqe = prepare( r, IORING_OP_ASYNC_CANCEL, -1, u, OP_CANCEL );
+      sqe->addr = (unsigned long)u | OP_BODY_WRITE;
+    }
+    if ( u->outputBusy ) {
+      struct io_uring_sqe * sqe = prepare( r, IORING_OP_ASYNC_CANCEL, -1, u, OP_CANCEL );
+      sqe->addr = (unsigned long)u | OP_CGI_READ;
+    }
+    // wakes up a send waiting for room, and a recv of the body. A
+    // connection that is merely done gets its lingering close instead,
+    // a shut down read side would reset it when more input comes.
+    if ( stuck ) {
+      shutdown( u->c.socket, SHUT_RDWR );
+    }
+  }
+
+  if ( u->pending == 0 ) {
+    connectionClose( &u->c );
+    free( u->spill );
+    free( u );
+  }
+}
+
+// Queue the next recv or write of a request body on its way to a CGI
+// script's stdin, what connectionBody() does with system calls
+static void pumpBody( Uring * r, UringConnection * u ) {
+  Connection * c = &u->c;
+  struct io_uring_sqe * sqe;
+  char * data;
+  int length;
+
+  // wait for the multishot recv's last completion, received() adds what
+  // it read ahead to the body
+  if ( u->receiving ) {
+    if ( !u->cancelled ) {
+      sqe = prepare( r, IORING_OP_ASYNC_CANCEL, -1, u, OP_CANCEL );
+      sqe->addr = (unsigned long)u | OP_RECV;
+      u->cancelled = 1;
+    }
+    return;
+  }
+
+  switch ( bodyNext( &c->body, &data, &length ) ) {
+  case BODY_DATA:
+    sqe = prepare( r, IORING_OP_WRITE, c->cgiIn, u, OP_BODY_WRITE );
+    sqe->addr = (unsigned long)data;
+    sqe->len = length;
+    sqe->off = (unsigned long)-1;
+    u->bodyBusy = 1;
+    break;
+
+  case BODY_MORE:
+    if ( u->eof ) {
+      uringClose( r, u );
+      return;
+    }
+    data = bodySpace( &c->body, &length );
+    sqe = prepare( r, IORING_OP_RECV, c->socket, u, OP_BODY_RECV );
+    sqe->addr = (unsigned long)data;
+    sqe->len = length;
+    u->bodyBusy = 1;
+    break;
+
+  case BODY_END:
+    // the script sees the end of its input, and the next request may
+    // come in while its output is still being sent
+    close( c->cgiIn );
+    c->cgiIn = -1;
+    connectionBodyEnd( c );
+    if ( !u->eof ) {
+      u->cancelled = 0;
+      receive( r, u );
+    }
+    break;
+
+  default:
+    LOG( LOG_INFO, "malformed or too large request body" );
+    uringClose( r, u );
+  }
+}
+
+// Queue the next read of a CGI script's output, or send of what was read
+static void pumpOutput( Uring * r, UringConnection * u ) {
+  Connection * c = &u->c;
+  struct io_uring_sqe * sqe;
+  char * data;
+  int space;
+
+  int pending = cgiOutputPending( &c->output, &data );
+  if ( pending > 0 ) {
+    sqe = prepare( r, IORING_OP_SEND, c->socket, u, OP_CGI_SEND );
+    sqe->addr = (unsigned long)data;
+    sqe->len = pending;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    u->outputBusy = 1;
+  } else if ( cgiOutputDone( &c->output ) ) {
+    cgiOutputFree( &c->output );
+  } else {
+    data = cgiOutputSpace( &c->output, &space );
+    sqe = prepare( r, IORING_OP_READ, c->cgiOut, u, OP_CGI_READ );
+    sqe->addr = (unsigned long)data;
+    sqe->len = space;
+    sqe->off = (unsigned long)-1;
+    u->outputBusy = 1;
+  }
+}
+
+// Keep a CGI script's request body and output moving, what
+// connectionCgi() does with system calls. The response is done once
+// both are and nothing is in flight for either.
+static void pumpCgi( Uring * r, UringConnection * u ) {
+  Connection * c = &u->c;
+
+  if ( c->output.buffer != NULL && !u->outputBusy ) {
+    pumpOutput( r, u );
+  }
+
+  if ( c->body.buffer != NULL && c->output.buffer == NULL && !u->stopping ) {
+    // the script is done without reading all of the body
+    u->stopping = 1;
+    if ( u->bodyBusy ) {
+      struct io_uring_sqe * sqe = prepare( r, IORING_OP_ASYNC_CANCEL, -1, u, OP_CANCEL );
+      sqe->addr = (unsigned long)u | OP_BODY_RECV;
+      sqe = prepare( r, IORING_OP_ASYNC_CANCEL, -1, u, OP_CANCEL );
+      sqe->addr = (unsigned long)u | OP_BODY_WRITE;
+    }
+  }
+  if ( c->body.buffer != NULL && !u->bodyBusy && u->stopping ) {
+    // the rest of it is left unread on the connection
+    close( c->cgiIn );
+    c->cgiIn = -1;
+    bodyFree( &c->body );
+    c->keepAlive = 0;
+    u->stopping = 0;
+  } else if ( c->body.buffer != NULL && !u->bodyBusy ) {
+    pumpBody( r, u );
+  }
+
+  if ( !u->closing && c->body.buffer == NULL && c->output.buffer == NULL &&
+       !u->bodyBusy && !u->outputBusy ) {
+    sendResponse( r, u );
+  }
+}
+
+// Queue the next part of the response, the same steps connectionWrite()
+// takes with system calls
+static void sendResponse( Uring * r, UringConnection * u ) {
+  Connection * c = &u->c;
+  struct io_uring_sqe * sqe;
+
+  if ( c->body.buffer != NULL || c->output.buffer != NULL ) {
+    pumpCgi( r, u );
+    return;
+  }
+
+  if ( c->entry != NULL ) {
+    int count = connectionCachedIov( c, u->iov );
+    if ( count > 0 ) {
+      memset( &u->msg, 0, sizeof(u->msg) );
+      u->msg.msg_iov = u->iov;
+      u->msg.msg_iovlen = count;
+      sqe = prepare( r, IORING_OP_SENDMSG, c->socket, u, OP_SEND_ENTRY );
+      sqe->addr = (unsigned long)&u->msg;
+      sqe->len = 1;
+      sqe->msg_flags = MSG_NOSIGNAL;
+      u->writes++;
+      return;
+    }
+    cacheRelease( c->entry );
+    c->entry = NULL;
+  }
+
+  if ( c->headerSent < c->headerLength ) {
+    sqe = prepare( r, IORING_OP_SEND, c->socket, u, OP_SEND_HEADER );
+    sqe->addr = (unsigned long)( c->header + c->headerSent );
+    sqe->len = c->headerLength - c->headerSent;
+    sqe->msg_flags = MSG_NOSIGNAL | ( c->fileRemaining > 0 ? MSG_MORE : 0 );
+    u->writes++;
+
+  } else if ( c->piped > 0 ) {
+    // flush what the last splice left in the pipe
+    sqe = prepare( r, IORING_OP_SPLICE, c->socket, u, OP_SPLICE_OUT );
+    sqe->splice_fd_in = c->pipe[0];
+    sqe->splice_off_in = (unsigned long)-1;
+    sqe->off = (unsigned long)-1;
+    sqe->len = c->piped;
+    sqe->splice_flags = SPLICE_F_MOVE | SPLICE_F_NONBLOCK;
+    u->writes++;
+
+  } else if ( c->map != NULL && c->fileRemaining > 0 ) {
+    sqe = prepare( r, IORING_OP_SEND, c->socket, u, OP_SEND_MAP );
+    sqe->addr = (unsigned long)( c->map->data + c->fileOffset );
+    sqe->len = c->fileRemaining < SENDFILE_CHUNK ? c->fileRemaining : SENDFILE_CHUNK;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    u->writes++;
+
+  } else if ( c->fd != -1 && c->fileRemaining > 0 ) {
+    // a blocking pipe, the splices run in the kernel's worker threads.
+    // The second one doesn't wait for an empty pipe, in case the first
+    // one found the file shrunk.
+    if ( c->pipe[0] == -1 && pipe2( c->pipe, O_CLOEXEC ) < 0 ) {
+      uringClose( r, u );
+      return;
+    }
+    unsigned chunk = c->fileRemaining < PIPE_CHUNK ? c->fileRemaining : PIPE_CHUNK;
+
+    reserve( r, 2 );
+    sqe = prepare( r, IORING_OP_SPLICE, c->pipe[1], u, OP_SPLICE_IN );
+    sqe->splice_fd_in = c->fd;
+    sqe->splice_off_in = c->fileOffset;
+    sqe->off = (unsigned long)-1;
+    sqe->len = chunk;
+    sqe->splice_flags = SPLICE_F_MOVE;
+    sqe->flags = IOSQE_IO_LINK;
+
+    sqe = prepare( r, IORING_OP_SPLICE, c->socket, u, OP_SPLICE_OUT );
+    sqe->splice_fd_in = c->pipe[0];
+    sqe->splice_off_in = (unsigned long)-1;
+    sqe->off = (unsigned long)-1;
+    sqe->len = chunk;
+    sqe->splice_flags = SPLICE_F_MOVE | SPLICE_F_NONBLOCK;
+    u->writes += 2;
+
+  } else if ( connectionNextPart( c ) ) {
+    // the next part of a multipart/byteranges body
+    sendResponse( r, u );
+
+  } else {
+    // all sent, connectionWrite() only closes the file and logs
+    if ( connectionWrite( c ) == IO_CLOSE || connectionNext( c ) == IO_CLOSE ||
+	 u->overflow ) {
+      uringClose( r, u );
+      return;
+    }
+    serve( r, u );
+  }
+}
+
+// Serve the next buffered request, if it has arrived completely
+static void serve( Uring * r, UringConnection * u ) {
+  Connection * c = &u->c;
+
+  if ( connectionParse( c ) == IO_AGAIN ) {
+    if ( u->eof ) {
+      uringClose( r, u );
+    }
+    return;
+  }
+
+  if ( connectionRespond( c ) == IO_CLOSE ) {
+    uringClose( r, u );
+    return;
+  }
+  c->state = CONN_WRITING;
+
+  // a request body goes on past the message buffer
+  if ( u->spill != NULL ) {
+    if ( c->body.buffer != NULL && bodyReserve( &c->body, u->spilled ) == 0 ) {
+      memcpy( c->body.buffer + c->body.end, u->spill, u->spilled );
+      bodyReceived( &c->body, u->spilled );
+      u->overflow = 0;
+    }
+    free( u->spill );
+    u->spill = NULL;
+  }
+  sendResponse( r, u );
+}
+
+static void accepted( Uring * r, struct io_uring_cqe * cqe ) {
+  int res = cqe->res;
+  if ( res == -EMFILE || res == -ENFILE || res == -ENOBUFS || res == -ENOMEM ) {
+    // leave the accept unqueued for a while rather than fail at once again
+    if ( !r->outOfFiles ) {
+      LOG( LOG_WARN, "accept: %s, waiting for connections to close", strerror(-res) );
+      r->outOfFiles = 1;
+    }
+    if ( !( cqe->flags & IORING_CQE_F_MORE ) ) {
+      r->acceptRetry = nowMs() + ACCEPT_RETRY_MS;
+    }
+    return;
+  }
+  if ( !( cqe->flags & IORING_CQE_F_MORE ) ) {
+    // the multishot accept ended, on an error or a full completion queue
+    acceptAll( r );
+  }
+  if ( cqe->res < 0 ) {
+    if ( cqe->res != -ECONNABORTED && cqe->res != -EINTR ) {
+      LOG( LOG_ERROR, "accept: %s", strerror(-cqe->res) );
+    }
+    return;
+  }
+  r->outOfFiles = 0;
+
+  metricsAccepted( cqe->res );
+  if ( !admissionEnter( cqe->res ) ) {
+    return;
+  }
+
+  UringConnection * u = (UringConnection *)malloc( sizeof(UringConnection) );
+  if ( u == NULL ) {
+    admissionLeave();
+    admissionReject( cqe->res );
+    return;
+  }
+  memset( u, 0, sizeof(*u) );
+  connectionInit( &u->c, cqe->res );
+  idleAppend( &r->idle, &u->c );
+  receive( r, u );
+}
+
+static void received( Uring * r, UringConnection * u, struct io_uring_cqe * cqe ) {
+  Connection * c = &u->c;
+
+  if ( !( cqe->flags & IORING_CQE_F_MORE ) ) {
+    u->receiving = 0;
+  }
+
+  if ( cqe->flags & IORING_CQE_F_BUFFER && c->body.buffer != NULL ) {
+    // read ahead of a request body before the recv could be stopped
+    int id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    if ( bodyReserve( &c->body, cqe->res ) < 0 ) {
+      u->eof = 1;
+    } else {
+      memcpy( c->body.buffer + c->body.end, r->bufferData + id * BUFFER_SIZE, cqe->res );
+      bodyReceived( &c->body, cqe->res );
+    }
+    provide( r, id, 1 );
+  } else if ( cqe->flags & IORING_CQE_F_BUFFER ) {
+    int id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    int n = cqe->res;
+    if ( n > MAX_MESSAGE - c->received ) {
+      n = MAX_MESSAGE - c->received;
+      u->overflow = 1;
+      if ( u->spill == NULL && (u->spill = (char *)malloc( cqe->res - n )) != NULL ) {
+	memcpy( u->spill, r->bufferData + id * BUFFER_SIZE + n, cqe->res - n );
+	u->spilled = cqe->res - n;
+      }
+    }
+    if ( n > 0 ) {
+      memcpy( c->message + c->received, r->bufferData + id * BUFFER_SIZE, n );
+      c->received += n;
+      c->message[c->received] = '\0';
+    }
+    provide( r, id, 1 );
+  } else if ( cqe->res == 0 ) {
+    LOG( LOG_DEBUG, "client disconnected" );
+    u->eof = 1;
+  } else if ( cqe->res != -ENOBUFS && cqe->res != -ECANCELED ) {
+    LOG( LOG_WARN, "recv error: %s", strerror(-cqe->res) );
+    u->eof = 1;
+  }
+
+  if ( !u->receiving && !u->eof && c->body.buffer == NULL ) {
+    // ran out of buffers, or the kernel ended it for another reason
+    receive( r, u );
+  }
+
+  idleRemove( &r->idle, c );
+  idleAppend( &r->idle, c );
+
+  // while the response is being sent, pipelined requests just queue up
+  if ( c->state == CONN_READING ) {
+    serve( r, u );
+  } else if ( c->body.buffer != NULL && !u->receiving ) {
+    // the body can go on now that the recv has stopped
+    pumpCgi( r, u );
+  }
+}
+
+// A request body operation or CGI output operation completed
+static void cgiCompleted( Uring * r, UringConnection * u, int op, int result ) {
+  Connection * c = &u->c;
+
+  switch ( op ) {
+  case OP_BODY_RECV:
+  case OP_BODY_WRITE:
+    u->bodyBusy = 0;
+    if ( u->stopping ) {
+      // pumpCgi() drops the body
+      break;
+    }
+    if ( op == OP_BODY_WRITE && result == -EPIPE ) {
+      // the script closed its stdin, its output is the answer
+      u->stopping = 1;
+      break;
+    }
+    if ( result <= 0 ) {
+      uringClose( r, u );
+      return;
+    }
+    if ( op == OP_BODY_RECV ) {
+      bodyReceived( &c->body, result );
+    } else {
+      bodyConsumed( &c->body, result );
+    }
+    break;
+
+  case OP_CGI_READ:
+    u->outputBusy = 0;
+    if ( result < 0 ) {
+      uringClose( r, u );
+      return;
+    }
+    connectionCgiRead( c, result );
+    break;
+
+  case OP_CGI_SEND:
+    u->outputBusy = 0;
+    if ( result <= 0 ) {
+      uringClose( r, u );
+      return;
+    }
+    cgiOutputSent( &c->output, result );
+    break;
+  }
+
+  idleRemove( &r->idle, c );
+  idleAppend( &r->idle, c );
+  pumpCgi( r, u );
+}
+
+static void sent( Uring * r, UringConnection * u, int op, int result ) {
+  Connection * c = &u->c;
+  u->writes--;
+
+  if ( op == OP_SPLICE_OUT && result == -ECANCELED ) {
+    // the splice into the pipe came up short, which breaks the link;
+    // what it moved is flushed next
+    result = 0;
+  } else if ( result <= 0 ) {
+    // a splice into the pipe reading nothing means the file shrank
+    // under us, the Content-Length can't be met
+    u->failed = 1;
+    result = 0;
+  }
+
+  switch ( op ) {
+  case OP_SEND_ENTRY:
+    c->entrySent += result;
+    break;
+  case OP_SEND_HEADER:
+    c->headerSent += result;
+    break;
+  case OP_SEND_MAP:
+    mapAdvise( c->map, c->fileOffset, c->fileOffset + result );
+    c->fileOffset += result;
+    c->fileRemaining -= result;
+    break;
+  case OP_SPLICE_IN:
+    c->fileOffset += result;
+    c->fileRemaining -= result;
+    c->piped += result;
+    break;
+  case OP_SPLICE_OUT:
+    c->piped -= result;
+    break;
+  }
+
+  if ( u->writes > 0 ) {
+    return;
+  }
+  if ( u->failed ) {
+    uringClose( r, u );
+    return;
+  }
+
+  idleRemove( &r->idle, c );
+  idleAppend( &r->idle, c );
+  sendResponse( r, u );
+}
+
+static void complete( Uring * r, struct io_uring_cqe * cqe ) {
+  int op = cqe->user_data & OP_MASK;
+  UringConnection * u = (UringConnection *)( cqe->user_data & ~OP_MASK );
+
+  if ( op == OP_ACCEPT ) {
+    accepted( r, cqe );
+    return;
+  }
+  if ( op == OP_PROVIDE ) {
+    LOG( LOG_ERROR, "io_uring provide buffers: %s", strerror(-cqe->res) );
+    return;
+  }
+
+  if ( !( cqe->flags & IORING_CQE_F_MORE ) ) {
+    u->pending--;
+  }
+
+  if ( u->closing ) {
+    // only waiting for it to finish
+    if ( cqe->flags & IORING_CQE_F_BUFFER ) {
+      provide( r, cqe->flags >> IORING_CQE_BUFFER_SHIFT, 1 );
+    }
+    uringClose( r, u );
+  } else if ( op == OP_RECV ) {
+    received( r, u, cqe );
+  } else if ( op == OP_CANCEL ) {
+    // the operation it stopped reports that itself
+  } else if ( op >= OP_BODY_RECV ) {
+    cgiCompleted( r, u, op, cqe->res );
+  } else {
+    sent( r, u, op, cqe->res );
+  }
+}
+
+static void * mapRing( int fd, size_t size, off_t offset ) {
+  void * p = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+      fd, offset );
+  if ( p == MAP_FAILED ) {
+    perror( "mmap" );
+    exit( -1 );
+  }
+  return p;
+}
+
+// Set up a ring for the calling thread. Returns -1 if this kernel can't
+// do what the loop needs.
+static int uringCreate( Uring * r, int masterSocket ) {
+  struct io_uring_params p;
+  memset( &p, 0, sizeof(p) );
+  // only this thread submits, and completions are processed when it
+  // asks for them instead of interrupting it
+  p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN |
+    IORING_SETUP_CQSIZE;
+  p.cq_entries = CQ_ENTRIES;
+
+  int fd = syscall( __NR_io_uring_setup, SQ_ENTRIES, &p );
+  if ( fd < 0 ) {
+    LOG( LOG_WARN, "io_uring_setup: %s", strerror(errno) );
+    return -1;
+  }
+  if ( !( p.features & IORING_FEAT_EXT_ARG ) ||
+       syscall( __NR_io_uring_register, fd, IORING_REGISTER_FILES, &masterSocket, 1 ) < 0 ) {
+    LOG( LOG_WARN, "io_uring: kernel too old" );
+    close( fd );
+    return -1;
+  }
+
+  size_t sqSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  size_t cqSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  char * sq;
+  char * cq;
+  if ( p.features & IORING_FEAT_SINGLE_MMAP ) {
+    sq = cq = (char *)mapRing( fd, sqSize > cqSize ? sqSize : cqSize, IORING_OFF_SQ_RING );
+  } else {
+    sq = (char *)mapRing( fd, sqSize, IORING_OFF_SQ_RING );
+    cq = (char *)mapRing( fd, cqSize, IORING_OFF_CQ_RING );
+  }
+
+  r->sqHead = (unsigned *)( sq + p.sq_off.head );
+  r->sqTail = (unsigned *)( sq + p.sq_off.tail );
+  r->sqArray = (unsigned *)( sq + p.sq_off.array );
+  r->sqMask = *(unsigned *)( sq + p.sq_off.ring_mask );
+  r->sqEntries = p.sq_entries;
+  r->sqes = (struct io_uring_sqe *)mapRing( fd,
+      p.sq_entries * sizeof(struct io_uring_sqe), IORING_OFF_SQES );
+
+  r->cqHead = (unsigned *)( cq + p.cq_off.head );
+  r->cqTail = (unsigned *)( cq + p.cq_off.tail );
+  r->cqMask = *(unsigned *)( cq + p.cq_off.ring_mask );
+  r->cqes = (struct io_uring_cqe *)( cq + p.cq_off.cqes );
+
+  r->fd = fd;
+  r->enterFlags = 0;
+  r->queued = 0;
+
+  // io_uring_enter() then skips looking up the ring's file descriptor
+  struct io_uring_rsrc_update update;
+  memset( &update, 0, sizeof(update) );
+  update.offset = -1U;
+  update.data = fd;
+  if ( syscall( __NR_io_uring_register, fd, IORING_REGISTER_RING_FDS, &update, 1 ) == 1 ) {
+    r->fd = update.offset;
+    r->enterFlags = IORING_ENTER_REGISTERED_RING;
+  }
+
+  r->bufferData = (char *)malloc( BUFFERS * BUFFER_SIZE );
+  if ( r->bufferData == NULL ) {
+    perror( "malloc" );
+    exit( -1 );
+  }
+  provide( r, 0, BUFFERS );
+
+  r->idle.head = NULL;
+  r->idle.tail = NULL;
+  r->acceptRetry = 0;
+  r->outOfFiles = 0;
+  return 0;
+}
+
+static void uringMain( Uring * r ) {
+  acceptAll( r );
+
+  while ( 1 ) {
+    int timeout;
+    Connection * c;
+    while ( (c = idleExpired( &r->idle, &timeout )) != NULL ) {
+      // one waiting for a CGI script is left to the script's timeout
+      if ( c->output.buffer != NULL ) {
+	idleRemove( &r->idle, c );
+	idleAppend( &r->idle, c );
+      } else {
+	uringClose( r, (UringConnection *)c );
+      }
+    }
+
+    if ( r->acceptRetry != 0 ) {
+      long long left = r->acceptRetry - nowMs();
+      if ( left <= 0 ) {
+	r->acceptRetry = 0;
+	acceptAll( r );
+      } else if ( timeout < 0 || left < timeout ) {
+	timeout = (int)left;
+      }
+    }
+
+    if ( uringEnter( r, 1, timeout ) < 0 && errno != EINTR && errno != ETIME &&
+	 errno != EAGAIN && errno != EBUSY ) {
+      perror( "io_uring_enter" );
+      exit( -1 );
+    }
+
+    unsigned head = *r->cqHead;
+    while ( head != __atomic_load_n( r->cqTail, __ATOMIC_ACQUIRE ) ) {
+      struct io_uring_cqe cqe = r->cqes[head & r->cqMask];
+      head++;
+      __atomic_store_n( r->cqHead, head, __ATOMIC_RELEASE );
+      complete( r, &cqe );
+    }
+  }
+}
+
+static void * uringThread( void * masterSocketDescriptor ) {
+  Uring ring;
+  if ( uringCreate( &ring, *(int *)masterSocketDescriptor ) < 0 ) {
+    exit( -1 );
+  }
+  uringMain( &ring );
+  return NULL;
+}
+
+// Serve requests from one ring per core. Only returns if io_uring isn't
+// available, before anything has been started.
+void runUringLoop( int masterSocket ) {
+  // the main thread's ring tells whether the kernel is up to it
+  static Uring ring;
+  if ( uringCreate( &ring, masterSocket ) < 0 ) {
+    return;
+  }
+
+  // a splice to a socket the client reset raises SIGPIPE
+  signal( SIGPIPE, SIG_IGN );
+
+  static int masterSock;
+  masterSock = masterSocket;
+
+  long cores = sysconf( _SC_NPROCESSORS_ONLN );
+  if ( cores < 1 ) {
+    cores = 1;
+  }
+
+  LOG( LOG_INFO, "starting %ld io_uring threads", cores );
+  for ( long i = 1; i < cores; i++ ) {
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    if ( pthread_create( &thread, &attr, uringThread, (void *)&masterSock ) != 0 ) {
+      perror( "pthread_create" );
+      exit( -1 );
+    }
+  }
+
+  uringMain( &ring );
+}
@@ -0,0 +1,96 @@
+//------------------------------------------------------------------------
+// Work-stealing deque, after Chase and Lev, with the memory orderings
+// of Le et al., "Correct and Efficient Work-Stealing for Weak Memory
+// Models" (PPoPP 2013).
+//
+// The owner treats its end as a stack: what it pushed last it pops
+// first, while the data is still warm in its cache. Thieves take the
+// oldest item from the other end. Only when a single item is left do
+// the owner and a thief race for it, and a compare-and-swap on top
+// settles who gets it. Nobody ever waits for a lock.
+//
+// The array doesn't grow. A push onto a full deque fails and the owner
+// runs the item itself, which with a deque per thread of a few thousand
+// items only happens when a thread is far behind anyway.
+//------------------------------------------------------------------------
+
+#include <stdlib.h>
+
+#include "work-deque.h"
+
+// Set up an empty deque, capacity rounded up to a power of two.
+// Returns -1 if out of memory.
+int dequeInit( WorkDeque * d, int capacity ) {
+  long size = 1;
+  while ( size < capacity ) {
+    size *= 2;
+  }
+  d->top = 0;
+  d->bottom = 0;
+  d->mask = size - 1;
+  d->items = (void **)calloc( size, sizeof(void *) );
+  return d->items == NULL ? -1 : 0;
+}
+
+// Add an item at the owner's end. Owner only. Returns -1 if full.
+int dequePush( WorkDeque * d, void * item ) {
+  long b = __atomic_load_n( &d->bottom, __ATOMIC_RELAXED );
+  long t = __atomic_load_n( &d->top, __ATOMIC_ACQUIRE );
+  if ( b - t > d->mask ) {
+    return -1;
+  }
+  __atomic_store_n( &d->items[b & d->mask], item, __ATOMIC_RELAXED );
+  // a thief that sees the new bottom sees the item too
+  __atomic_thread_fence( __ATOMIC_RELEASE );
+  __atomic_store_n( &d->bottom, b + 1, __ATOMIC_RELAXED );
+  return 0;
+}
+
+// Take the item pushed last. Owner only. Returns NULL if there is none.
+void * dequePop( WorkDeque * d ) {
+  long b = __atomic_load_n( &d->bottom, __ATOMIC_RELAXED ) - 1;
+  __atomic_store_n( &d->bottom, b, __ATOMIC_RELAXED );
+  // thieves must see the smaller bottom before top is read
+  __atomic_thread_fence( __ATOMIC_SEQ_CST );
+  long t = __atomic_load_n( &d->top, __ATOMIC_RELAXED );
+
+  void * item = NULL;
+  if ( t <= b ) {
+    item = __atomic_load_n( &d->items[b & d->mask], __ATOMIC_RELAXED );
+    if ( t == b ) {
+      // the last one, a thief may be after it as well
+      if ( !__atomic_compare_exchange_n( &d->top, &t, t + 1, 0,
+	     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED ) ) {
+	item = NULL;
+      }
+      __atomic_store_n( &d->bottom, b + 1, __ATOMIC_RELAXED );
+    }
+  } else {
+    __atomic_store_n( &d->bottom, b + 1, __ATOMIC_RELAXED );
+  }
+  return item;
+}
+
+// Take the oldest item. Any thread. Returns NULL if there is none, or
+// if another thread got it first.
+void * dequeSteal( WorkDeque * d ) {
+  long t = __atomic_load_n( &d->top, __ATOMIC_ACQUIRE );
+  __atomic_thread_fence( __ATOMIC_SEQ_CST );
+  long b = __atomic_load_n( &d->bottom, __ATOMIC_ACQUIRE );
+  if ( t >= b ) {
+    return NULL;
+  }
+  void * item = __atomic_load_n( &d->items[t & d->mask], __ATOMIC_RELAXED );
+  if ( !__atomic_compare_exchange_n( &d->top, &t, t + 1, 0,
+	 __ATOMIC_SEQ_CST, __ATOMIC_RELAXED ) ) {
+    return NULL;
+  }
+  return item;
+}
+
+// Items in the deque, a snapshot that may be out of date at once
+long dequeSize( WorkDeque * d ) {
+  long b = __atomic_load_n( &d->bottom, __ATOMIC_RELAXED );
+  long t = __atomic_load_n( &d->top, __ATOMIC_RELAXED );
+  return b > t ? b - t : 0;
+}
@@ -0,0 +1,20 @@
+#ifndef WORK_DEQUE_H
+#define WORK_DEQUE_H
+
+// A Chase-Lev work-stealing deque of a fixed size. One owner thread
+// pushes and pops at the bottom, any thread may steal from the top.
+struct WorkDeque {
+  long top;      // next to be stolen, only ever grows
+  char pad[56];  // keep the thieves' line apart from the owner's
+  long bottom;   // next free slot, moved by the owner
+  long mask;     // capacity - 1
+  void ** items;
+};
+
+int dequeInit( WorkDeque * d, int capacity );
+int dequePush( WorkDeque * d, void * item );
+void * dequePop( WorkDeque * d );
+void * dequeSteal( WorkDeque * d );
+long dequeSize( WorkDeque * d );
+
+#endif